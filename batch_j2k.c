@@ -0,0 +1,151 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "main.h"
+#include "write_j2k.h"
+#include "batch_j2k.h"
+
+
+struct Batch_Encoder
+{
+   GThreadPool    *pool;
+   Save_Parameters params;       // Per encode : num_threads is the worker's share.
+   Batch_Result   *results;
+   int             num_workers;
+
+   GMutex lock;
+   GCond  started;
+   guint  waiting;               // Submitted, not yet picked up by a worker. Guarded by lock.
+};
+
+
+typedef struct
+{
+   guint       index;
+   Image_Info  image;
+   gchar      *filename;
+
+} Batch_Job;
+
+
+static void batch_job(gpointer data, gpointer user_data)
+{
+   Batch_Job *job = (Batch_Job *) data;
+   Batch_Encoder *batch = (Batch_Encoder *) user_data;
+   Batch_Result *result = &batch->results[job->index];
+   gint64 start = g_get_monotonic_time();
+   GStatBuf st;
+   FILE *f;
+
+   g_mutex_lock(&batch->lock);
+   batch->waiting--;
+   g_cond_signal(&batch->started);
+   g_mutex_unlock(&batch->lock);
+
+   f = g_fopen(job->filename, "wb");
+
+   if (f)
+   {
+      result->ok = serialize_image_to_file(&job->image, &batch->params, true, f);
+
+      if (fclose(f))
+         result->ok = false;
+
+      // A failed encode leaves no truncated file behind.
+      if (!result->ok)
+         g_remove(job->filename);
+   }
+   else
+      fprintf(stderr, "Could not open file for writing : %s\n", job->filename);
+
+   if (result->ok && !g_stat(job->filename, &st))
+      result->size = st.st_size;
+
+   result->encode_time = (g_get_monotonic_time() - start) / (gdouble) G_USEC_PER_SEC;
+
+   g_free(job->image.data);
+   g_free(job->filename);
+   g_free(job);
+}
+
+
+Batch_Encoder *Batch_New(const Save_Parameters *params, int num_workers, Batch_Result *results)
+{
+   Batch_Encoder *batch = g_new0(Batch_Encoder, 1);
+   int total_threads = Encoder_NumThreads(params);
+
+   if (num_workers <= 0)
+      num_workers = opj_get_num_cpus();
+
+   batch->num_workers = MAX(1, num_workers);
+   batch->results = results;
+   batch->params = *params;
+   batch->params.num_threads = MAX(1, total_threads / batch->num_workers);
+
+   g_mutex_init(&batch->lock);
+   g_cond_init(&batch->started);
+
+   batch->pool = g_thread_pool_new(batch_job, batch, batch->num_workers, TRUE, nullptr);
+
+   return batch;
+}
+
+
+void Batch_Submit(Batch_Encoder *batch, guint index, const Image_Info *image, const char *filename)
+{
+   Batch_Job *job = g_new0(Batch_Job, 1);
+
+   job->index = index;
+   job->image = *image;
+   job->image.fetch = nullptr;
+   job->image.cancel = nullptr;
+   job->filename = g_strdup(filename);
+
+   memset(&batch->results[index], 0, sizeof(Batch_Result));
+
+   // Holds the caller back while every worker already has its next image queued.
+   g_mutex_lock(&batch->lock);
+
+   while (batch->waiting >= (guint) batch->num_workers)
+      g_cond_wait(&batch->started, &batch->lock);
+
+   batch->waiting++;
+
+   g_mutex_unlock(&batch->lock);
+
+   g_thread_pool_push(batch->pool, job, nullptr);
+}
+
+
+void Batch_Finish(Batch_Encoder *batch)
+{
+   // Waits for every queued job.
+   g_thread_pool_free(batch->pool, FALSE, TRUE);
+
+   g_mutex_clear(&batch->lock);
+   g_cond_clear(&batch->started);
+
+   g_free(batch);
+}
@@ -0,0 +1,53 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+#ifndef __GIMP_BATCH_J2K_H__
+#define __GIMP_BATCH_J2K_H__
+
+
+// Batch encoder. In memory images are encoded to files on a bounded pool of workers, one image per worker, while the caller
+// fetches the next. Batch_Submit blocks once as many images are waiting as there are workers, so memory is bounded by about
+// twice the worker count in source images whatever the batch length.
+//
+// Whole images per worker scale better than threads within one encode, so workers default to one per core & the
+// encoder threads setting is shared out between them.
+
+typedef struct Batch_Encoder Batch_Encoder;
+
+typedef struct
+{
+   bool    ok;
+   guint64 size;              // Bytes written.
+   gdouble encode_time;       // Seconds from the start of the encode to the file being closed.
+
+} Batch_Result;
+
+
+// num_workers 0 = automatic. results has an entry per index, written by the workers until Batch_Finish. Entries of
+// indices never submitted are left as they are.
+Batch_Encoder *Batch_New(const Save_Parameters *params, int num_workers, Batch_Result *results);
+
+// Takes ownership of image->data, freed once encoded. image->fetch isn't used.
+void  Batch_Submit(Batch_Encoder *batch, guint index, const Image_Info *image, const char *filename);
+
+// Waits for every submitted image & frees batch.
+void  Batch_Finish(Batch_Encoder *batch);
+
+
+#endif
@@ -0,0 +1,422 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+// j2k-bench : times the codec core's hot stages on synthetic images, for comparing performance between commits.
+//
+//   j2k-bench [--sizes 512,2048] [--min-time 200] [--threads 0] [--preset balanced] [--output results.json]
+//
+// Each stage runs on every size & channel layout, repeated until it has taken at least --min-time. Results are a JSON
+// array, one record per stage run : ns per pixel, source MB/s & the process's peak resident set so far.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#ifdef G_OS_WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "main.h"
+#include "write_j2k.h"
+#include "convert_j2k.h"
+
+
+static gchar *opt_sizes    = nullptr;
+static gint   opt_min_time = 200;
+static gint   opt_threads  = 0;
+static gchar *opt_preset   = nullptr;
+static gchar *opt_output   = nullptr;
+
+static GOptionEntry entries[] =
+{
+   { "sizes",    's', 0, G_OPTION_ARG_STRING,   &opt_sizes,    "Comma separated image edge lengths. Default 512,2048", "N,..." },
+   { "min-time", 'm', 0, G_OPTION_ARG_INT,      &opt_min_time, "Minimum time per stage, milliseconds. Default 200", "MS" },
+   { "threads",  'j', 0, G_OPTION_ARG_INT,      &opt_threads,  "Encoder / decoder threads (0 = all cores)", "N" },
+   { "preset",   'p', 0, G_OPTION_ARG_STRING,   &opt_preset,   "Encoder preset : fastest, balanced or smallest. Default balanced", "PRESET" },
+   { "output",   'o', 0, G_OPTION_ARG_FILENAME, &opt_output,   "Write results to this file instead of stdout", "FILE" },
+   { nullptr }
+};
+
+
+// Synthetic source layouts. Grey colour & uniform alpha exercise the analysis' component reductions.
+typedef struct
+{
+   const char *name;
+   guint       num_components;
+   bool        grey;           // Colour channels equal.
+   bool        opaque;         // Alpha uniform.
+
+} Layout;
+
+static const Layout layouts[] =
+{
+   { "g",        1, true,  false },
+   { "ga",       2, true,  false },
+   { "rgb",      3, false, false },
+   { "rgb-grey", 3, true,  false },
+   { "rgba",     4, false, false },
+   { "rgbx",     4, false, true  },
+};
+
+
+typedef struct
+{
+   Image_Info  source;
+   Scan_Result scan;
+   OPJ_INT32  *planes[4];       // Deinterleave output.
+   guint8     *codestream;      // Last encode, decode input.
+   gsize       codestream_len;
+   opj_image_t *decoded;
+   guchar     *interleaved;     // Image_ToInterleaved output.
+   Save_Parameters params;
+
+} Bench_State;
+
+typedef bool (*Stage_Fn)(Bench_State *s);
+
+
+// Smooth gradients plus deterministic noise : compresses like a photograph rather than flat or random data.
+static void Synthesize(Image_Info *ii, const Layout *layout, guint size)
+{
+   GRand *rand = g_rand_new_with_seed(size * 16 + layout->num_components);
+   guint x, y, c, nc = layout->num_components;
+   guchar *p;
+
+   ii->width = ii->height = size;
+   ii->num_components = nc;
+   ii->data = p = g_new(guchar, (gsize) size * size * nc);
+
+   for (y=0;y<size;y++)
+   {
+      for (x=0;x<size;x++, p+=nc)
+      {
+         guint noise = g_rand_int_range(rand, 0, 24);
+         guint colour_channels = nc >= 3 ? 3 : 1;
+
+         for (c=0;c<colour_channels;c++)
+            p[c] = (guchar) (((layout->grey ? x + y : x * (c + 1) + y * (3 - c)) * 255 / (4 * size) + noise) & 0xff);
+
+         if ((nc == 2) || (nc == 4))
+            p[nc-1] = layout->opaque ? 255 : (guchar) (y * 255 / size);
+      }
+   }
+
+   g_rand_free(rand);
+}
+
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Stages
+// -------------------------------------------------------------------------------------------------------
+
+// Pre-encode analysis : mono & redundant alpha.
+static bool StageScan(Bench_State *s)
+{
+   Image_Info *ii = &s->source;
+
+   Scan_Begin(&s->scan, ii->num_components, FALSE);
+   Scan_Rows(&s->scan, ii->data, ii->width * ii->num_components, ii->width, ii->height);
+   Scan_End(&s->scan);
+
+   return true;
+}
+
+
+// Interleaved -> planar conversion as ToCodestream does it, to the layout the analysis chose.
+static bool StageDeinterleave(Bench_State *s)
+{
+   Image_Info *ii = &s->source;
+   Planar_Layout layout = Planar_SelectLayout(ii->num_components, s->scan.mono, (ii->num_components % 2 == 0) && !s->scan.alpha_uniform);
+   Deinterleave_Fn fn = Deinterleave_GetKernel(layout);
+   guint32 c, y, num_planes = Planar_NumComponents(layout);
+   OPJ_INT32 *rows[4];
+
+   for (c=0;c<num_planes;c++)
+   {
+      if (!s->planes[c])
+         s->planes[c] = g_new(OPJ_INT32, (gsize) ii->width * ii->height);
+   }
+
+   for (y=0;y<ii->height;y++)
+   {
+      for (c=0;c<num_planes;c++)
+         rows[c] = s->planes[c] + (gsize) y * ii->width;
+
+      fn(ii->data + (gsize) y * ii->width * ii->num_components, rows, ii->width);
+   }
+
+   return true;
+}
+
+
+static bool KeepCodestream(void *buffer, int length, void *user_data)
+{
+   Bench_State *s = (Bench_State *) user_data;
+
+   g_free(s->codestream);
+   s->codestream = (guint8 *) g_memdup2(buffer, length);
+   s->codestream_len = length;
+
+   return true;
+}
+
+
+// Whole export : analysis, conversion & OpenJPEG encode to memory.
+static bool StageEncode(Bench_State *s)
+{
+   return serialize_image(&s->source, &s->params, true, KeepCodestream, s);
+}
+
+
+static bool StageDecode(Bench_State *s)
+{
+   Decode_Options options;
+
+   if (s->decoded)
+      opj_image_destroy(s->decoded);
+
+   memset(&options, 0, sizeof(Decode_Options));
+   options.num_threads = opt_threads;
+
+   s->decoded = decode_image(s->codestream, s->codestream_len, true, &options);
+
+   return s->decoded != nullptr;
+}
+
+
+// Decoded planes -> interleaved u8, as the preview & loader hand them to GIMP.
+static bool StageInterleave(Bench_State *s)
+{
+   guint w = s->decoded->comps[0].w, h = s->decoded->comps[0].h;
+   Decode_Options options;
+
+   if (!s->interleaved)
+      s->interleaved = g_new(guchar, (gsize) w * h * s->decoded->numcomps);
+
+   memset(&options, 0, sizeof(Decode_Options));
+   options.num_threads = opt_threads;
+
+   return Image_ToInterleaved(s->decoded, s->interleaved, w, h, 0, h, &options);
+}
+
+
+typedef struct
+{
+   const char *name;
+   Stage_Fn    fn;
+
+} Stage;
+
+// In dependency order : each stage's first run sets up the next one's input.
+static const Stage stages[] =
+{
+   { "scan",         StageScan },
+   { "deinterleave", StageDeinterleave },
+   { "encode",       StageEncode },
+   { "decode",       StageDecode },
+   { "interleave",   StageInterleave },
+};
+
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Measurement & report
+// -------------------------------------------------------------------------------------------------------
+
+// Process peak resident set, kB. Never decreases, so a stage's figure includes everything before it.
+static guint64 PeakRSS(void)
+{
+#ifdef G_OS_WIN32
+   PROCESS_MEMORY_COUNTERS counters;
+
+   if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return counters.PeakWorkingSetSize / 1024;
+
+   return 0;
+#else
+   struct rusage usage;
+
+   if (getrusage(RUSAGE_SELF, &usage))
+      return 0;
+
+#ifdef __APPLE__
+   return usage.ru_maxrss / 1024;   // Bytes on macOS.
+#else
+   return usage.ru_maxrss;
+#endif
+#endif
+}
+
+
+// Mean ns per run, after one untimed warm up run.
+static bool TimeStage(const Stage *stage, Bench_State *s, gdouble *ns, int *iterations)
+{
+   gint64 start, elapsed;
+   int n = 0;
+
+   if (!stage->fn(s))
+      return false;
+
+   start = g_get_monotonic_time();
+
+   do
+   {
+      if (!stage->fn(s))
+         return false;
+
+      n++;
+      elapsed = g_get_monotonic_time() - start;
+   }
+   while (elapsed < (gint64) opt_min_time * 1000);
+
+   *ns = elapsed * 1000.0 / n;
+   *iterations = n;
+
+   return true;
+}
+
+
+static const char *FormatDouble(gchar *buf, gdouble value)
+{
+   return g_ascii_formatd(buf, G_ASCII_DTOSTR_BUF_SIZE, "%.3f", value);
+}
+
+
+static void Report(FILE *f, bool first, const char *stage, const Layout *layout, guint size, int iterations, gdouble ns, gsize bytes)
+{
+   gchar b1[G_ASCII_DTOSTR_BUF_SIZE], b2[G_ASCII_DTOSTR_BUF_SIZE];
+   gdouble num_pixels = (gdouble) size * size;
+   gdouble source_bytes = num_pixels * layout->num_components;
+
+   fprintf(f, "%s    { \"stage\": \"%s\", \"layout\": \"%s\", \"width\": %u, \"height\": %u, \"iterations\": %d, "
+              "\"ns_per_pixel\": %s, \"mb_per_s\": %s, \"output_bytes\": %" G_GSIZE_FORMAT ", \"peak_rss_kb\": %" G_GUINT64_FORMAT " }",
+           first ? "" : ",\n", stage, layout->name, size, size, iterations,
+           FormatDouble(b1, ns / num_pixels), FormatDouble(b2, source_bytes / ns * 1000.0), bytes, PeakRSS());
+}
+
+
+static void FreeState(Bench_State *s)
+{
+   int c;
+
+   g_free(s->source.data);
+   g_free(s->codestream);
+   g_free(s->interleaved);
+
+   for (c=0;c<4;c++)
+      g_free(s->planes[c]);
+
+   if (s->decoded)
+      opj_image_destroy(s->decoded);
+
+   memset(s, 0, sizeof(Bench_State));
+}
+
+
+int main(int argc, char **argv)
+{
+   GOptionContext *context;
+   GError *error = nullptr;
+   gdouble sizes[16];
+   int num_sizes, i, l, k, iterations;
+   bool first = true, ok = true;
+   gdouble ns;
+   FILE *f = stdout;
+
+   context = g_option_context_new("- time the JPEG-2000 codec's hot stages");
+   g_option_context_add_main_entries(context, entries, nullptr);
+
+   if (!g_option_context_parse(context, &argc, &argv, &error))
+   {
+      fprintf(stderr, "j2k-bench: %s\n", error->message);
+      g_error_free(error);
+      g_option_context_free(context);
+      return 1;
+   }
+
+   g_option_context_free(context);
+
+   if (opt_preset && g_ascii_strcasecmp(Preset_Name(Preset_FromName(opt_preset)), opt_preset))
+   {
+      fprintf(stderr, "j2k-bench: unknown preset %s.\n", opt_preset);
+      return 1;
+   }
+
+   num_sizes = Layers_Parse(opt_sizes ? opt_sizes : "512,2048", sizes, G_N_ELEMENTS(sizes));
+
+   if (opt_output && !(f = fopen(opt_output, "w")))
+   {
+      fprintf(stderr, "j2k-bench: could not open %s for writing.\n", opt_output);
+      return 1;
+   }
+
+   fprintf(f, "{\n  \"openjpeg\": \"%s\",\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"preset\": \"%s\",\n  \"results\": [\n",
+           opj_version(), Convert_SimdName(), opt_threads, Preset_Name(Preset_FromName(opt_preset)));
+
+   for (i=0; ok && i<num_sizes; i++)
+   {
+      guint size = (guint) CLAMP(sizes[i], 16, 32768);
+
+      for (l=0; ok && l<(int) G_N_ELEMENTS(layouts); l++)
+      {
+         Bench_State s;
+
+         memset(&s, 0, sizeof(Bench_State));
+
+         Synthesize(&s.source, &layouts[l], size);
+
+         s.params.num_layers = 1;
+         s.params.quality[0] = DEFAULT_QUALITY;
+         s.params.num_threads = opt_threads;
+         s.params.preset = Preset_FromName(opt_preset);
+
+         for (k=0; ok && k<(int) G_N_ELEMENTS(stages); k++)
+         {
+            ok = TimeStage(&stages[k], &s, &ns, &iterations);
+
+            if (ok)
+            {
+               gsize bytes = stages[k].fn == StageEncode ? s.codestream_len : 0;
+
+               Report(f, first, stages[k].name, &layouts[l], size, iterations, ns, bytes);
+               first = false;
+               fflush(f);
+            }
+            else
+               fprintf(stderr, "j2k-bench: %s failed on %s %ux%u.\n", stages[k].name, layouts[l].name, size, size);
+         }
+
+         FreeState(&s);
+      }
+   }
+
+   fprintf(f, "\n  ]\n}\n");
+
+   if (f != stdout)
+      fclose(f);
+
+   return ok ? 0 : 1;
+}
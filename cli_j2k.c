@@ -0,0 +1,626 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+// j2k-cli : headless JPEG-2000 encoder & decoder, built from the same codec core as the plug-in for machines without GIMP.
+//
+//   j2k-cli [options] input output            raw, PPM / PGM / PAM or PNG -> J2K (JP2 by output extension or --format)
+//   j2k-cli --decode [options] input output   J2K / JP2 -> PPM / PGM / PAM (PNG by output extension or --format)
+//
+// Either name may be "-" for stdin / stdout, so the tool can sit in a shell pipeline. Encoder options are the export
+// procedure's : quality 0 - 1, target size in kB, layer qualities or rates, progression, preset, tile size & threads.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <png.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "main.h"
+#include "write_j2k.h"
+
+
+static gdouble  opt_quality         = 0.9;
+static gint     opt_target_size     = 0;
+static gchar   *opt_layer_qualities = nullptr;
+static gchar   *opt_layer_rates     = nullptr;
+static gchar   *opt_progression     = nullptr;
+static gchar   *opt_preset          = nullptr;
+static gint     opt_tile_size       = 0;
+static gint     opt_threads         = 0;
+static gchar   *opt_raw             = nullptr;
+static gchar   *opt_format          = nullptr;
+static gboolean opt_decode          = false;
+static gint     opt_reduce          = 0;
+static gint     opt_layers          = 0;
+static gchar   *opt_region          = nullptr;
+
+static GOptionEntry entries[] =
+{
+   { "quality",         'q', 0, G_OPTION_ARG_DOUBLE, &opt_quality,         "Quality, 0 - 1 (1 = lossless). Default 0.9", "Q" },
+   { "target-size",     's', 0, G_OPTION_ARG_INT,    &opt_target_size,     "Highest quality that fits this size in kB (0 = use quality)", "KB" },
+   { "layer-qualities", 'l', 0, G_OPTION_ARG_STRING, &opt_layer_qualities, "Comma separated quality (0 - 1) of each quality layer, coarse to fine", "Q,..." },
+   { "layer-rates",     'r', 0, G_OPTION_ARG_STRING, &opt_layer_rates,     "Comma separated compression ratio of each quality layer, coarse to fine (1 = lossless). Overrides layer qualities", "R,..." },
+   { "progression",     'p', 0, G_OPTION_ARG_STRING, &opt_progression,     "Packet order : lrcp, rlcp, rpcl, pcrl or cprl. Default lrcp", "ORDER" },
+   { "preset",          0,   0, G_OPTION_ARG_STRING, &opt_preset,          "Encoder preset : fastest, balanced or smallest. Default balanced", "PRESET" },
+   { "tile-size",       't', 0, G_OPTION_ARG_INT,    &opt_tile_size,       "Encode tile by tile with tiles of this size (0 = single tile)", "N" },
+   { "threads",         'j', 0, G_OPTION_ARG_INT,    &opt_threads,         "Encoder / decoder threads (0 = all cores)", "N" },
+   { "raw",             0,   0, G_OPTION_ARG_STRING, &opt_raw,             "Input is raw interleaved 8 bit pixels : width, height & 1 - 4 channels", "WxHxC" },
+   { "format",          'f', 0, G_OPTION_ARG_STRING, &opt_format,          "Output format : j2k or jp2 when encoding, pnm or png when decoding. Default from the output name", "FORMAT" },
+   { "decode",          'd', 0, G_OPTION_ARG_NONE,   &opt_decode,          "Decode J2K / JP2 input", nullptr },
+   { "reduce",          0,   0, G_OPTION_ARG_INT,    &opt_reduce,          "Decode : discard this many resolution levels, each halving the size", "N" },
+   { "layers",          0,   0, G_OPTION_ARG_INT,    &opt_layers,          "Decode : only the first N quality layers (0 = all)", "N" },
+   { "region",          0,   0, G_OPTION_ARG_STRING, &opt_region,          "Decode : only this window, in full resolution pixels", "X,Y,WxH" },
+   { nullptr }
+};
+
+
+static bool IsStdio(const char *filename)
+{
+   return !strcmp(filename, "-");
+}
+
+
+// Format from --format, else the file extension.
+static bool HasFormat(const char *filename, const char *format)
+{
+   const char *ext;
+
+   if (opt_format)
+      return !g_ascii_strcasecmp(opt_format, format);
+
+   ext = strrchr(filename, '.');
+
+   return ext && !g_ascii_strcasecmp(ext + 1, format);
+}
+
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Input
+// -------------------------------------------------------------------------------------------------------
+
+static guint8 *ReadInput(const char *filename, gsize *len)
+{
+   GByteArray *bytes;
+   GError *error = nullptr;
+   gchar *contents;
+   guint8 chunk[65536];
+   size_t n;
+
+   if (!IsStdio(filename))
+   {
+      if (!g_file_get_contents(filename, &contents, len, &error))
+      {
+         fprintf(stderr, "j2k-cli: %s\n", error->message);
+         g_error_free(error);
+         return nullptr;
+      }
+
+      return (guint8 *) contents;
+   }
+
+   bytes = g_byte_array_new();
+
+   while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+      g_byte_array_append(bytes, chunk, n);
+
+   *len = bytes->len;
+
+   return g_byte_array_free(bytes, FALSE);
+}
+
+
+// Next header token. Whitespace & comments before it are skipped, pos is left just after it.
+static bool PnmToken(const guint8 *data, gsize len, gsize *pos, char *token, gsize size)
+{
+   gsize n = 0;
+
+   for (;;)
+   {
+      while ((*pos < len) && g_ascii_isspace(data[*pos]))
+         (*pos)++;
+
+      if ((*pos < len) && (data[*pos] == '#'))
+      {
+         while ((*pos < len) && (data[*pos] != '\n'))
+            (*pos)++;
+      }
+      else
+         break;
+   }
+
+   while ((*pos < len) && !g_ascii_isspace(data[*pos]) && (n + 1 < size))
+      token[n++] = data[(*pos)++];
+
+   token[n] = 0;
+
+   return n > 0;
+}
+
+
+// Binary PGM (P5), PPM (P6) & PAM (P7, 1 - 4 channels). Samples above 8 bits are scaled down.
+static bool ReadPnm(const guint8 *data, gsize len, Image_Info *ii)
+{
+   char token[32], value[32];
+   guint maxval = 0, depth = data[1] == '5' ? 1 : 3;
+   guint bytes_per_sample;
+   gsize pos = 2, i, num_samples;
+
+   if (data[1] == '7')
+   {
+      depth = 0;
+
+      while (PnmToken(data, len, &pos, token, sizeof(token)) && strcmp(token, "ENDHDR"))
+      {
+         if (!PnmToken(data, len, &pos, value, sizeof(value)))
+            return false;
+
+         if (!strcmp(token, "WIDTH"))
+            ii->width = atoi(value);
+         else if (!strcmp(token, "HEIGHT"))
+            ii->height = atoi(value);
+         else if (!strcmp(token, "DEPTH"))
+            depth = atoi(value);
+         else if (!strcmp(token, "MAXVAL"))
+            maxval = atoi(value);
+      }
+   }
+   else
+   {
+      if (PnmToken(data, len, &pos, token, sizeof(token)))
+         ii->width = atoi(token);
+
+      if (PnmToken(data, len, &pos, token, sizeof(token)))
+         ii->height = atoi(token);
+
+      if (PnmToken(data, len, &pos, token, sizeof(token)))
+         maxval = atoi(token);
+   }
+
+   // Single whitespace ends the header.
+   pos++;
+
+   if (!ii->width || !ii->height || (depth < 1) || (depth > 4) || (maxval < 1) || (maxval > 65535))
+   {
+      fprintf(stderr, "j2k-cli: unsupported PNM header.\n");
+      return false;
+   }
+
+   bytes_per_sample = maxval > 255 ? 2 : 1;
+   num_samples = (gsize) ii->width * ii->height * depth;
+
+   if ((pos > len) || ((len - pos) / bytes_per_sample < num_samples))
+   {
+      fprintf(stderr, "j2k-cli: PNM data truncated.\n");
+      return false;
+   }
+
+   ii->num_components = depth;
+   ii->data = g_try_new(guchar, num_samples);
+
+   if (!ii->data)
+      return false;
+
+   data += pos;
+
+   if (maxval == 255)
+   {
+      memcpy(ii->data, data, num_samples);
+   }
+   else
+   {
+      for (i=0;i<num_samples;i++)
+      {
+         guint v = bytes_per_sample == 2 ? (data[2*i] << 8) | data[2*i+1] : data[i];
+
+         ii->data[i] = (guchar) ((MIN(v, maxval) * 255 + maxval / 2) / maxval);
+      }
+   }
+
+   return true;
+}
+
+
+// Grey or colour, with or without alpha, as stored. Palette & 16 bit images are expanded to 8 bits per sample.
+static bool ReadPng(const guint8 *data, gsize len, Image_Info *ii)
+{
+   png_image png;
+
+   memset(&png, 0, sizeof(png));
+   png.version = PNG_IMAGE_VERSION;
+
+   if (!png_image_begin_read_from_memory(&png, data, len))
+   {
+      fprintf(stderr, "j2k-cli: %s\n", png.message);
+      return false;
+   }
+
+   png.format &= PNG_FORMAT_FLAG_COLOR | PNG_FORMAT_FLAG_ALPHA;
+
+   ii->width = png.width;
+   ii->height = png.height;
+   ii->num_components = PNG_IMAGE_PIXEL_CHANNELS(png.format);
+   ii->data = g_try_new(guchar, PNG_IMAGE_SIZE(png));
+
+   if (!ii->data)
+   {
+      png_image_free(&png);
+      return false;
+   }
+
+   if (!png_image_finish_read(&png, nullptr, ii->data, 0, nullptr))
+   {
+      fprintf(stderr, "j2k-cli: %s\n", png.message);
+      return false;
+   }
+
+   return true;
+}
+
+
+static bool ReadRaw(const guint8 *data, gsize len, Image_Info *ii)
+{
+   gsize size;
+
+   if ((sscanf(opt_raw, "%ux%ux%u", &ii->width, &ii->height, &ii->num_components) != 3) ||
+       !ii->width || !ii->height || (ii->num_components < 1) || (ii->num_components > 4))
+   {
+      fprintf(stderr, "j2k-cli: --raw expects WIDTHxHEIGHTxCHANNELS, 1 - 4 channels.\n");
+      return false;
+   }
+
+   size = (gsize) ii->width * ii->height * ii->num_components;
+
+   if (len < size)
+   {
+      fprintf(stderr, "j2k-cli: raw input is %" G_GSIZE_FORMAT " bytes, %" G_GSIZE_FORMAT " expected.\n", len, size);
+      return false;
+   }
+
+   ii->data = (guchar *) g_memdup2(data, size);
+
+   return true;
+}
+
+
+// Source pixels, interleaved 8 bits per sample. The format is sniffed from the data - stdin has no name to go by.
+static bool LoadPixels(const char *filename, Image_Info *ii)
+{
+   static const guint8 png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+   guint8 *data;
+   gsize len = 0;
+   bool ok;
+
+   memset(ii, 0, sizeof(Image_Info));
+
+   data = ReadInput(filename, &len);
+
+   if (!data)
+      return false;
+
+   if (opt_raw)
+      ok = ReadRaw(data, len, ii);
+   else if ((len >= 8) && !memcmp(data, png_signature, 8))
+      ok = ReadPng(data, len, ii);
+   else if ((len >= 3) && (data[0] == 'P') && (data[1] >= '5') && (data[1] <= '7'))
+      ok = ReadPnm(data, len, ii);
+   else
+   {
+      fprintf(stderr, "j2k-cli: %s : unrecognised input. Expected PNG, binary PGM / PPM / PAM or --raw.\n", filename);
+      ok = false;
+   }
+
+   g_free(data);
+
+   if (!ok)
+   {
+      g_free(ii->data);
+      ii->data = nullptr;
+   }
+
+   return ok;
+}
+
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Output
+// -------------------------------------------------------------------------------------------------------
+
+static FILE *OpenOutput(const char *filename)
+{
+   FILE *f;
+
+   if (IsStdio(filename))
+      return stdout;
+
+   f = fopen(filename, "wb");
+
+   if (!f)
+      fprintf(stderr, "j2k-cli: could not open %s for writing.\n", filename);
+
+   return f;
+}
+
+
+// ok : whether writing succeeded. A failed file is removed rather than left truncated.
+static bool CloseOutput(FILE *f, const char *filename, bool ok)
+{
+   if (f == stdout)
+      return (fflush(f) == 0) && ok;
+
+   ok = (fclose(f) == 0) && ok;
+
+   if (!ok)
+      remove(filename);
+
+   return ok;
+}
+
+
+static bool WriteStream(void *buffer, int length, void *user_data)
+{
+   return fwrite(buffer, 1, length, (FILE *) user_data) == (size_t) length;
+}
+
+
+// Grey -> PGM, RGB -> PPM, with alpha -> PAM.
+static bool WritePnm(FILE *f, const guchar *data, guint width, guint height, guint num_components)
+{
+   static const char *tuple_types[] = { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+   gsize size = (gsize) width * height * num_components;
+
+   if ((num_components == 1) || (num_components == 3))
+      fprintf(f, "P%d\n%u %u\n255\n", num_components == 1 ? 5 : 6, width, height);
+   else
+      fprintf(f, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n", width, height, num_components,
+              tuple_types[num_components-1]);
+
+   return fwrite(data, 1, size, f) == size;
+}
+
+
+static bool WritePng(FILE *f, const guchar *data, guint width, guint height, guint num_components)
+{
+   static const png_uint_32 formats[] = { PNG_FORMAT_GRAY, PNG_FORMAT_GA, PNG_FORMAT_RGB, PNG_FORMAT_RGBA };
+   png_image png;
+
+   memset(&png, 0, sizeof(png));
+   png.version = PNG_IMAGE_VERSION;
+   png.width = width;
+   png.height = height;
+   png.format = formats[num_components-1];
+
+   if (!png_image_write_to_stdio(&png, f, 0, data, 0, nullptr))
+   {
+      fprintf(stderr, "j2k-cli: %s\n", png.message);
+      return false;
+   }
+
+   return true;
+}
+
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Encode & decode
+// -------------------------------------------------------------------------------------------------------
+
+static bool Encode(const char *input, const char *output)
+{
+   Save_Parameters params;
+   Image_Info ii;
+   const char *layers_error;
+   bool format_codestream = !HasFormat(output, "jp2");
+   FILE *f;
+   bool ok;
+
+   if (opt_progression && g_ascii_strcasecmp(Progression_Name(Progression_FromName(opt_progression)), opt_progression))
+   {
+      fprintf(stderr, "j2k-cli: unknown progression order %s.\n", opt_progression);
+      return false;
+   }
+
+   if (opt_preset && g_ascii_strcasecmp(Preset_Name(Preset_FromName(opt_preset)), opt_preset))
+   {
+      fprintf(stderr, "j2k-cli: unknown preset %s.\n", opt_preset);
+      return false;
+   }
+
+   memset(&params, 0, sizeof(Save_Parameters));
+
+   layers_error = Layers_Setup(&params, CLAMP(opt_quality, 0.0, 1.0), opt_layer_qualities, opt_layer_rates);
+
+   if (layers_error)
+   {
+      fprintf(stderr, "j2k-cli: %s.\n", layers_error);
+      return false;
+   }
+
+   params.progression = Progression_FromName(opt_progression);
+   params.preset      = Preset_FromName(opt_preset);
+   params.target_size = (guint64) MAX(opt_target_size, 0) * 1024;
+   params.tile_size   = MAX(opt_tile_size, 0);
+   params.num_threads = MAX(opt_threads, 0);
+
+   if (!LoadPixels(input, &ii))
+      return false;
+
+   f = OpenOutput(output);
+
+   if (!f)
+   {
+      g_free(ii.data);
+      return false;
+   }
+
+   // OpenJPEG seeks back over its output, which a pipe can't do : stdout gets the codestream from memory once complete.
+   if (f == stdout)
+      ok = serialize_image(&ii, &params, format_codestream, WriteStream, f);
+   else
+      ok = serialize_image_to_file(&ii, &params, format_codestream, f);
+
+   ok = CloseOutput(f, output, ok);
+
+   g_free(ii.data);
+
+   if (!ok)
+      fprintf(stderr, "j2k-cli: encoding failed.\n");
+
+   return ok;
+}
+
+
+static bool Decode(const char *input, const char *output)
+{
+   Decode_Options options;
+   opj_image_t *image;
+   guint8 *data;
+   guchar *pixels;
+   gsize len = 0;
+   guint width, height, num_components;
+   bool format_codestream;
+   FILE *f;
+   bool ok;
+
+   memset(&options, 0, sizeof(Decode_Options));
+   options.reduce = MAX(opt_reduce, 0);
+   options.layers = MAX(opt_layers, 0);
+   options.num_threads = MAX(opt_threads, 0);
+
+   if (opt_region)
+   {
+      guint x, y, w, h;
+
+      if ((sscanf(opt_region, "%u,%u,%ux%u", &x, &y, &w, &h) != 4) || (w == 0) || (h == 0))
+      {
+         fprintf(stderr, "j2k-cli: bad --region '%s', expected X,Y,WxH.\n", opt_region);
+         return false;
+      }
+
+      options.x0 = x;
+      options.y0 = y;
+      options.x1 = x + w;
+      options.y1 = y + h;
+   }
+
+   data = ReadInput(input, &len);
+
+   if (!data)
+      return false;
+
+   if (!Format_Sniff(data, len, &format_codestream))
+   {
+      fprintf(stderr, "j2k-cli: %s : not a J2K codestream or JP2 file.\n", input);
+      g_free(data);
+      return false;
+   }
+
+   image = decode_image(data, len, format_codestream, &options);
+
+   g_free(data);
+
+   if (!image)
+   {
+      fprintf(stderr, "j2k-cli: %s : decoding failed.\n", input);
+      return false;
+   }
+
+   width = image->comps[0].w;
+   height = image->comps[0].h;
+   num_components = image->numcomps;
+
+   pixels = (num_components >= 1) && (num_components <= 4) ? g_try_new(guchar, (gsize) width * height * num_components) : nullptr;
+
+   if (!pixels || !Image_ToInterleaved(image, pixels, width, height, 0, height, &options))
+   {
+      fprintf(stderr, "j2k-cli: %s : unsupported component layout.\n", input);
+      opj_image_destroy(image);
+      g_free(pixels);
+      return false;
+   }
+
+   opj_image_destroy(image);
+
+   f = OpenOutput(output);
+
+   if (!f)
+   {
+      g_free(pixels);
+      return false;
+   }
+
+   if (HasFormat(output, "png"))
+      ok = WritePng(f, pixels, width, height, num_components);
+   else
+      ok = WritePnm(f, pixels, width, height, num_components);
+
+   ok = CloseOutput(f, output, ok);
+
+   g_free(pixels);
+
+   return ok;
+}
+
+
+int main(int argc, char **argv)
+{
+   GOptionContext *context;
+   GError *error = nullptr;
+   bool ok;
+
+   context = g_option_context_new("INPUT OUTPUT - encode to or decode from JPEG-2000. \"-\" = stdin / stdout");
+   g_option_context_add_main_entries(context, entries, nullptr);
+
+   if (!g_option_context_parse(context, &argc, &argv, &error))
+   {
+      fprintf(stderr, "j2k-cli: %s\n", error->message);
+      g_error_free(error);
+      g_option_context_free(context);
+      return 1;
+   }
+
+   if (argc != 3)
+   {
+      gchar *help = g_option_context_get_help(context, TRUE, nullptr);
+
+      fprintf(stderr, "%s", help);
+      g_free(help);
+      g_option_context_free(context);
+      return 1;
+   }
+
+   g_option_context_free(context);
+
+#ifdef G_OS_WIN32
+   _setmode(_fileno(stdin), _O_BINARY);
+   _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+   ok = opt_decode ? Decode(argv[1], argv[2]) : Encode(argv[1], argv[2]);
+
+   return ok ? 0 : 1;
+}
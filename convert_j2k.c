@@ -0,0 +1,1343 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+// Pixel layout conversion & analysis kernels. Scalar versions are always available, SSE2 & AVX2 versions are used when the CPU supports them.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert_j2k.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define J2K_X86_SIMD 1
+#include <immintrin.h>
+#define J2K_SSE2 __attribute__((target("sse2")))
+#define J2K_AVX2 __attribute__((target("avx2")))
+#else
+#define J2K_X86_SIMD 0
+#endif
+
+
+typedef enum
+{
+   SIMD_SCALAR,
+   SIMD_SSE2,
+   SIMD_AVX2
+
+} Simd_Level;
+
+
+// Highest level the getters may pick, lowered by Convert_LimitSimd.
+static volatile gint level_limit = SIMD_AVX2;
+
+
+static Simd_Level simd_level(void)
+{
+   static volatile gint level = -1;
+
+   // Benign race : every thread computes the same answer.
+   if (level < 0)
+   {
+      Simd_Level detected = SIMD_SCALAR;
+
+#if J2K_X86_SIMD
+      __builtin_cpu_init();
+
+      if (__builtin_cpu_supports("avx2"))
+         detected = SIMD_AVX2;
+      else if (__builtin_cpu_supports("sse2"))
+         detected = SIMD_SSE2;
+#endif
+
+      level = detected;
+   }
+
+   return (Simd_Level) MIN(level, level_limit);
+}
+
+
+gboolean Convert_LimitSimd(const char *name)
+{
+   static const char *const names[] = { "scalar", "sse2", "avx2" };
+   guint i;
+
+   for (i=0;i<G_N_ELEMENTS(names);i++)
+   {
+      if (!g_ascii_strcasecmp(name, names[i]))
+      {
+         level_limit = (gint) i;
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+const char *Convert_SimdName(void)
+{
+   switch (simd_level())
+   {
+      case SIMD_AVX2 : return "avx2";
+      case SIMD_SSE2 : return "sse2";
+      default        : return "scalar";
+   }
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Scalar kernels. Called with constant layout arguments so each instance compiles to a branch free loop.
+// -------------------------------------------------------------------------------------------------------
+
+// One row template per source / destination sample type. src_bpp counts samples.
+#define DEINTERLEAVE_ROW(name, src_type, dest_type)                                                       \
+static inline void name(const src_type *src, dest_type *const *dest, guint32 width,                       \
+                        guint32 src_bpp, guint32 colours, guint32 grey_offset, gboolean alpha)            \
+{                                                                                                        \
+   guint32 x;                                                                                            \
+                                                                                                         \
+   for (x=0;x<width;x++, src += src_bpp)                                                                 \
+   {                                                                                                     \
+      if (colours == 3)                                                                                  \
+      {                                                                                                  \
+         dest[0][x] = src[0];                                                                            \
+         dest[1][x] = src[1];                                                                            \
+         dest[2][x] = src[2];                                                                            \
+      }                                                                                                  \
+      else                                                                                               \
+         dest[0][x] = src[grey_offset];                                                                  \
+                                                                                                         \
+      if (alpha)                                                                                         \
+         dest[colours][x] = src[src_bpp-1];                                                              \
+   }                                                                                                     \
+}
+
+DEINTERLEAVE_ROW(deinterleave_row,        guint8,  OPJ_INT32)
+DEINTERLEAVE_ROW(deinterleave_row8,       guint8,  guint8)
+DEINTERLEAVE_ROW(deinterleave_row16,      guint16, OPJ_INT32)
+DEINTERLEAVE_ROW(deinterleave_row_tile16, guint16, guint16)
+
+
+#define SCALAR_KERNELS(name, src_bpp, colours, grey_offset, alpha)                                        \
+static void name##_scalar(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)                      \
+{                                                                                                        \
+   deinterleave_row(src, dest, width, src_bpp, colours, grey_offset, alpha);                             \
+}                                                                                                        \
+static void name##_scalar8(const guint8 *src, guint8 *const *dest, guint32 width)                        \
+{                                                                                                        \
+   deinterleave_row8(src, dest, width, src_bpp, colours, grey_offset, alpha);                            \
+}                                                                                                        \
+static void name##_scalar16(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)                   \
+{                                                                                                        \
+   deinterleave_row16(src, dest, width, src_bpp, colours, grey_offset, alpha);                           \
+}                                                                                                        \
+static void name##_tile16(const guint16 *src, guint16 *const *dest, guint32 width)                       \
+{                                                                                                        \
+   deinterleave_row_tile16(src, dest, width, src_bpp, colours, grey_offset, alpha);                      \
+}
+
+// Grey from RGB(A) sources comes from the green channel, the closest single channel to luminance.
+SCALAR_KERNELS(row_g,       1, 1, 0, FALSE)
+SCALAR_KERNELS(row_ga,      2, 1, 0, TRUE)
+SCALAR_KERNELS(row_gx,      2, 1, 0, FALSE)
+SCALAR_KERNELS(row_rgb,     3, 3, 0, FALSE)
+SCALAR_KERNELS(row_rgb_g,   3, 1, 1, FALSE)
+SCALAR_KERNELS(row_rgba,    4, 3, 0, TRUE)
+SCALAR_KERNELS(row_rgbx,    4, 3, 0, FALSE)
+SCALAR_KERNELS(row_rgba_ga, 4, 1, 1, TRUE)
+SCALAR_KERNELS(row_rgbx_g,  4, 1, 1, FALSE)
+
+
+// Finishes the pixels a vector loop left over, from pixel x onwards.
+static inline void scalar_tail(Deinterleave_Fn fn, const guint8 *src, OPJ_INT32 *const *dest, guint32 numcomps,
+                               guint32 src_bpp, guint32 x, guint32 width)
+{
+   OPJ_INT32 *tail[4];
+   guint32 c;
+
+   if (x >= width)
+      return;
+
+   for (c=0;c<numcomps;c++)
+      tail[c] = dest[c] + x;
+
+   fn(src + x * src_bpp, tail, width - x);
+}
+
+
+static inline void scalar_tail16(Deinterleave16_Fn fn, const guint16 *src, OPJ_INT32 *const *dest, guint32 numcomps,
+                                 guint32 src_bpp, guint32 x, guint32 width)
+{
+   OPJ_INT32 *tail[4];
+   guint32 c;
+
+   if (x >= width)
+      return;
+
+   for (c=0;c<numcomps;c++)
+      tail[c] = dest[c] + x;
+
+   fn(src + x * src_bpp, tail, width - x);
+}
+
+
+#if J2K_X86_SIMD
+
+// -------------------------------------------------------------------------------------------------------
+//   SSE2 kernels. RGB has no efficient SSE2 deinterleave (needs pshufb) so uses the scalar kernel here.
+// -------------------------------------------------------------------------------------------------------
+
+// Zero extends 16 bytes into 16 int32 samples.
+J2K_SSE2 static inline void widen16_sse2(OPJ_INT32 *dest, __m128i v)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i lo = _mm_unpacklo_epi8(v, zero);
+   __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+   _mm_storeu_si128((__m128i *) (dest),      _mm_unpacklo_epi16(lo, zero));
+   _mm_storeu_si128((__m128i *) (dest + 4),  _mm_unpackhi_epi16(lo, zero));
+   _mm_storeu_si128((__m128i *) (dest + 8),  _mm_unpacklo_epi16(hi, zero));
+   _mm_storeu_si128((__m128i *) (dest + 12), _mm_unpackhi_epi16(hi, zero));
+}
+
+
+J2K_SSE2 static void row_g_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   guint32 x = 0;
+
+   for (; x + 16 <= width; x += 16)
+      widen16_sse2(dest[0] + x, _mm_loadu_si128((const __m128i *) (src + x)));
+
+   scalar_tail(row_g_scalar, src, dest, 1, 1, x, width);
+}
+
+
+J2K_SSE2 static inline void row_ga_sse2_common(const guint8 *src, OPJ_INT32 *const *dest, guint32 width, gboolean alpha)
+{
+   const __m128i low_byte = _mm_set1_epi16(0x00FF);
+   guint32 x = 0;
+
+   for (; x + 16 <= width; x += 16)
+   {
+      __m128i v0 = _mm_loadu_si128((const __m128i *) (src + 2*x));
+      __m128i v1 = _mm_loadu_si128((const __m128i *) (src + 2*x + 16));
+
+      widen16_sse2(dest[0] + x, _mm_packus_epi16(_mm_and_si128(v0, low_byte), _mm_and_si128(v1, low_byte)));
+
+      if (alpha)
+         widen16_sse2(dest[1] + x, _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8)));
+   }
+
+   scalar_tail(alpha ? row_ga_scalar : row_gx_scalar, src, dest, alpha ? 2 : 1, 2, x, width);
+}
+
+
+J2K_SSE2 static void row_ga_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_ga_sse2_common(src, dest, width, TRUE);
+}
+
+
+J2K_SSE2 static void row_gx_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_ga_sse2_common(src, dest, width, FALSE);
+}
+
+
+// Four RGBA pixels per vector, one pixel per 32 bit lane : shifts & masks isolate each channel as int32.
+J2K_SSE2 static inline void row_rgba_sse2_common(const guint8 *src, OPJ_INT32 *const *dest, guint32 width, guint32 colours, gboolean alpha)
+{
+   const __m128i low_byte = _mm_set1_epi32(0xFF);
+   Deinterleave_Fn tail;
+   guint32 x = 0;
+
+   for (; x + 4 <= width; x += 4)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + 4*x));
+      __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), low_byte);
+
+      if (colours == 3)
+      {
+         _mm_storeu_si128((__m128i *) (dest[0] + x), _mm_and_si128(v, low_byte));
+         _mm_storeu_si128((__m128i *) (dest[1] + x), g);
+         _mm_storeu_si128((__m128i *) (dest[2] + x), _mm_and_si128(_mm_srli_epi32(v, 16), low_byte));
+      }
+      else
+         _mm_storeu_si128((__m128i *) (dest[0] + x), g);
+
+      if (alpha)
+         _mm_storeu_si128((__m128i *) (dest[colours] + x), _mm_srli_epi32(v, 24));
+   }
+
+   if (colours == 3)
+      tail = alpha ? row_rgba_scalar : row_rgbx_scalar;
+   else
+      tail = alpha ? row_rgba_ga_scalar : row_rgbx_g_scalar;
+
+   scalar_tail(tail, src, dest, colours + (alpha ? 1 : 0), 4, x, width);
+}
+
+
+J2K_SSE2 static void row_rgba_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_sse2_common(src, dest, width, 3, TRUE);
+}
+
+
+J2K_SSE2 static void row_rgbx_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_sse2_common(src, dest, width, 3, FALSE);
+}
+
+
+J2K_SSE2 static void row_rgba_ga_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_sse2_common(src, dest, width, 1, TRUE);
+}
+
+
+J2K_SSE2 static void row_rgbx_g_sse2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_sse2_common(src, dest, width, 1, FALSE);
+}
+
+
+// 16 bit sources. Eight u16 samples per vector, zero extended to int32 in two halves. RGB uses the scalar kernel.
+
+J2K_SSE2 static void row_g16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   const __m128i zero = _mm_setzero_si128();
+   guint32 x = 0;
+
+   for (; x + 8 <= width; x += 8)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + x));
+
+      _mm_storeu_si128((__m128i *) (dest[0] + x),     _mm_unpacklo_epi16(v, zero));
+      _mm_storeu_si128((__m128i *) (dest[0] + x + 4), _mm_unpackhi_epi16(v, zero));
+   }
+
+   scalar_tail16(row_g_scalar16, src, dest, 1, 1, x, width);
+}
+
+
+// Four GA pixels per vector, one pixel per 32 bit lane : grey is the low word, alpha the high.
+J2K_SSE2 static inline void row_ga16_sse2_common(const guint16 *src, OPJ_INT32 *const *dest, guint32 width, gboolean alpha)
+{
+   const __m128i low_word = _mm_set1_epi32(0xFFFF);
+   guint32 x = 0;
+
+   for (; x + 4 <= width; x += 4)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + 2*x));
+
+      _mm_storeu_si128((__m128i *) (dest[0] + x), _mm_and_si128(v, low_word));
+
+      if (alpha)
+         _mm_storeu_si128((__m128i *) (dest[1] + x), _mm_srli_epi32(v, 16));
+   }
+
+   scalar_tail16(alpha ? row_ga_scalar16 : row_gx_scalar16, src, dest, alpha ? 2 : 1, 2, x, width);
+}
+
+
+J2K_SSE2 static void row_ga16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_ga16_sse2_common(src, dest, width, TRUE);
+}
+
+
+J2K_SSE2 static void row_gx16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_ga16_sse2_common(src, dest, width, FALSE);
+}
+
+
+// Four RGBA pixels per pair of vectors : widened to one pixel per vector, then a 4 x 4 transpose leaves one channel per vector.
+J2K_SSE2 static inline void row_rgba16_sse2_common(const guint16 *src, OPJ_INT32 *const *dest, guint32 width, guint32 colours, gboolean alpha)
+{
+   const __m128i zero = _mm_setzero_si128();
+   Deinterleave16_Fn tail;
+   guint32 x = 0;
+
+   for (; x + 4 <= width; x += 4)
+   {
+      __m128i v0 = _mm_loadu_si128((const __m128i *) (src + 4*x));
+      __m128i v1 = _mm_loadu_si128((const __m128i *) (src + 4*x + 8));
+      __m128i p0 = _mm_unpacklo_epi16(v0, zero), p1 = _mm_unpackhi_epi16(v0, zero);
+      __m128i p2 = _mm_unpacklo_epi16(v1, zero), p3 = _mm_unpackhi_epi16(v1, zero);
+      __m128i rg01 = _mm_unpacklo_epi32(p0, p1), rg23 = _mm_unpacklo_epi32(p2, p3);   // R0 R1 G0 G1, R2 R3 G2 G3
+      __m128i ba01 = _mm_unpackhi_epi32(p0, p1), ba23 = _mm_unpackhi_epi32(p2, p3);   // B0 B1 A0 A1, B2 B3 A2 A3
+      __m128i g = _mm_unpackhi_epi64(rg01, rg23);
+
+      if (colours == 3)
+      {
+         _mm_storeu_si128((__m128i *) (dest[0] + x), _mm_unpacklo_epi64(rg01, rg23));
+         _mm_storeu_si128((__m128i *) (dest[1] + x), g);
+         _mm_storeu_si128((__m128i *) (dest[2] + x), _mm_unpacklo_epi64(ba01, ba23));
+      }
+      else
+         _mm_storeu_si128((__m128i *) (dest[0] + x), g);
+
+      if (alpha)
+         _mm_storeu_si128((__m128i *) (dest[colours] + x), _mm_unpackhi_epi64(ba01, ba23));
+   }
+
+   if (colours == 3)
+      tail = alpha ? row_rgba_scalar16 : row_rgbx_scalar16;
+   else
+      tail = alpha ? row_rgba_ga_scalar16 : row_rgbx_g_scalar16;
+
+   scalar_tail16(tail, src, dest, colours + (alpha ? 1 : 0), 4, x, width);
+}
+
+
+J2K_SSE2 static void row_rgba16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba16_sse2_common(src, dest, width, 3, TRUE);
+}
+
+
+J2K_SSE2 static void row_rgbx16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba16_sse2_common(src, dest, width, 3, FALSE);
+}
+
+
+J2K_SSE2 static void row_rgba_ga16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba16_sse2_common(src, dest, width, 1, TRUE);
+}
+
+
+J2K_SSE2 static void row_rgbx_g16_sse2(const guint16 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba16_sse2_common(src, dest, width, 1, FALSE);
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+//   AVX2 kernels.
+// -------------------------------------------------------------------------------------------------------
+
+J2K_AVX2 static void row_g_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   guint32 x = 0;
+
+   for (; x + 8 <= width; x += 8)
+      _mm256_storeu_si256((__m256i *) (dest[0] + x), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + x))));
+
+   scalar_tail(row_g_scalar, src, dest, 1, 1, x, width);
+}
+
+
+// Sixteen GA pixels per vector : the low byte of each 16 bit lane is grey, the high byte alpha.
+J2K_AVX2 static inline void row_ga_avx2_common(const guint8 *src, OPJ_INT32 *const *dest, guint32 width, gboolean alpha)
+{
+   const __m256i low_byte = _mm256_set1_epi16(0x00FF);
+   guint32 x = 0;
+
+   for (; x + 16 <= width; x += 16)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (src + 2*x));
+      __m256i g = _mm256_and_si256(v, low_byte);
+
+      _mm256_storeu_si256((__m256i *) (dest[0] + x),     _mm256_cvtepu16_epi32(_mm256_castsi256_si128(g)));
+      _mm256_storeu_si256((__m256i *) (dest[0] + x + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(g, 1)));
+
+      if (alpha)
+      {
+         __m256i a = _mm256_srli_epi16(v, 8);
+
+         _mm256_storeu_si256((__m256i *) (dest[1] + x),     _mm256_cvtepu16_epi32(_mm256_castsi256_si128(a)));
+         _mm256_storeu_si256((__m256i *) (dest[1] + x + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(a, 1)));
+      }
+   }
+
+   scalar_tail(alpha ? row_ga_scalar : row_gx_scalar, src, dest, alpha ? 2 : 1, 2, x, width);
+}
+
+
+J2K_AVX2 static void row_ga_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_ga_avx2_common(src, dest, width, TRUE);
+}
+
+
+J2K_AVX2 static void row_gx_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_ga_avx2_common(src, dest, width, FALSE);
+}
+
+
+// Eight RGB pixels (24 bytes) per iteration. pshufb gathers each 4 pixel half into R0-3 G0-3 B0-3, the halves are then
+// merged per channel & zero extended. The second load reads 4 bytes beyond the 8 pixels, hence the loop bound.
+J2K_AVX2 static inline void row_rgb_avx2_common(const guint8 *src, OPJ_INT32 *const *dest, guint32 width, gboolean mono)
+{
+   const __m128i gather = _mm_setr_epi8(0, 3, 6, 9,  1, 4, 7, 10,  2, 5, 8, 11,  -1, -1, -1, -1);
+   guint32 x = 0;
+
+   for (; x + 10 <= width; x += 8)
+   {
+      __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 3*x)), gather);
+      __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 3*x + 12)), gather);
+      __m128i rg = _mm_unpacklo_epi32(lo, hi);
+
+      if (mono)
+         _mm256_storeu_si256((__m256i *) (dest[0] + x), _mm256_cvtepu8_epi32(_mm_srli_si128(rg, 8)));
+      else
+      {
+         __m128i b = _mm_unpackhi_epi32(lo, hi);
+
+         _mm256_storeu_si256((__m256i *) (dest[0] + x), _mm256_cvtepu8_epi32(rg));
+         _mm256_storeu_si256((__m256i *) (dest[1] + x), _mm256_cvtepu8_epi32(_mm_srli_si128(rg, 8)));
+         _mm256_storeu_si256((__m256i *) (dest[2] + x), _mm256_cvtepu8_epi32(b));
+      }
+   }
+
+   scalar_tail(mono ? row_rgb_g_scalar : row_rgb_scalar, src, dest, mono ? 1 : 3, 3, x, width);
+}
+
+
+J2K_AVX2 static void row_rgb_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgb_avx2_common(src, dest, width, FALSE);
+}
+
+
+J2K_AVX2 static void row_rgb_g_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgb_avx2_common(src, dest, width, TRUE);
+}
+
+
+J2K_AVX2 static inline void row_rgba_avx2_common(const guint8 *src, OPJ_INT32 *const *dest, guint32 width, guint32 colours, gboolean alpha)
+{
+   const __m256i low_byte = _mm256_set1_epi32(0xFF);
+   Deinterleave_Fn tail;
+   guint32 x = 0;
+
+   for (; x + 8 <= width; x += 8)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (src + 4*x));
+      __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), low_byte);
+
+      if (colours == 3)
+      {
+         _mm256_storeu_si256((__m256i *) (dest[0] + x), _mm256_and_si256(v, low_byte));
+         _mm256_storeu_si256((__m256i *) (dest[1] + x), g);
+         _mm256_storeu_si256((__m256i *) (dest[2] + x), _mm256_and_si256(_mm256_srli_epi32(v, 16), low_byte));
+      }
+      else
+         _mm256_storeu_si256((__m256i *) (dest[0] + x), g);
+
+      if (alpha)
+         _mm256_storeu_si256((__m256i *) (dest[colours] + x), _mm256_srli_epi32(v, 24));
+   }
+
+   if (colours == 3)
+      tail = alpha ? row_rgba_scalar : row_rgbx_scalar;
+   else
+      tail = alpha ? row_rgba_ga_scalar : row_rgbx_g_scalar;
+
+   scalar_tail(tail, src, dest, colours + (alpha ? 1 : 0), 4, x, width);
+}
+
+
+J2K_AVX2 static void row_rgba_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_avx2_common(src, dest, width, 3, TRUE);
+}
+
+
+J2K_AVX2 static void row_rgbx_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_avx2_common(src, dest, width, 3, FALSE);
+}
+
+
+J2K_AVX2 static void row_rgba_ga_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_avx2_common(src, dest, width, 1, TRUE);
+}
+
+
+J2K_AVX2 static void row_rgbx_g_avx2(const guint8 *src, OPJ_INT32 *const *dest, guint32 width)
+{
+   row_rgba_avx2_common(src, dest, width, 1, FALSE);
+}
+
+#define SIMD_KERNELS(name, sse2) sse2, name##_avx2
+#define SIMD16_KERNEL(sse2)      sse2
+
+#else
+
+#define SIMD_KERNELS(name, sse2) NULL, NULL
+#define SIMD16_KERNEL(sse2)      NULL
+
+#endif // J2K_X86_SIMD
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Pre-encode analysis.
+// -------------------------------------------------------------------------------------------------------
+
+// Vector blocks are 48 bytes : a whole number of pixels for every source layout, so lane i of block vector k always
+// holds channel (16k + i) % bpp. Masks select, per vector : [0] r-g & g-b pairs, [1] r-b pairs, [2] alpha.
+
+void Scan_Begin(Scan_Result *r, guint32 src_bytes_per_pixel, gboolean want_ranges)
+{
+   guint32 k, i, c;
+
+   memset(r, 0, sizeof(Scan_Result));
+
+   r->src_bytes_per_pixel = src_bytes_per_pixel;
+   r->want_ranges = want_ranges;
+   r->mono = TRUE;
+   r->alpha_uniform = (src_bytes_per_pixel == 2) || (src_bytes_per_pixel == 4);
+
+   for (c=0;c<4;c++)
+   {
+      r->min[c] = 0xFFFF;
+      r->bit_depth[c] = 8;
+   }
+
+   for (k=0;k<3;k++)
+   {
+      for (i=0;i<16;i++)
+      {
+         guint32 channel = (16*k + i) % src_bytes_per_pixel;
+
+         r->masks[k][0][i] = (src_bytes_per_pixel >= 3) && (channel <= 1) ? 0xFF : 0;
+         r->masks[k][1][i] = (src_bytes_per_pixel >= 3) && (channel == 0) ? 0xFF : 0;
+         r->masks[k][2][i] = r->alpha_uniform && (channel == src_bytes_per_pixel - 1) ? 0xFF : 0;
+      }
+   }
+}
+
+
+static inline gboolean colour_open(const Scan_Result *r)
+{
+   return r->mono && (r->src_bytes_per_pixel >= 3);
+}
+
+
+static inline gboolean scan_open(const Scan_Result *r)
+{
+   return r->want_ranges || colour_open(r) || r->alpha_uniform;
+}
+
+
+static void scan_pixels_scalar(Scan_Result *r, const guint8 *src, guint32 num_pixels)
+{
+   const guint32 bpp = r->src_bytes_per_pixel;
+   guint32 x, c;
+
+   for (x=0;x<num_pixels;x++, src += bpp)
+   {
+      if (colour_open(r))
+      {
+         int rg = src[0] - src[1], rb = src[0] - src[2], gb = src[1] - src[2];
+
+         if ((abs(rg) > MONO_THRESHOLD) || (abs(rb) > MONO_THRESHOLD) || (abs(gb) > MONO_THRESHOLD))
+            r->mono = FALSE;
+      }
+
+      if (r->alpha_uniform && (src[bpp-1] != r->alpha_value))
+         r->alpha_uniform = FALSE;
+
+      if (r->want_ranges)
+      {
+         for (c=0;c<bpp;c++)
+         {
+            r->min[c] = MIN(r->min[c], src[c]);
+            r->max[c] = MAX(r->max[c], src[c]);
+         }
+      }
+      else if (!scan_open(r))
+         return;
+   }
+}
+
+
+#if J2K_X86_SIMD
+
+J2K_SSE2 static inline __m128i absdiff_epu8(__m128i a, __m128i b)
+{
+   return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+
+J2K_SSE2 static inline gboolean any_set(__m128i v)
+{
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF;
+}
+
+
+// Returns the number of row bytes handled, a multiple of 48. The grey check also reads 2 bytes beyond each block.
+J2K_SSE2 static guint32 scan_row_sse2(Scan_Result *r, const guint8 *src, guint32 row_bytes)
+{
+   const guint32 bpp = r->src_bytes_per_pixel;
+   const __m128i threshold = _mm_set1_epi8(MONO_THRESHOLD);
+   const __m128i alpha = _mm_set1_epi8((char) r->alpha_value);
+   __m128i vmin[3], vmax[3];
+   guint32 pos = 0;
+   guint32 k, i;
+
+   for (k=0;k<3;k++)
+   {
+      vmin[k] = _mm_set1_epi8((char) 0xFF);
+      vmax[k] = _mm_setzero_si128();
+   }
+
+   for (; pos + 50 <= row_bytes; pos += 48)
+   {
+      const guint8 *block = src + pos;
+
+      for (k=0;k<3;k++)
+      {
+         __m128i v = _mm_loadu_si128((const __m128i *) (block + 16*k));
+
+         if (colour_open(r))
+         {
+            __m128i d1 = _mm_and_si128(absdiff_epu8(v, _mm_loadu_si128((const __m128i *) (block + 16*k + 1))),
+                                       _mm_loadu_si128((const __m128i *) r->masks[k][0]));
+            __m128i d2 = _mm_and_si128(absdiff_epu8(v, _mm_loadu_si128((const __m128i *) (block + 16*k + 2))),
+                                       _mm_loadu_si128((const __m128i *) r->masks[k][1]));
+
+            if (any_set(_mm_subs_epu8(_mm_or_si128(d1, d2), threshold)))
+               r->mono = FALSE;
+         }
+
+         if (r->alpha_uniform)
+         {
+            __m128i differs = _mm_andnot_si128(_mm_cmpeq_epi8(v, alpha), _mm_loadu_si128((const __m128i *) r->masks[k][2]));
+
+            if (any_set(differs))
+               r->alpha_uniform = FALSE;
+         }
+
+         vmin[k] = _mm_min_epu8(vmin[k], v);
+         vmax[k] = _mm_max_epu8(vmax[k], v);
+      }
+
+      if (!scan_open(r))
+         return row_bytes;
+   }
+
+   if (r->want_ranges)
+   {
+      guint8 lane_min[16], lane_max[16];
+
+      for (k=0;k<3;k++)
+      {
+         _mm_storeu_si128((__m128i *) lane_min, vmin[k]);
+         _mm_storeu_si128((__m128i *) lane_max, vmax[k]);
+
+         for (i=0;i<16;i++)
+         {
+            guint32 channel = (16*k + i) % bpp;
+
+            r->min[channel] = MIN(r->min[channel], lane_min[i]);
+            r->max[channel] = MAX(r->max[channel], lane_max[i]);
+         }
+      }
+   }
+
+   return pos;
+}
+
+#endif // J2K_X86_SIMD
+
+
+gboolean Scan_Rows(Scan_Result *r, const guint8 *src, guint32 src_pitch, guint32 width, guint32 height)
+{
+   const guint32 bpp = r->src_bytes_per_pixel;
+   const guint32 row_bytes = width * bpp;
+   guint32 y;
+
+   if (!width || !height)
+      return scan_open(r);
+
+   if (!r->started)
+   {
+      r->alpha_value = src[bpp-1];
+      r->started = TRUE;
+   }
+
+   for (y=0; (y < height) && scan_open(r); y++, src += src_pitch)
+   {
+      guint32 done = 0;
+
+#if J2K_X86_SIMD
+      if (simd_level() >= SIMD_SSE2)
+         done = scan_row_sse2(r, src, row_bytes);
+#endif
+
+      if (done < row_bytes)
+         scan_pixels_scalar(r, src + done, (row_bytes - done) / bpp);
+   }
+
+   return scan_open(r);
+}
+
+
+// True when sample v survives being cut to its top bits & scaled back up to 16 bits as the loader does (scale_to_u16).
+static inline gboolean fits_bits16(guint32 v, guint32 bits)
+{
+   guint32 top = v >> (16 - bits);
+
+   return ((top << (16 - bits)) | (top >> (2 * bits - 16))) == v;
+}
+
+
+// Scalar only : for most colour images the grey & alpha checks are decided within the first rows. Ranges take the whole
+// image, but a channel's bit depth only ever grows so costs one compare per sample once settled.
+gboolean Scan_Rows16(Scan_Result *r, const guint16 *src, guint32 src_pitch, guint32 width, guint32 height)
+{
+   const guint32 spp = r->src_bytes_per_pixel;
+   const int threshold = MONO_THRESHOLD * 257;
+   guint32 x, y, c;
+
+   if (!width || !height)
+      return scan_open(r);
+
+   if (!r->started)
+   {
+      r->alpha_value = src[spp-1];
+      r->started = TRUE;
+   }
+
+   for (y=0; (y < height) && scan_open(r); y++, src += src_pitch)
+   {
+      const guint16 *p = src;
+
+      for (x=0; (x < width) && scan_open(r); x++, p += spp)
+      {
+         if (colour_open(r))
+         {
+            int rg = p[0] - p[1], rb = p[0] - p[2], gb = p[1] - p[2];
+
+            if ((abs(rg) > threshold) || (abs(rb) > threshold) || (abs(gb) > threshold))
+               r->mono = FALSE;
+         }
+
+         if (r->alpha_uniform && (p[spp-1] != r->alpha_value))
+            r->alpha_uniform = FALSE;
+
+         if (r->want_ranges)
+         {
+            for (c=0;c<spp;c++)
+            {
+               r->min[c] = MIN(r->min[c], p[c]);
+               r->max[c] = MAX(r->max[c], p[c]);
+
+               while (!fits_bits16(p[c], r->bit_depth[c]))
+                  r->bit_depth[c]++;
+            }
+         }
+      }
+   }
+
+   return scan_open(r);
+}
+
+
+void Scan_End(Scan_Result *r)
+{
+   if (!r->started)
+   {
+      r->alpha_uniform = FALSE;
+      memset(r->min, 0, sizeof(r->min));
+   }
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Planar -> interleaved, for loading. Decoded samples may overshoot their precision, hence the clamp.
+// -------------------------------------------------------------------------------------------------------
+
+static inline void interleave_row(const OPJ_INT32 *const *src, guint8 *dest, guint32 width, guint32 shift, guint32 numcomps)
+{
+   guint32 x, c;
+
+   for (x=0;x<width;x++, dest += numcomps)
+      for (c=0;c<numcomps;c++)
+         dest[c] = (guint8) CLAMP(src[c][x] >> shift, 0, 255);
+}
+
+
+#define INTERLEAVE_SCALAR(numcomps)                                                                     \
+static void interleave##numcomps##_scalar(const OPJ_INT32 *const *src, guint8 *dest, guint32 width,    \
+                                          guint32 shift)                                               \
+{                                                                                                      \
+   interleave_row(src, dest, width, shift, numcomps);                                                  \
+}
+
+INTERLEAVE_SCALAR(1)
+INTERLEAVE_SCALAR(2)
+INTERLEAVE_SCALAR(3)
+INTERLEAVE_SCALAR(4)
+
+
+#if J2K_X86_SIMD
+
+static inline void interleave_tail(Interleave_Fn fn, const OPJ_INT32 *const *src, guint8 *dest, guint32 numcomps,
+                                   guint32 shift, guint32 x, guint32 width)
+{
+   const OPJ_INT32 *tail[4];
+   guint32 c;
+
+   if (x >= width)
+      return;
+
+   for (c=0;c<numcomps;c++)
+      tail[c] = src[c] + x;
+
+   fn(tail, dest + x * numcomps, width - x, shift);
+}
+
+
+// 16 samples of one plane -> 16 bytes. The saturating packs do the clamp.
+J2K_SSE2 static inline __m128i narrow16_sse2(const OPJ_INT32 *src, __m128i shift)
+{
+   __m128i a = _mm_sra_epi32(_mm_loadu_si128((const __m128i *) (src)),      shift);
+   __m128i b = _mm_sra_epi32(_mm_loadu_si128((const __m128i *) (src + 4)),  shift);
+   __m128i c = _mm_sra_epi32(_mm_loadu_si128((const __m128i *) (src + 8)),  shift);
+   __m128i d = _mm_sra_epi32(_mm_loadu_si128((const __m128i *) (src + 12)), shift);
+
+   return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+
+
+J2K_SSE2 static void interleave1_sse2(const OPJ_INT32 *const *src, guint8 *dest, guint32 width, guint32 shift)
+{
+   const __m128i count = _mm_cvtsi32_si128(shift);
+   guint32 x = 0;
+
+   for (; x + 16 <= width; x += 16)
+      _mm_storeu_si128((__m128i *) (dest + x), narrow16_sse2(src[0] + x, count));
+
+   interleave_tail(interleave1_scalar, src, dest, 1, shift, x, width);
+}
+
+
+J2K_SSE2 static void interleave2_sse2(const OPJ_INT32 *const *src, guint8 *dest, guint32 width, guint32 shift)
+{
+   const __m128i count = _mm_cvtsi32_si128(shift);
+   guint32 x = 0;
+
+   for (; x + 16 <= width; x += 16)
+   {
+      __m128i g = narrow16_sse2(src[0] + x, count);
+      __m128i a = narrow16_sse2(src[1] + x, count);
+      guint8 *d = dest + x * 2;
+
+      _mm_storeu_si128((__m128i *) (d),      _mm_unpacklo_epi8(g, a));
+      _mm_storeu_si128((__m128i *) (d + 16), _mm_unpackhi_epi8(g, a));
+   }
+
+   interleave_tail(interleave2_scalar, src, dest, 2, shift, x, width);
+}
+
+
+// RG & BA byte pairs are zipped, then the pairs zipped again into RGBA.
+J2K_SSE2 static void interleave4_sse2(const OPJ_INT32 *const *src, guint8 *dest, guint32 width, guint32 shift)
+{
+   const __m128i count = _mm_cvtsi32_si128(shift);
+   guint32 x = 0;
+
+   for (; x + 16 <= width; x += 16)
+   {
+      __m128i r = narrow16_sse2(src[0] + x, count);
+      __m128i g = narrow16_sse2(src[1] + x, count);
+      __m128i b = narrow16_sse2(src[2] + x, count);
+      __m128i a = narrow16_sse2(src[3] + x, count);
+      __m128i rg_lo = _mm_unpacklo_epi8(r, g), rg_hi = _mm_unpackhi_epi8(r, g);
+      __m128i ba_lo = _mm_unpacklo_epi8(b, a), ba_hi = _mm_unpackhi_epi8(b, a);
+      guint8 *d = dest + x * 4;
+
+      _mm_storeu_si128((__m128i *) (d),      _mm_unpacklo_epi16(rg_lo, ba_lo));
+      _mm_storeu_si128((__m128i *) (d + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+      _mm_storeu_si128((__m128i *) (d + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+      _mm_storeu_si128((__m128i *) (d + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+   }
+
+   interleave_tail(interleave4_scalar, src, dest, 4, shift, x, width);
+}
+
+
+// pshufb control for byte i of block k from channel c : the pixel's index in that channel, or Z (zero) for the other channels.
+#define Z 0x80
+
+static const guint8 interleave3_shuffle[3][3][16] =
+{
+   { {  0,  Z,  Z,  1,  Z,  Z,  2,  Z,  Z,  3,  Z,  Z,  4,  Z,  Z,  5 },
+     {  Z,  0,  Z,  Z,  1,  Z,  Z,  2,  Z,  Z,  3,  Z,  Z,  4,  Z,  Z },
+     {  Z,  Z,  0,  Z,  Z,  1,  Z,  Z,  2,  Z,  Z,  3,  Z,  Z,  4,  Z } },
+   { {  Z,  Z,  6,  Z,  Z,  7,  Z,  Z,  8,  Z,  Z,  9,  Z,  Z, 10,  Z },
+     {  5,  Z,  Z,  6,  Z,  Z,  7,  Z,  Z,  8,  Z,  Z,  9,  Z,  Z, 10 },
+     {  Z,  5,  Z,  Z,  6,  Z,  Z,  7,  Z,  Z,  8,  Z,  Z,  9,  Z,  Z } },
+   { {  Z, 11,  Z,  Z, 12,  Z,  Z, 13,  Z,  Z, 14,  Z,  Z, 15,  Z,  Z },
+     {  Z,  Z, 11,  Z,  Z, 12,  Z,  Z, 13,  Z,  Z, 14,  Z,  Z, 15,  Z },
+     { 10,  Z,  Z, 11,  Z,  Z, 12,  Z,  Z, 13,  Z,  Z, 14,  Z,  Z, 15 } }
+};
+
+#undef Z
+
+
+// Sixteen RGB pixels -> three 16 byte blocks. Byte i of block k is channel (16k + i) % 3 of pixel (16k + i) / 3, so
+// each block is one pshufb per channel, merged. 1, 2 & 4 components are already pack / unpack bound & share SSE2.
+J2K_AVX2 static void interleave3_avx2(const OPJ_INT32 *const *src, guint8 *dest, guint32 width, guint32 shift)
+{
+   const __m128i count = _mm_cvtsi32_si128(shift);
+   __m128i masks[3][3];
+   guint32 k, c, x = 0;
+
+   for (k=0;k<3;k++)
+      for (c=0;c<3;c++)
+         masks[k][c] = _mm_loadu_si128((const __m128i *) interleave3_shuffle[k][c]);
+
+   for (; x + 16 <= width; x += 16)
+   {
+      __m128i r = narrow16_sse2(src[0] + x, count);
+      __m128i g = narrow16_sse2(src[1] + x, count);
+      __m128i b = narrow16_sse2(src[2] + x, count);
+      guint8 *d = dest + x * 3;
+
+      for (k=0;k<3;k++)
+      {
+         __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, masks[k][0]), _mm_shuffle_epi8(g, masks[k][1])),
+                                  _mm_shuffle_epi8(b, masks[k][2]));
+
+         _mm_storeu_si128((__m128i *) (d + 16 * k), v);
+      }
+   }
+
+   interleave_tail(interleave3_scalar, src, dest, 3, shift, x, width);
+}
+
+#endif // J2K_X86_SIMD
+
+
+Interleave_Fn Interleave_GetKernel(guint32 numcomps)
+{
+   static const Interleave_Fn scalar[4] = { interleave1_scalar, interleave2_scalar, interleave3_scalar, interleave4_scalar };
+
+#if J2K_X86_SIMD
+   static const Interleave_Fn sse2[4] = { interleave1_sse2, interleave2_sse2, interleave3_scalar, interleave4_sse2 };
+   static const Interleave_Fn avx2[4] = { interleave1_sse2, interleave2_sse2, interleave3_avx2,   interleave4_sse2 };
+#endif
+
+   if ((numcomps < 1) || (numcomps > 4))
+      return NULL;
+
+#if J2K_X86_SIMD
+   switch (simd_level())
+   {
+      case SIMD_AVX2 : return avx2[numcomps-1];
+      case SIMD_SSE2 : return sse2[numcomps-1];
+      default        : break;
+   }
+#endif
+
+   return scalar[numcomps-1];
+}
+
+
+// Planar -> interleaved u16, for high bit depth loads.
+
+static inline guint16 scale_to_u16(OPJ_INT32 v, guint32 prec)
+{
+   if (prec >= 16)
+      return (guint16) CLAMP(v >> (prec - 16), 0, 65535);
+
+   v = CLAMP(v, 0, (1 << prec) - 1);
+
+   return (guint16) ((v << (16 - prec)) | (v >> (2 * prec - 16)));
+}
+
+
+static inline void interleave16_row(const OPJ_INT32 *const *src, guint16 *dest, guint32 width, guint32 prec, guint32 numcomps)
+{
+   guint32 x, c;
+
+   for (x=0;x<width;x++, dest += numcomps)
+      for (c=0;c<numcomps;c++)
+         dest[c] = scale_to_u16(src[c][x], prec);
+}
+
+
+#define INTERLEAVE16_SCALAR(numcomps)                                                                   \
+static void interleave16_##numcomps##_scalar(const OPJ_INT32 *const *src, guint16 *dest, guint32 width, \
+                                             guint32 prec)                                             \
+{                                                                                                      \
+   interleave16_row(src, dest, width, prec, numcomps);                                                 \
+}
+
+INTERLEAVE16_SCALAR(1)
+INTERLEAVE16_SCALAR(2)
+INTERLEAVE16_SCALAR(3)
+INTERLEAVE16_SCALAR(4)
+
+
+#if J2K_X86_SIMD
+
+static inline void interleave16_tail(Interleave16_Fn fn, const OPJ_INT32 *const *src, guint16 *dest, guint32 numcomps,
+                                     guint32 prec, guint32 x, guint32 width)
+{
+   const OPJ_INT32 *tail[4];
+   guint32 c;
+
+   if (x >= width)
+      return;
+
+   for (c=0;c<numcomps;c++)
+      tail[c] = src[c] + x;
+
+   fn(tail, dest + x * numcomps, width - x, prec);
+}
+
+
+// scale_to_u16 as vector constants : shift down to 16 bits, clamp to max, then replicate the top bits.
+typedef struct
+{
+   __m128i down;
+   __m128i max;
+   __m128i left;
+   __m128i right;
+
+} Scale16;
+
+
+J2K_SSE2 static inline void scale16_init(Scale16 *s, guint32 prec)
+{
+   s->down  = _mm_cvtsi32_si128(prec > 16 ? prec - 16 : 0);
+   s->max   = _mm_set1_epi32(prec >= 16 ? 65535 : (1 << prec) - 1);
+   s->left  = _mm_cvtsi32_si128(prec >= 16 ? 0 : 16 - prec);
+   s->right = _mm_cvtsi32_si128(prec >= 16 ? 16 : 2 * prec - 16);
+}
+
+
+// 8 samples of one plane -> 8 u16. SSE2 has no 32 bit min / max or unsigned 32 -> 16 pack, so the clamp uses compares
+// & the scaled samples are biased into signed range for the saturating signed pack, then flipped back.
+J2K_SSE2 static inline __m128i narrow8_u16_sse2(const OPJ_INT32 *src, const Scale16 *s)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i bias32 = _mm_set1_epi32(0x8000);
+   const __m128i bias16 = _mm_set1_epi16((short) 0x8000);
+   __m128i half[2];
+   int k;
+
+   for (k=0;k<2;k++)
+   {
+      __m128i v = _mm_sra_epi32(_mm_loadu_si128((const __m128i *) (src + 4*k)), s->down);
+      __m128i over;
+
+      v = _mm_and_si128(v, _mm_cmpgt_epi32(v, zero));
+      over = _mm_cmpgt_epi32(v, s->max);
+      v = _mm_or_si128(_mm_and_si128(over, s->max), _mm_andnot_si128(over, v));
+      v = _mm_or_si128(_mm_sll_epi32(v, s->left), _mm_srl_epi32(v, s->right));
+
+      half[k] = _mm_sub_epi32(v, bias32);
+   }
+
+   return _mm_xor_si128(_mm_packs_epi32(half[0], half[1]), bias16);
+}
+
+
+J2K_SSE2 static void interleave16_1_sse2(const OPJ_INT32 *const *src, guint16 *dest, guint32 width, guint32 prec)
+{
+   Scale16 s;
+   guint32 x = 0;
+
+   scale16_init(&s, prec);
+
+   for (; x + 8 <= width; x += 8)
+      _mm_storeu_si128((__m128i *) (dest + x), narrow8_u16_sse2(src[0] + x, &s));
+
+   interleave16_tail(interleave16_1_scalar, src, dest, 1, prec, x, width);
+}
+
+
+J2K_SSE2 static void interleave16_2_sse2(const OPJ_INT32 *const *src, guint16 *dest, guint32 width, guint32 prec)
+{
+   Scale16 s;
+   guint32 x = 0;
+
+   scale16_init(&s, prec);
+
+   for (; x + 8 <= width; x += 8)
+   {
+      __m128i g = narrow8_u16_sse2(src[0] + x, &s);
+      __m128i a = narrow8_u16_sse2(src[1] + x, &s);
+      guint16 *d = dest + x * 2;
+
+      _mm_storeu_si128((__m128i *) (d),     _mm_unpacklo_epi16(g, a));
+      _mm_storeu_si128((__m128i *) (d + 8), _mm_unpackhi_epi16(g, a));
+   }
+
+   interleave16_tail(interleave16_2_scalar, src, dest, 2, prec, x, width);
+}
+
+
+// RG & BA word pairs are zipped, then the pairs zipped again into RGBA. RGB has no SSE2 word shuffle & stays scalar.
+J2K_SSE2 static void interleave16_4_sse2(const OPJ_INT32 *const *src, guint16 *dest, guint32 width, guint32 prec)
+{
+   Scale16 s;
+   guint32 x = 0;
+
+   scale16_init(&s, prec);
+
+   for (; x + 8 <= width; x += 8)
+   {
+      __m128i r = narrow8_u16_sse2(src[0] + x, &s);
+      __m128i g = narrow8_u16_sse2(src[1] + x, &s);
+      __m128i b = narrow8_u16_sse2(src[2] + x, &s);
+      __m128i a = narrow8_u16_sse2(src[3] + x, &s);
+      __m128i rg_lo = _mm_unpacklo_epi16(r, g), rg_hi = _mm_unpackhi_epi16(r, g);
+      __m128i ba_lo = _mm_unpacklo_epi16(b, a), ba_hi = _mm_unpackhi_epi16(b, a);
+      guint16 *d = dest + x * 4;
+
+      _mm_storeu_si128((__m128i *) (d),      _mm_unpacklo_epi32(rg_lo, ba_lo));
+      _mm_storeu_si128((__m128i *) (d + 8),  _mm_unpackhi_epi32(rg_lo, ba_lo));
+      _mm_storeu_si128((__m128i *) (d + 16), _mm_unpacklo_epi32(rg_hi, ba_hi));
+      _mm_storeu_si128((__m128i *) (d + 24), _mm_unpackhi_epi32(rg_hi, ba_hi));
+   }
+
+   interleave16_tail(interleave16_4_scalar, src, dest, 4, prec, x, width);
+}
+
+#endif // J2K_X86_SIMD
+
+
+Interleave16_Fn Interleave16_GetKernel(guint32 numcomps)
+{
+   static const Interleave16_Fn scalar[4] = { interleave16_1_scalar, interleave16_2_scalar, interleave16_3_scalar, interleave16_4_scalar };
+
+#if J2K_X86_SIMD
+   static const Interleave16_Fn sse2[4] = { interleave16_1_sse2, interleave16_2_sse2, interleave16_3_scalar, interleave16_4_sse2 };
+#endif
+
+   if ((numcomps < 1) || (numcomps > 4))
+      return NULL;
+
+#if J2K_X86_SIMD
+   if (simd_level() >= SIMD_SSE2)
+      return sse2[numcomps-1];
+#endif
+
+   return scalar[numcomps-1];
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Kernel selection.
+// -------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+   guint32               src_bytes_per_pixel;
+   guint32               numcomps;
+   Deinterleave8_Fn      scalar8;
+   Deinterleave_Fn       scalar;
+   Deinterleave_Fn       sse2;
+   Deinterleave_Fn       avx2;
+   Deinterleave16_Fn     scalar16;
+   Deinterleave16_Fn     sse2_16;     // Also used at AVX2 level.
+   DeinterleaveTile16_Fn tile16;
+
+} Layout_Info;
+
+
+static const Layout_Info layouts[PLANAR_NUM_LAYOUTS] =
+{
+   { 1, 1, row_g_scalar8,       row_g_scalar,       SIMD_KERNELS(row_g,       row_g_sse2),
+           row_g_scalar16,       SIMD16_KERNEL(row_g16_sse2),         row_g_tile16       },
+   { 2, 2, row_ga_scalar8,      row_ga_scalar,      SIMD_KERNELS(row_ga,      row_ga_sse2),
+           row_ga_scalar16,      SIMD16_KERNEL(row_ga16_sse2),        row_ga_tile16      },
+   { 2, 1, row_gx_scalar8,      row_gx_scalar,      SIMD_KERNELS(row_gx,      row_gx_sse2),
+           row_gx_scalar16,      SIMD16_KERNEL(row_gx16_sse2),        row_gx_tile16      },
+   { 3, 3, row_rgb_scalar8,     row_rgb_scalar,     SIMD_KERNELS(row_rgb,     row_rgb_scalar),
+           row_rgb_scalar16,     SIMD16_KERNEL(row_rgb_scalar16),     row_rgb_tile16     },
+   { 3, 1, row_rgb_g_scalar8,   row_rgb_g_scalar,   SIMD_KERNELS(row_rgb_g,   row_rgb_g_scalar),
+           row_rgb_g_scalar16,   SIMD16_KERNEL(row_rgb_g_scalar16),   row_rgb_g_tile16   },
+   { 4, 4, row_rgba_scalar8,    row_rgba_scalar,    SIMD_KERNELS(row_rgba,    row_rgba_sse2),
+           row_rgba_scalar16,    SIMD16_KERNEL(row_rgba16_sse2),      row_rgba_tile16    },
+   { 4, 3, row_rgbx_scalar8,    row_rgbx_scalar,    SIMD_KERNELS(row_rgbx,    row_rgbx_sse2),
+           row_rgbx_scalar16,    SIMD16_KERNEL(row_rgbx16_sse2),      row_rgbx_tile16    },
+   { 4, 2, row_rgba_ga_scalar8, row_rgba_ga_scalar, SIMD_KERNELS(row_rgba_ga, row_rgba_ga_sse2),
+           row_rgba_ga_scalar16, SIMD16_KERNEL(row_rgba_ga16_sse2),   row_rgba_ga_tile16 },
+   { 4, 1, row_rgbx_g_scalar8,  row_rgbx_g_scalar,  SIMD_KERNELS(row_rgbx_g,  row_rgbx_g_sse2),
+           row_rgbx_g_scalar16,  SIMD16_KERNEL(row_rgbx_g16_sse2),    row_rgbx_g_tile16  },
+};
+
+
+Planar_Layout Planar_SelectLayout(guint32 src_bytes_per_pixel, gboolean mono, gboolean save_alpha)
+{
+   switch (src_bytes_per_pixel)
+   {
+      case 1  : return PLANAR_G;
+      case 2  : return save_alpha ? PLANAR_GA : PLANAR_GX;
+      case 3  : return mono ? PLANAR_RGB_G : PLANAR_RGB;
+      default :
+         if (mono)
+            return save_alpha ? PLANAR_RGBA_GA : PLANAR_RGBX_G;
+
+         return save_alpha ? PLANAR_RGBA : PLANAR_RGBX;
+   }
+}
+
+
+guint32 Planar_NumComponents(Planar_Layout layout)
+{
+   return layouts[layout].numcomps;
+}
+
+
+Deinterleave_Fn Deinterleave_GetKernel(Planar_Layout layout)
+{
+   const Layout_Info *info = &layouts[layout];
+
+   switch (simd_level())
+   {
+      case SIMD_AVX2 : return info->avx2;
+      case SIMD_SSE2 : return info->sse2;
+      default        : return info->scalar;
+   }
+}
+
+
+Deinterleave8_Fn Deinterleave8_GetKernel(Planar_Layout layout)
+{
+   return layouts[layout].scalar8;
+}
+
+
+Deinterleave16_Fn Deinterleave16_GetKernel(Planar_Layout layout)
+{
+   const Layout_Info *info = &layouts[layout];
+
+   return simd_level() >= SIMD_SSE2 ? info->sse2_16 : info->scalar16;
+}
+
+
+DeinterleaveTile16_Fn DeinterleaveTile16_GetKernel(Planar_Layout layout)
+{
+   return layouts[layout].tile16;
+}
@@ -0,0 +1,122 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+#ifndef __GIMP_CONVERT_J2K_H__
+#define __GIMP_CONVERT_J2K_H__
+
+#include <glib.h>
+#include <openjpeg.h>
+
+
+// Interleaved u8 source layout -> component planes. Each layout has its own branch free row kernel.
+
+typedef enum
+{
+   PLANAR_G,          // G    -> G
+   PLANAR_GA,         // GA   -> G, A
+   PLANAR_GX,         // GA   -> G       (uniform alpha dropped)
+   PLANAR_RGB,        // RGB  -> R, G, B
+   PLANAR_RGB_G,      // RGB  -> G       (grey image stored as RGB)
+   PLANAR_RGBA,       // RGBA -> R, G, B, A
+   PLANAR_RGBX,       // RGBA -> R, G, B (uniform alpha dropped)
+   PLANAR_RGBA_GA,    // RGBA -> G, A
+   PLANAR_RGBX_G,     // RGBA -> G
+
+   PLANAR_NUM_LAYOUTS
+
+} Planar_Layout;
+
+
+// Converts one row of width pixels. dest[c] points at the row start in component plane c.
+typedef void (*Deinterleave_Fn)(const guint8 *src, OPJ_INT32 *const *dest, guint32 width);
+
+// As above, for the one byte per sample planar layout used by opj_write_tile.
+typedef void (*Deinterleave8_Fn)(const guint8 *src, guint8 *const *dest, guint32 width);
+
+// 16 bit sources : the same layouts with u16 samples (native byte order), for 16 bit precision components. The Tile
+// variant writes the two byte per sample planar layout opj_write_tile expects at that precision.
+typedef void (*Deinterleave16_Fn)(const guint16 *src, OPJ_INT32 *const *dest, guint32 width);
+typedef void (*DeinterleaveTile16_Fn)(const guint16 *src, guint16 *const *dest, guint32 width);
+
+
+// Pre-encode analysis. All facts are gathered in one pass over the source : Scan_Begin, Scan_Rows for all rows (whole image
+// or successive bands), then Scan_End. Colour & alpha checks stop as soon as they are decided, ranges need every pixel.
+
+#define MONO_THRESHOLD 3   // Max channel difference still considered grey.
+
+typedef struct
+{
+   guint32  src_bytes_per_pixel;
+   gboolean want_ranges;
+
+   gboolean mono;             // All pixels grey (always so for G & GA sources).
+   gboolean alpha_uniform;    // Source has alpha & every pixel shares alpha_value - redundant.
+   guint16  alpha_value;      // In source sample units.
+
+   // Per source channel, valid when want_ranges. min & max in source sample units. bit_depth is the fewest bits (8 - 16)
+   // which hold every sample exactly once the loader scales them back up by replicating the top bits - always 8 for u8.
+   guint16  min[4];
+   guint16  max[4];
+   guint32  bit_depth[4];
+
+   // Private.
+   gboolean started;
+   guint8   masks[3][3][16];
+
+} Scan_Result;
+
+void     Scan_Begin(Scan_Result *r, guint32 src_bytes_per_pixel, gboolean want_ranges);
+gboolean Scan_Rows(Scan_Result *r, const guint8 *src, guint32 src_pitch, guint32 width, guint32 height);  // FALSE once nothing is left to learn.
+void     Scan_End(Scan_Result *r);
+
+// u16 sources : Scan_Begin with the channel count as src_bytes_per_pixel, src_pitch in samples.
+// Grey means channels within MONO_THRESHOLD of each other at 8 bit scale.
+gboolean Scan_Rows16(Scan_Result *r, const guint16 *src, guint32 src_pitch, guint32 width, guint32 height);
+
+
+Planar_Layout    Planar_SelectLayout(guint32 src_bytes_per_pixel, gboolean mono, gboolean save_alpha);
+guint32          Planar_NumComponents(Planar_Layout layout);
+
+// Best kernel for the running CPU (AVX2, SSE2 or scalar), selected once at runtime.
+Deinterleave_Fn  Deinterleave_GetKernel(Planar_Layout layout);
+Deinterleave8_Fn Deinterleave8_GetKernel(Planar_Layout layout);
+
+Deinterleave16_Fn     Deinterleave16_GetKernel(Planar_Layout layout);   // Layout channel counts apply to u16 samples.
+DeinterleaveTile16_Fn DeinterleaveTile16_GetKernel(Planar_Layout layout);
+
+
+// Decoded planes -> one interleaved u8 row for the loader : width pixels from numcomps planes, each sample shifted
+// right by shift (the precision above 8 bits) & clamped to 0 - 255.
+typedef void (*Interleave_Fn)(const OPJ_INT32 *const *src, guint8 *dest, guint32 width, guint32 shift);
+
+Interleave_Fn    Interleave_GetKernel(guint32 numcomps);   // 1 - 4 components, NULL otherwise.
+
+// As above, to u16 for high bit depth loads : samples of prec bits (at least 8) are scaled to the full 0 - 65535 range,
+// lower precisions by replicating their top bits into the new low bits, higher ones by shifting right. Clamped.
+typedef void (*Interleave16_Fn)(const OPJ_INT32 *const *src, guint16 *dest, guint32 width, guint32 prec);
+
+Interleave16_Fn  Interleave16_GetKernel(guint32 numcomps);
+
+const char      *Convert_SimdName(void);
+
+// Caps the level kernels are selected at : "scalar", "sse2" or "avx2". Levels the CPU lacks stay unused. FALSE for an
+// unknown name. For testing SIMD kernels against the scalar ones, not while other threads are converting.
+gboolean         Convert_LimitSimd(const char *name);
+
+
+#endif
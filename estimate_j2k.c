@@ -0,0 +1,354 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+#include <math.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "main.h"
+#include "write_j2k.h"
+#include "estimate_j2k.h"
+
+
+// Sampled qualities. Sizes change fastest at the low end, above the last lossy sample predictions run towards lossless.
+static const gdouble estimate_qualities[ESTIMATE_SAMPLES] = { 20, 30, 40, 50, 60, QUALITY_MAX };
+
+// Floor on measured bits per pixel, so flat images still interpolate in the log domain.
+#define MIN_BPP 1e-4
+
+
+// Along one axis : the whole extent when it fits the mosaic, otherwise ESTIMATE_BLOCKS blocks, each centred in an equal share.
+static void MosaicAxis(guint size, guint *num_blocks, guint *block)
+{
+   if (size <= ESTIMATE_BLOCK * ESTIMATE_BLOCKS)
+   {
+      *num_blocks = 1;
+      *block = size;
+   }
+   else
+   {
+      *num_blocks = ESTIMATE_BLOCKS;
+      *block = ESTIMATE_BLOCK;
+   }
+}
+
+
+static guint BlockOrigin(guint size, guint num_blocks, guint block, guint i)
+{
+   return (guint) (((guint64) size * (2 * i + 1)) / (2 * num_blocks)) - block / 2;
+}
+
+
+static bool FetchBlock(Image_Info *src, guchar *dest, guint x, guint y, guint width, guint height)
+{
+   gsize row_bytes = (gsize) width * Image_BytesPerPixel(src);
+   guint j;
+
+   if (!src->data)
+      return src->fetch(dest, x, y, width, height, src->fetch_user_data);
+
+   for (j=0;j<height;j++)
+      memcpy(dest + j * row_bytes, src->data + (((gsize) (y + j) * src->width) + x) * Image_BytesPerPixel(src), row_bytes);
+
+   return true;
+}
+
+
+// Gathers the sample blocks into one interleaved image.
+static bool BuildMosaic(Image_Info *src, Image_Info *mosaic)
+{
+   guint nx, ny, bw, bh, i, j, row;
+   gsize block_row_bytes, mosaic_row_bytes;
+   guchar *block;
+   bool ok = true;
+
+   MosaicAxis(src->width, &nx, &bw);
+   MosaicAxis(src->height, &ny, &bh);
+
+   memset(mosaic, 0, sizeof(Image_Info));
+
+   mosaic->width = nx * bw;
+   mosaic->height = ny * bh;
+   mosaic->num_components = src->num_components;
+   mosaic->bytes_per_sample = Image_BytesPerSample(src);
+   mosaic->cancel = src->cancel;
+   mosaic->data = g_try_new(guchar, (gsize) mosaic->width * mosaic->height * Image_BytesPerPixel(src));
+
+   block = g_try_new(guchar, (gsize) bw * bh * Image_BytesPerPixel(src));
+
+   if (!mosaic->data || !block)
+   {
+      g_free(mosaic->data);
+      g_free(block);
+      mosaic->data = nullptr;
+      return false;
+   }
+
+   block_row_bytes = (gsize) bw * Image_BytesPerPixel(src);
+   mosaic_row_bytes = (gsize) mosaic->width * Image_BytesPerPixel(src);
+
+   for (j=0; ok && j<ny; j++)
+   {
+      for (i=0; ok && i<nx; i++)
+      {
+         ok = FetchBlock(src, block, BlockOrigin(src->width, nx, bw, i), BlockOrigin(src->height, ny, bh, j), bw, bh);
+
+         for (row=0; ok && row<bh; row++)
+            memcpy(mosaic->data + ((gsize) j * bh + row) * mosaic_row_bytes + i * block_row_bytes, block + row * block_row_bytes, block_row_bytes);
+      }
+   }
+
+   g_free(block);
+
+   if (!ok)
+   {
+      g_free(mosaic->data);
+      mosaic->data = nullptr;
+   }
+
+   return ok;
+}
+
+
+// Final layer's value, which decides the size : the highest quality, or the lowest compression ratio.
+static gdouble FinalLayer(const Save_Parameters *params)
+{
+   int num_layers = CLAMP(params->num_layers, 1, MAX_QUALITY_LAYERS);
+   gdouble value;
+   int i;
+
+   if (params->layer_rates)
+   {
+      for (value=params->rate[0], i=1; i<num_layers; i++)
+         value = MIN(value, params->rate[i]);
+   }
+   else
+   {
+      for (value=params->quality[0], i=1; i<num_layers; i++)
+         value = MAX(value, params->quality[i]);
+   }
+
+   return value;
+}
+
+
+static bool keep_data_size(void *buffer, int length, void *user_data)
+{
+   guint64 *size = (guint64 *) user_data;
+   gsize header_size = Codestream_HeaderSize(buffer, length);
+
+   *size = length > header_size ? length - header_size : 0;
+
+   return true;
+}
+
+
+// Tile-part & packet headers, & coding restarted at tile edges, make a tiled or layered codestream larger than the single
+// layer, untiled one the samples are. Measured on the mosaic, encoded both ways at the final layer.
+static bool MeasureLayout(Image_Info *mosaic, const Save_Parameters *params, gdouble *ratio)
+{
+   Save_Parameters layout = *params, flat = *params;
+   guint64 layout_size = 0, flat_size = 0;
+
+   layout.target_size = 0;
+
+   flat.target_size = 0;
+   flat.tile_size = 0;
+   flat.num_layers = 1;
+   flat.quality[0] = flat.rate[0] = FinalLayer(params);
+
+   if (!serialize_image(mosaic, &layout, true, keep_data_size, &layout_size) || !serialize_image(mosaic, &flat, true, keep_data_size, &flat_size))
+      return false;
+
+   *ratio = flat_size ? (gdouble) layout_size / flat_size : 1.0;
+
+   return true;
+}
+
+
+// Encode time on one thread, so it doesn't depend on how busy the other cores are. Fastest of ESTIMATE_TIMINGS runs : the
+// mosaic is small enough for a scheduler hiccup to double a single run.
+static bool TimeEncode(Image_Info *mosaic, const Save_Parameters *params, gdouble *ns_per_pixel)
+{
+   Save_Parameters timed = *params;
+   gint64 best = G_MAXINT64;
+   guint64 size;
+   int i;
+
+   timed.target_size = 0;
+   timed.num_threads = 1;
+
+   for (i=0;i<ESTIMATE_TIMINGS;i++)
+   {
+      gint64 start = g_get_monotonic_time();
+
+      if (!serialize_image(mosaic, &timed, true, keep_data_size, &size))
+         return false;
+
+      best = MIN(best, g_get_monotonic_time() - start);
+   }
+
+   *ns_per_pixel = best * 1000.0 / ((guint64) mosaic->width * mosaic->height);
+
+   return true;
+}
+
+
+// Encodes the mosaic once per sampled quality, in parallel. Target size doesn't apply to the samples, tiling & layering
+// are measured apart, the remaining settings apply directly. Then timed as configured.
+bool Estimator_Fit(Size_Estimator *e, Image_Info *source, const Save_Parameters *params)
+{
+   Sweep_Point points[ESTIMATE_SAMPLES];
+   Image_Info mosaic;
+   guint64 mosaic_pixels;
+   int i;
+   bool ok;
+
+   memset(e, 0, sizeof(Size_Estimator));
+
+   if (!source->width || !source->height || (!source->data && !source->fetch))
+      return false;
+
+   if (!BuildMosaic(source, &mosaic))
+      return false;
+
+   memset(points, 0, sizeof(points));
+
+   for (i=0;i<ESTIMATE_SAMPLES;i++)
+      points[i].quality = estimate_qualities[i];
+
+   ok = serialize_sweep(&mosaic, params, points, ESTIMATE_SAMPLES, false, nullptr, nullptr);
+
+   e->layout_ratio = 1.0;
+
+   if (ok && (params->tile_size || (params->num_layers > 1)))
+      ok = MeasureLayout(&mosaic, params, &e->layout_ratio);
+
+   if (ok)
+      ok = TimeEncode(&mosaic, params, &e->encode_ns_per_pixel);
+
+   g_free(mosaic.data);
+
+   if (!ok)
+      return false;
+
+   mosaic_pixels = (guint64) mosaic.width * mosaic.height;
+
+   e->num_pixels = (guint64) source->width * source->height;
+   e->raw_size = e->num_pixels * Image_BytesPerPixel(source);
+   e->header_size = points[0].header_size;
+   e->whole_image = mosaic_pixels == e->num_pixels;
+   e->params = *params;
+
+   for (i=0;i<ESTIMATE_SAMPLES;i++)
+   {
+      guint64 data_bytes = points[i].size > e->header_size ? points[i].size - e->header_size : 0;
+
+      e->quality[i] = points[i].quality;
+      e->bpp[i] = MAX(MIN_BPP, data_bytes * 8.0 / mosaic_pixels);
+   }
+
+   e->valid = true;
+
+   return true;
+}
+
+
+guint64 Estimator_Predict(const Size_Estimator *e, gdouble quality)
+{
+   gdouble t, bpp, lossless;
+   int i;
+
+   if (!e->valid)
+      return 0;
+
+   lossless = e->bpp[ESTIMATE_SAMPLES-1];
+
+   if (quality >= QUALITY_MAX)
+   {
+      bpp = lossless;
+   }
+   else
+   {
+      // Segment containing quality. Below the first sample the first segment's slope is extended.
+      for (i=0; (i < ESTIMATE_SAMPLES-2) && (quality >= e->quality[i+1]); i++);
+
+      t = (quality - e->quality[i]) / (e->quality[i+1] - e->quality[i]);
+      bpp = exp(log(e->bpp[i]) + t * (log(e->bpp[i+1]) - log(e->bpp[i])));
+
+      // Lossy is never larger than lossless.
+      bpp = MIN(bpp, lossless);
+   }
+
+   return e->header_size + (guint64) (bpp * e->num_pixels / 8.0);
+}
+
+
+// Tiles & layers scale the data, not the main header.
+static guint64 WithLayout(const Size_Estimator *e, guint64 size)
+{
+   return e->header_size + (guint64) ((size - MIN(size, e->header_size)) * e->layout_ratio);
+}
+
+
+// The final layer decides the size, earlier ones add only the overhead the fit measured.
+guint64 Estimator_PredictParams(const Size_Estimator *e, const Save_Parameters *params)
+{
+   guint64 lossless = WithLayout(e, Estimator_Predict(e, QUALITY_MAX));
+   gdouble value = FinalLayer(params);
+
+   if (!e->valid)
+      return 0;
+
+   if (params->target_size)
+      return MIN(params->target_size, lossless);
+
+   // Rate allocation fits the overhead within the ratio. 1 or less is lossless.
+   if (params->layer_rates)
+      return value > 1.0 ? MIN((guint64) (e->raw_size / value), lossless) : lossless;
+
+   return WithLayout(e, Estimator_Predict(e, value));
+}
+
+
+// Quality & target size are predicted, so don't need a refit. The values of several layers do : the layout overhead was
+// measured with them.
+bool Estimator_Matches(const Size_Estimator *e, const Save_Parameters *params)
+{
+   const Save_Parameters *fit = &e->params;
+   int num_layers = CLAMP(params->num_layers, 1, MAX_QUALITY_LAYERS);
+   int i;
+
+   if (!e->valid)
+      return false;
+
+   if ((fit->preset != params->preset) || (fit->progression != params->progression) || (fit->tile_size != params->tile_size) ||
+       (CLAMP(fit->num_layers, 1, MAX_QUALITY_LAYERS) != num_layers) || (fit->layer_rates != params->layer_rates))
+      return false;
+
+   for (i=0; (num_layers > 1) && (i < num_layers); i++)
+   {
+      if (params->layer_rates ? (fit->rate[i] != params->rate[i]) : (fit->quality[i] != params->quality[i]))
+         return false;
+   }
+
+   return true;
+}
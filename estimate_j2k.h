@@ -0,0 +1,70 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+#ifndef __GIMP_ESTIMATE_J2K_H__
+#define __GIMP_ESTIMATE_J2K_H__
+
+
+// File size estimator. Fitted once per image from a few small encodes, then predicts the output size of any setting almost
+// instantly.
+//
+// The samples are encodes of a mosaic of blocks taken from across the image at full resolution, so they see both the
+// image's content & its native detail. Each sample gives the bits per pixel needed at one quality, predictions
+// interpolate log(bits per pixel) between them & scale to the whole image. Images no larger than the mosaic are sampled
+// whole.
+//
+// The samples are single layer & untiled. The overhead of tiles & further quality layers is measured by encoding the mosaic
+// once as configured, & applied as a ratio. A fit holds only for the settings it was made with, see Estimator_Matches.
+//
+// The fit also times the mosaic encoded as configured on one thread, best of a few runs, so settings (presets) can be
+// compared for speed on the image's own content. Only the ratio between two such times means anything.
+
+#define ESTIMATE_SAMPLES 6
+#define ESTIMATE_BLOCK   64   // Edge of each mosaic block.
+#define ESTIMATE_BLOCKS  4    // Blocks along each side of the mosaic.
+#define ESTIMATE_TIMINGS 3    // Timed encodes, the first also warms caches & the allocator.
+
+typedef struct
+{
+   guint64 num_pixels;                   // Image the estimate is for.
+   guint64 raw_size;                     // Uncompressed bytes, for settings given as compression ratios.
+   guint64 header_size;                  // Fixed overhead, not scaled with the image.
+   gdouble quality[ESTIMATE_SAMPLES];    // Ascending, last = QUALITY_MAX.
+   gdouble bpp[ESTIMATE_SAMPLES];        // Bits per pixel measured at each quality.
+   gdouble layout_ratio;                 // Data bytes as tiled & layered over single layer, untiled. 1 when neither applies.
+   gdouble encode_ns_per_pixel;          // Single threaded encode of the mosaic as configured, fastest run.
+   Save_Parameters params;               // Settings fitted with.
+   bool    whole_image;                  // Samples are of the image itself, so exact at the sampled qualities.
+   bool    valid;
+
+} Size_Estimator;
+
+
+bool    Estimator_Fit(Size_Estimator *e, Image_Info *source, const Save_Parameters *params);
+
+// False when e must be refitted to predict params : any setting the fit depends on differs.
+bool    Estimator_Matches(const Size_Estimator *e, const Save_Parameters *params);
+
+// Predicted bytes for one quality, or for the final layer of params (target size & layer rates included).
+guint64 Estimator_Predict(const Size_Estimator *e, gdouble quality);
+guint64 Estimator_PredictParams(const Size_Estimator *e, const Save_Parameters *params);
+
+
+#endif
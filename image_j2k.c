@@ -0,0 +1,290 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgimp/gimp.h>
+#include <libgimp/gimpui.h>
+
+#include "main.h"
+#include "image_j2k.h"
+#include "trace_j2k.h"
+
+
+// Decoded images -> GIMP. The codec core itself (read_j2k.c, write_j2k.c) doesn't depend on GIMP.
+
+gint32 volatile  preview_image_ID;
+gint32           preview_layer_ID;
+GimpDrawable    *drawable_global;
+
+
+/*
+ * Divide an integer by a power of 2 and round upwards.
+ *
+ * a divided by 2^b
+ */
+
+
+static int ceildiv(int a, int b)
+{
+    return (a+b-1)/b;
+}
+
+
+static gboolean __Query(opj_image_t *img, uint32 *width, uint32 *height, gboolean *alpha)
+{
+	if (!Image_Supported(img))
+		return 0;
+
+   *width  = ceildiv(img->x1-img->x0, img->comps[0].dx);
+	*height = ceildiv(img->y1-img->y0, img->comps[0].dy);
+
+	// Mono with alpha, or RGB with alpha.
+   *alpha = (img->numcomps==2) || (img->numcomps==4);
+
+   return 1;
+}
+
+
+#define BUFFER_BAND_HEIGHT 64
+
+
+// Decoded planes -> GEGL buffer at the origin, scaled (nearest) to width x height - e.g. a reduced preview shown full size.
+// Converted in bands of rows, using options' decoder threads (options may be nullptr). Grey & alpha layouts keep their own
+// babl format, GEGL converts to the buffer's.
+bool image_to_buffer(opj_image_t *image, GeglBuffer *buffer, guint width, guint height, const Decode_Options *options)
+{
+   static const char *formats[] = { "Y' u8", "Y'A u8", "R'G'B' u8", "R'G'B'A u8" };
+   uint32 numcomps = image->numcomps;
+   uint32 y, band;
+   guchar *buf;
+
+   if ((numcomps < 1) || (numcomps > 4) || !Image_Supported(image))
+      return false;
+
+   band = MIN(BUFFER_BAND_HEIGHT, height);
+
+   buf = g_try_new (guchar, (gsize) numcomps * width * band);
+
+   if (!buf)
+      return false;
+
+   for (y=0;y<height;y+=band)
+   {
+      uint32 rows = MIN(band, height - y);
+
+      if (!Image_ToInterleaved(image, buf, width, height, y, rows, options))
+      {
+         g_free(buf);
+         return false;
+      }
+
+      gint64 start = Trace_Begin();
+
+      gegl_buffer_set (buffer, GEGL_RECTANGLE (0, y, width, rows), 0, babl_format (formats[numcomps-1]),
+                       buf, GEGL_AUTO_ROWSTRIDE);
+
+      Trace_End("gegl_buffer_set", start, (guint64) width * rows * numcomps);
+   }
+
+   g_free(buf);
+
+   return true;
+}
+
+
+// New image with an empty Background layer for numcomps (1 - 4) decoded components. Grey files load as grey images - a
+// third of the memory of grey duplicated across RGB. Stored at the precision the samples are converted to (u8, or u16
+// for components deeper than 8 bits) : the buffer's format then matches & gegl_buffer_set copies without conversion.
+static GimpImage *new_gimp_image(guint width, guint height, guint numcomps, guint bytes_per_sample, GimpLayer **layer)
+{
+   static const GimpImageType layer_types[] = { GIMP_GRAY_IMAGE, GIMP_GRAYA_IMAGE, GIMP_RGB_IMAGE, GIMP_RGBA_IMAGE };
+   GimpImage *gimp_image;
+
+   if ((numcomps < 1) || (numcomps > 4))
+   {
+      fprintf(stderr,"Unsupported number of channels : %d.", numcomps);
+      return nullptr;
+   }
+
+   gimp_image = gimp_image_new_with_precision (width, height, numcomps < 3 ? GIMP_GRAY : GIMP_RGB,
+                                               bytes_per_sample == 2 ? GIMP_PRECISION_U16_NON_LINEAR :
+                                                                       GIMP_PRECISION_U8_NON_LINEAR);
+
+   *layer = gimp_layer_new (gimp_image, "Background",
+                            width, height,
+                            layer_types[numcomps-1], 100,
+                            gimp_image_get_default_new_layer_mode (gimp_image));
+
+   gimp_image_insert_layer (gimp_image, *layer, NULL, 0);
+
+   return gimp_image;
+}
+
+
+// Transfers openjpeg format image to gimp equivalent - loaded as regular image or constructed in preview window as appropriate.
+GimpImage * image_to_gimp(opj_image_t *image, const char *filename, gboolean preview)
+{
+   uint32 image_width, image_height;
+
+   gint32 layer_ID,image_ID;
+   gint x1, y1, x2, y2, width, height;
+   
+   GimpImage         *gimp_image;
+   GimpLayer         *layer;
+   GeglBuffer        *buffer;
+
+   gboolean contains_alpha = 0;
+
+   if (!__Query(image, &image_width, &image_height, &contains_alpha))
+   {
+      fprintf(stderr,"The encoding method is not currently supported.");
+      return 0;
+   }
+
+  /* create output image */
+
+  // Decoded size - smaller than the reference grid when reduced or restricted to a window.
+  width = (gint) image->comps[0].w;
+  height = (gint) image->comps[0].h;
+  x1 = (gint) (image->x0);
+  y1 = (gint) (image->y0);
+  x2 = x1 + width;
+  y2 = y1 + height;
+
+#if 0
+  if (preview)
+  {
+      image_ID = preview_image_ID;
+
+      // TODO: Preview layer format should match image format, not saved file format.
+      preview_layer_ID = gimp_layer_new(preview_image_ID, "J2K preview", width, height, layer_type, 100, gimp_image_get_default_new_layer_mode (gimp_image));
+      layer_ID = preview_layer_ID;
+  }
+  else
+  {
+     gimp_image = gimp_image_new(width, height, type);
+
+     gimp_image_set_filename(image_ID, filename);
+     layer_ID = gimp_layer_new (image_ID, "Background", width, height, layer_type, 100, gimp_image_get_default_new_layer_mode (gimp_image));
+  }
+
+  gimp_image_add_layer(image_ID, layer_ID, 0);
+  drawable_global = drawable = gimp_drawable_get(layer_ID);
+  gimp_drawable_mask_bounds(drawable->drawable_id, &x1, &y1, &x2, &y2);
+  gimp_pixel_rgn_init(&rgn_in, drawable, x1, y1,x2 - x1, y2 - y1, TRUE, FALSE);
+#endif
+
+  gimp_image = new_gimp_image (width, height, image->numcomps, 1, &layer);
+
+  if (!gimp_image)
+     return 0;
+
+  buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+
+
+  // Convert the pixel data ...
+  image_to_buffer(image, buffer, image->comps[0].w, image->comps[0].h, nullptr);
+
+  g_object_unref (buffer);
+
+  return gimp_image;
+}
+
+
+typedef struct
+{
+   GimpImage  *image;
+   GeglBuffer *buffer;
+   const Babl *format;
+   guint       bytes_per_pixel;
+
+} Gimp_Sink;
+
+
+static bool sink_begin(void *user, guint width, guint height, guint num_components, guint bytes_per_sample)
+{
+   static const char *formats[2][4] = { { "Y' u8",  "Y'A u8",  "R'G'B' u8",  "R'G'B'A u8"  },
+                                        { "Y' u16", "Y'A u16", "R'G'B' u16", "R'G'B'A u16" } };
+   Gimp_Sink *sink = (Gimp_Sink*) user;
+   GimpLayer *layer;
+
+   if ((width == 0) || (height == 0))
+      return false;
+
+   sink->image = new_gimp_image(width, height, num_components, bytes_per_sample, &layer);
+
+   if (!sink->image)
+      return false;
+
+   sink->buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+   sink->format = babl_format (formats[bytes_per_sample == 2][num_components-1]);
+   sink->bytes_per_pixel = num_components * bytes_per_sample;
+
+   return true;
+}
+
+
+static bool sink_rows(void *user, const guchar *pixels, guint x, guint y, guint width, guint height)
+{
+   Gimp_Sink *sink = (Gimp_Sink*) user;
+   gint64 start = Trace_Begin();
+
+   gegl_buffer_set (sink->buffer, GEGL_RECTANGLE (x, y, width, height), 0, sink->format,
+                    pixels, (gint) (width * sink->bytes_per_pixel));
+
+   Trace_End("gegl_buffer_set", start, (guint64) width * height * sink->bytes_per_pixel);
+
+   return true;
+}
+
+
+// Decodes filename tile by tile straight into a new image's layer - neither the whole decoded image nor a whole
+// interleaved copy is ever held in memory.
+GimpImage *image_load_to_gimp(const char *filename, const Decode_Options *options)
+{
+   Gimp_Sink gimp_sink;
+   Tile_Sink sink;
+
+   memset(&gimp_sink, 0, sizeof(Gimp_Sink));
+
+   sink.begin = sink_begin;
+   sink.rows = sink_rows;
+   sink.user = &gimp_sink;
+
+   bool ok = image_load_tiles(filename, options, &sink);
+
+   if (gimp_sink.buffer)
+   {
+      gegl_buffer_flush (gimp_sink.buffer);
+      g_object_unref (gimp_sink.buffer);
+   }
+
+   if (!ok && gimp_sink.image)
+   {
+      gimp_image_delete (gimp_sink.image);
+      gimp_sink.image = nullptr;
+   }
+
+   return gimp_sink.image;
+}
@@ -0,0 +1,37 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+#ifndef __GIMP_IMAGE_J2K_H__
+#define __GIMP_IMAGE_J2K_H__
+
+
+extern gint32 volatile  preview_image_ID;
+extern gint32           preview_layer_ID;
+extern gchar           *image_comment;
+extern GimpDrawable    *drawable_global;
+extern gboolean         undo_touched;
+extern gint32           display_ID;
+
+
+GimpImage *image_to_gimp(opj_image_t *image, const char *filename, gboolean preview);
+bool image_to_buffer(opj_image_t *image, GeglBuffer *buffer, guint width, guint height, const Decode_Options *options);
+GimpImage *image_load_to_gimp(const char *filename, const Decode_Options *options);
+
+
+#endif
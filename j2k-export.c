@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <errno.h>
+#include <math.h>
 #include <string.h>
 
 #include <glib/gstdio.h>
@@ -36,18 +37,19 @@
 
 
 #include "main.h"
+#include "image_j2k.h"
 #include "write_j2k.h"
+#include "preview_j2k.h"
+#include "estimate_j2k.h"
+#include "batch_j2k.h"
+#include "trace_j2k.h"
 
 
-void Export_SetQuality(float q);
-bool serialize_image(Image_Info *src_image_info, bool format_codestream_only, Serialize_CB callback, void *user_data);
-
-GError **__error = NULL;
-
 static  gboolean  save_dialog (GimpProcedure       *procedure,
              GimpProcedureConfig *config,
              GimpDrawable        *drawable,
              GimpImage           *image,
+             const Babl          *format,
 			 gint           channels);
 
 static gboolean
@@ -75,23 +77,238 @@ warning_dialog (const gchar *primary,
 }
 
 
-int serialize_save(void *buffer, int buffer_length_bytes, void *user_data)
+typedef struct
 {
-	GFile *file = (GFile*) user_data;
-	
-	FILE *outfile = g_fopen (g_file_peek_path (file), "wb");
+  GeglBuffer *buffer;
+  const Babl *format;
+  gint        width;
+  gint        height;
+  gboolean    progress;   /* report export progress */
+} Export_Source;
+
+
+// Tiled export & estimator samples : GEGL hands over one rectangle at a time.
+static bool
+fetch_region (guchar *dest,
+              guint   x,
+              guint   y,
+              guint   width,
+              guint   height,
+              void   *user_data)
+{
+  Export_Source *source = (Export_Source *) user_data;
+  gint64         start  = Trace_Begin ();
+
+  gegl_buffer_get (source->buffer,
+                   GEGL_RECTANGLE (x, y, width, height), 1.0,
+                   source->format, dest,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+  Trace_End ("gegl_buffer_get", start,
+             (guint64) width * height * babl_format_get_bytes_per_pixel (source->format));
 
-	if (! outfile)
+  if (source->progress)
+    gimp_progress_update ((gdouble) (y + height) / source->height);
+
+  return true;
+}
+
+
+/* Babl format & channel count drawables are encoded from. 8 bit images
+ * are fetched as u8, deeper ones as u16 & encoded at the precision the
+ * samples actually use, without going through 8 bits. FALSE for indexed
+ * drawables, which aren't supported. */
+static gboolean
+get_drawable_format (GimpDrawable  *drawable,
+                     const Babl   **format,
+                     gint          *channels)
+{
+  gboolean deep;
+
+  switch (gimp_image_get_precision (gimp_item_get_image (GIMP_ITEM (drawable))))
     {
-      g_set_error (__error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                   _("Could not open '%s' for writing: %s"),
-                   gimp_file_get_utf8_name (file), g_strerror (errno));
-      return false;
+    case GIMP_PRECISION_U8_LINEAR:
+    case GIMP_PRECISION_U8_NON_LINEAR:
+    case GIMP_PRECISION_U8_PERCEPTUAL:
+      deep = FALSE;
+      break;
+
+    default:
+      deep = TRUE;
+      break;
+    }
+
+  switch (gimp_drawable_type (drawable))
+    {
+    case GIMP_RGBA_IMAGE:
+      *format   = babl_format (deep ? "R'G'B'A u16" : "R'G'B'A u8");
+      *channels = 4;
+      return TRUE;
+
+    case GIMP_RGB_IMAGE:
+      *format   = babl_format (deep ? "R'G'B' u16" : "R'G'B' u8");
+      *channels = 3;
+      return TRUE;
+
+    case GIMP_GRAYA_IMAGE:
+      *format   = babl_format (deep ? "Y'A u16" : "Y'A u8");
+      *channels = 2;
+      return TRUE;
+
+    case GIMP_GRAY_IMAGE:
+      *format   = babl_format (deep ? "Y' u16" : "Y' u8");
+      *channels = 1;
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+
+/* Sample layout of pixels fetched in format. */
+static void
+set_source_format (Image_Info *image_info,
+                   const Babl *format)
+{
+  image_info->num_components   = babl_format_get_n_components (format);
+  image_info->bytes_per_sample = babl_format_get_bytes_per_pixel (format) /
+                                 image_info->num_components;
+}
+
+
+// Encoder settings from the procedure config. The preview encoder has its own thread count.
+// Fails if the layers can't be encoded, params are set up regardless.
+static gboolean
+get_save_parameters (GObject         *config,
+                     Save_Parameters *params,
+                     gboolean         preview,
+                     GError         **error)
+{
+  const gchar *layers_error;
+  gdouble      quality;
+  gint         target_size;
+  gint         tile_size;
+  gint         threads;
+  gchar       *layer_qualities;
+  gchar       *layer_rates;
+  gchar       *progression;
+  gchar       *preset;
+
+  g_object_get (config,
+                "quality",                               &quality,
+                "layer-qualities",                       &layer_qualities,
+                "layer-rates",                           &layer_rates,
+                "progression",                           &progression,
+                "preset",                                &preset,
+                "target-size",                           &target_size,
+                "tile-size",                             &tile_size,
+                preview ? "preview-threads" : "threads", &threads,
+                NULL);
+
+  memset (params, 0, sizeof (Save_Parameters));
+
+  layers_error = Layers_Setup (params, quality, layer_qualities, layer_rates);
+
+  params->progression = Progression_FromName (progression);
+  params->preset      = Preset_FromName (preset);
+  params->target_size = (guint64) target_size * 1024;
+  params->tile_size   = tile_size;
+  params->num_threads = threads;
+
+  g_free (layer_qualities);
+  g_free (layer_rates);
+  g_free (progression);
+  g_free (preset);
+
+  if (layers_error)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   _("Invalid quality layers : %s."), layers_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/* Settings last used interactively, kept in a parasite. */
+static gboolean
+get_save_defaults (Save_Parameters *params)
+{
+  GimpParasite *parasite;
+  const gchar  *data;
+  guint32       size;
+  gchar        *def_str;
+  gboolean      ok;
+
+  parasite = gimp_get_parasite (J2K_DEFAULTS_PARASITE);
+
+  if (! parasite)
+    return FALSE;
+
+  data    = (const gchar *) gimp_parasite_get_data (parasite, &size);
+  def_str = g_strndup (data, size);
+
+  gimp_parasite_free (parasite);
+
+  ok = SaveDefaults_Parse (def_str, params);
+
+  g_free (def_str);
+
+  return ok;
+}
+
+
+static void
+save_defaults (const Save_Parameters *params)
+{
+  GimpParasite *parasite;
+  gchar        *def_str = SaveDefaults_Format (params);
+
+  parasite = gimp_parasite_new (J2K_DEFAULTS_PARASITE,
+                                GIMP_PARASITE_PERSISTENT,
+                                strlen (def_str), def_str);
+
+  gimp_attach_parasite (parasite);
+  gimp_parasite_free (parasite);
+  g_free (def_str);
+}
+
+
+// Seeds the layer & progression settings from those last used interactively.
+static void
+load_save_defaults (GObject *config)
+{
+  Save_Parameters defaults;
+  gchar          *values;
+
+  memset (&defaults, 0, sizeof (Save_Parameters));
+
+  if (! get_save_defaults (&defaults))
+    return;
+
+  if (defaults.layer_rates)
+    {
+      values = Layers_Format (defaults.rate, defaults.num_layers, 1.0);
+      g_object_set (config, "layer-rates", values, NULL);
     }
-	
-	fwrite(buffer, buffer_length_bytes, 1, outfile);
-	 
-	fclose (outfile);
+  else
+    {
+      values = Layers_Format (defaults.quality, defaults.num_layers, 100.0);
+      g_object_set (config,
+                    "layer-rates",     "",
+                    "layer-qualities", defaults.num_layers > 1 ? values : "",
+                    "quality",         defaults.quality[defaults.num_layers - 1] / 100.0,
+                    NULL);
+    }
+
+  g_object_set (config,
+                "progression",  Progression_Name (defaults.progression),
+                "show-preview", defaults.preview_enabled,
+                NULL);
+
+  g_free (values);
 }
 
 
@@ -99,6 +316,7 @@ GimpPDBStatusType
 export_image (GFile         *file,
               GimpImage     *image,
               GimpDrawable  *drawable,
+              GimpImage     *orig_image,
               GimpRunMode    run_mode,
               GimpProcedure *procedure,
               GObject       *config,
@@ -110,86 +328,132 @@ export_image (GFile         *file,
   guchar         *pixels = NULL;
   GeglBuffer     *buffer;
   const Babl     *format;
-  GimpImageType   drawable_type;
   gint            drawable_width;
   gint            drawable_height;
   gint            i;
-  double          dquality;
+  Export_Source   source;
+  Save_Parameters params;
+  FILE           *outfile;
+  bool            ok;
+  gint64          start;
+  gint64          close_start;
 
   buffer = gimp_drawable_get_buffer (drawable);
 
-  drawable_type   = gimp_drawable_type   (drawable);
   drawable_width  = gimp_drawable_get_width  (drawable);
   drawable_height = gimp_drawable_get_height (drawable);
   
   Image_Info image_info;
 
+  memset (&image_info, 0, sizeof (Image_Info));
+
   image_info.width = drawable_width;
   image_info.height = drawable_height;
 
-  __error = error;
-
-  switch (drawable_type)
+  if (! get_drawable_format (drawable, &format, &channels))
     {
-    case GIMP_RGBA_IMAGE:
-      format       = babl_format ("R'G'B'A u8");
-      channels     = 4; 
-      break;
-
-    case GIMP_RGB_IMAGE:
-      format       = babl_format ("R'G'B' u8");
-      channels     = 3;
-      break;
-
-    case GIMP_GRAYA_IMAGE:
-	  format   = babl_format ("Y'A u8");
-	  channels = 2;
-      break;
-		
-    case GIMP_GRAY_IMAGE:
-	  format   = babl_format ("Y' u8");
-	  channels = 1;
-      break;
-
-    case GIMP_INDEXEDA_IMAGE:
-	case GIMP_INDEXED_IMAGE:
-        if (run_mode == GIMP_RUN_INTERACTIVE) 
-           warning_dialog (_("Indexed image formats not yet supported & not ideal for j2k anyway."), "Suggest use of PNG instead.");
-  
-        return GIMP_PDB_CANCEL;
+      if (run_mode == GIMP_RUN_INTERACTIVE)
+        warning_dialog (_("Indexed image formats not yet supported & not ideal for j2k anyway."), "Suggest use of PNG instead.");
 
-    default:
-      g_assert_not_reached ();
+      g_object_unref (buffer);
+      return GIMP_PDB_CANCEL;
     }
 
-  image_info.num_components = channels;
+  set_source_format (&image_info, format);
 
   if (run_mode == GIMP_RUN_INTERACTIVE)
   {
-	if (! save_dialog (procedure, (GimpProcedureConfig*) config, drawable, image, channels))
+	load_save_defaults (config);
+
+	if (! save_dialog (procedure, (GimpProcedureConfig*) config, drawable, orig_image, format, channels))
 		return GIMP_PDB_CANCEL;
   }
   
-  g_object_get (config, "quality", &dquality, NULL);
+  if (! get_save_parameters (config, &params, FALSE, error))
+    {
+      g_object_unref (buffer);
+      return GIMP_PDB_CALLING_ERROR;
+    }
 
   gimp_progress_init_printf (_("Exporting '%s'"),
                              gimp_file_get_utf8_name (file));
 
-  /* fetch the image */
-  pixels = g_new (guchar, (gsize) drawable_width * drawable_height * channels);
+  start = Trace_Begin ();
 
-  gegl_buffer_get (buffer,
-                   GEGL_RECTANGLE (0, 0, drawable_width, drawable_height), 1.0,
-                   format, pixels,
-                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
-				   
-  image_info.data = pixels;
-    
-  serialize_image(&image_info, true, serialize_save, file);
+  outfile = g_fopen (g_file_peek_path (file), "wb");
+
+  if (! outfile)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   _("Could not open '%s' for writing: %s"),
+                   gimp_file_get_utf8_name (file), g_strerror (errno));
+      g_object_unref (buffer);
+      return GIMP_PDB_EXECUTION_ERROR;
+    }
+
+  image_info.data  = NULL;
+  image_info.fetch = NULL;
+
+  if (params.tile_size > 0)
+    {
+      /* stream the image tile by tile */
+      source.buffer = buffer;
+      source.format = format;
+      source.width  = drawable_width;
+      source.height = drawable_height;
+      source.progress = TRUE;
+
+      image_info.fetch           = fetch_region;
+      image_info.fetch_user_data = &source;
+    }
+  else
+    {
+      /* fetch the image */
+      gint64 fetch_start = Trace_Begin ();
+
+      pixels = g_new (guchar, (gsize) drawable_width * drawable_height *
+                              Image_BytesPerPixel (&image_info));
+
+      gegl_buffer_get (buffer,
+                       GEGL_RECTANGLE (0, 0, drawable_width, drawable_height), 1.0,
+                       format, pixels,
+                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+      Trace_End ("gegl_buffer_get", fetch_start,
+                 (guint64) drawable_width * drawable_height *
+                 Image_BytesPerPixel (&image_info));
+
+      image_info.data = pixels;
+    }
+
+  /* encode straight into the file */
+  ok = serialize_image_to_file (&image_info, &params, true, outfile);
+
+  close_start = Trace_Begin ();
+  ok = (fclose (outfile) == 0) && ok;
+  Trace_End ("file_close", close_start, 0);
+
+  Trace_End ("export", start, 0);
+  Trace_Flush ();
+
+  g_object_unref (buffer);
+
+  if (! ok)
+    {
+      /* don't leave a truncated file behind */
+      g_remove (g_file_peek_path (file));
+      goto abort;
+    }
+
+  /* remember the settings for the next interactive export */
+  if (run_mode == GIMP_RUN_INTERACTIVE)
+    {
+      g_object_get (config, "show-preview", &params.preview_enabled, NULL);
+      save_defaults (&params);
+    }
 
   /* ... and exit normally */
 
-  g_object_unref (buffer); 
   g_free (pixels);
 
   return GIMP_PDB_SUCCESS;
@@ -205,17 +469,195 @@ abort:
 }
 
 
+static bool
+count_bytes (void *buffer,
+             int   length,
+             void *user_data)
+{
+  *(guint64 *) user_data += length;
 
-static void
-quality_changed (GimpProcedureConfig *config)
+  return true;
+}
+
+
+/* Size probe : the estimator only reads its sample blocks from the
+ * drawable, exact mode encodes the whole drawable in memory. Quality
+ * is 0 - QUALITY_MAX, other settings are the export defaults. */
+GimpPDBStatusType
+estimate_size (GimpDrawable  *drawable,
+               gdouble        quality,
+               gboolean       exact,
+               gdouble       *estimated_size,
+               gdouble       *exact_size,
+               GError       **error)
 {
-  double quality;
-  
-  g_object_get (config,
-                "quality",               &quality,
-                NULL);
-				
-  Export_SetQuality(quality);
+  Size_Estimator  estimator;
+  Save_Parameters params;
+  Export_Source   source;
+  Image_Info      image_info;
+  const Babl     *format;
+  gint            channels;
+  guchar         *pixels;
+  guint64         size = 0;
+  bool            ok;
+
+  *estimated_size = 0;
+  *exact_size     = 0;
+
+  if (! get_drawable_format (drawable, &format, &channels))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Indexed image formats are not supported."));
+      return GIMP_PDB_EXECUTION_ERROR;
+    }
+
+  memset (&params, 0, sizeof (Save_Parameters));
+  params.num_layers = 1;
+  params.quality[0] = quality;
+
+  memset (&image_info, 0, sizeof (Image_Info));
+
+  source.buffer   = gimp_drawable_get_buffer (drawable);
+  source.format   = format;
+  source.width    = gimp_drawable_get_width  (drawable);
+  source.height   = gimp_drawable_get_height (drawable);
+  source.progress = FALSE;
+
+  image_info.width           = source.width;
+  image_info.height          = source.height;
+  set_source_format (&image_info, format);
+  image_info.fetch           = fetch_region;
+  image_info.fetch_user_data = &source;
+
+  ok = Estimator_Fit (&estimator, &image_info, &params);
+
+  if (ok)
+    *estimated_size = Estimator_Predict (&estimator, quality);
+
+  if (ok && exact)
+    {
+      pixels = g_new (guchar, (gsize) source.width * source.height *
+                              Image_BytesPerPixel (&image_info));
+
+      gegl_buffer_get (source.buffer,
+                       GEGL_RECTANGLE (0, 0, source.width, source.height), 1.0,
+                       format, pixels,
+                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+      image_info.data  = pixels;
+      image_info.fetch = NULL;
+
+      ok = serialize_image (&image_info, &params, true, count_bytes, &size);
+      *exact_size = size;
+
+      g_free (pixels);
+    }
+
+  g_object_unref (source.buffer);
+
+  if (! ok)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Could not encode the drawable."));
+      return GIMP_PDB_EXECUTION_ERROR;
+    }
+
+  return GIMP_PDB_SUCCESS;
+}
+
+
+
+/* Batch export. The drawables are fetched one after another on this
+ * thread, the only one GEGL & the PDB may be used from, while a pool
+ * of workers encodes those already fetched. A failed file doesn't stop
+ * the batch : statuses are 1 for each file written, 0 otherwise. */
+GimpPDBStatusType
+export_batch (GimpDrawable **drawables,
+              const gchar  **filenames,
+              gint           num_files,
+              GObject       *config,
+              gint           jobs,
+              gint32        *statuses,
+              gdouble       *sizes,
+              gdouble       *fetch_times,
+              gdouble       *encode_times,
+              GError       **error)
+{
+  Save_Parameters  params;
+  Batch_Encoder   *batch;
+  Batch_Result    *results;
+  gint             i;
+
+  if (! get_save_parameters (config, &params, FALSE, error))
+    return GIMP_PDB_CALLING_ERROR;
+
+  results = g_new0 (Batch_Result, num_files);
+  batch   = Batch_New (&params, jobs, results);
+
+  gimp_progress_init (_("Exporting J2K files"));
+
+  for (i = 0; i < num_files; i++)
+    {
+      GeglBuffer *buffer;
+      const Babl *format;
+      gint        channels;
+      Image_Info  image_info;
+      gint64      start = g_get_monotonic_time ();
+
+      fetch_times[i] = 0;
+
+      if (! get_drawable_format (drawables[i], &format, &channels))
+        {
+          g_printerr ("Batch export : skipped drawable %d (%s), unsupported format.\n",
+                      i, filenames[i]);
+          continue;
+        }
+
+      memset (&image_info, 0, sizeof (Image_Info));
+
+      image_info.width  = gimp_drawable_get_width  (drawables[i]);
+      image_info.height = gimp_drawable_get_height (drawables[i]);
+      set_source_format (&image_info, format);
+
+      image_info.data = g_try_malloc ((gsize) image_info.width * image_info.height *
+                                      Image_BytesPerPixel (&image_info));
+
+      if (! image_info.data)
+        {
+          g_printerr ("Batch export : skipped drawable %d (%s), out of memory.\n",
+                      i, filenames[i]);
+          continue;
+        }
+
+      buffer = gimp_drawable_get_buffer (drawables[i]);
+
+      gegl_buffer_get (buffer,
+                       GEGL_RECTANGLE (0, 0, image_info.width, image_info.height), 1.0,
+                       format, image_info.data,
+                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+      g_object_unref (buffer);
+
+      fetch_times[i] = (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC;
+
+      /* waits while every worker already has an image queued */
+      Batch_Submit (batch, i, &image_info, filenames[i]);
+
+      gimp_progress_update ((gdouble) (i + 1) / num_files);
+    }
+
+  Batch_Finish (batch);
+
+  for (i = 0; i < num_files; i++)
+    {
+      statuses[i]     = results[i].ok ? 1 : 0;
+      sizes[i]        = results[i].size;
+      encode_times[i] = results[i].encode_time;
+    }
+
+  g_free (results);
+
+  return GIMP_PDB_SUCCESS;
 }
 
 
@@ -223,25 +665,676 @@ quality_changed (GimpProcedureConfig *config)
 //   Preview
 // -------------------------------------------------------------------------------------------------------
 
-// TODO: Implement referencing pattern in jpeg-export.c
-void make_preview(GimpProcedureConfig *config) { /*TODO*/ }
+static GtkWidget      *preview_size   = NULL;
+static GimpImage      *preview_image  = NULL;   /* displayed image the preview layer is added to */
+static GimpDrawable   *preview_source = NULL;
+static GimpLayer      *preview_layer  = NULL;
+static const Babl     *preview_format = NULL;
+static Preview_Engine *preview_engine = NULL;
+static Image_Info      preview_info;
+static guint           preview_settle_id = 0;
+static Size_Estimator  preview_estimators[NUM_PRESETS];
+static GtkWidget      *preset_tradeoff = NULL;
+static guint           preset_fit_id = 0;
+
+/* changes this far apart count as the slider having settled */
+#define PREVIEW_SETTLE_MS 250
+
+
+static void
+remove_preview_layer (void)
+{
+  if (preview_layer &&
+      gimp_image_is_valid (preview_image) &&
+      gimp_item_is_valid (GIMP_ITEM (preview_layer)))
+    {
+      /*  assuming that reference counting is working correctly,
+          we do not need to delete the layer, removing it from
+          the image should be sufficient  */
+      gimp_image_remove_layer (preview_image, preview_layer);
+    }
+
+  preview_layer = NULL;
+}
+
+
+/* Main thread : show the latest encode in the preview layer. */
+static void
+preview_result (const Preview_Result *result,
+                void                 *user_data)
+{
+  GimpProcedureConfig *config = user_data;
+  GeglBuffer          *buffer;
+  Decode_Options       options;
+  gchar                temp[128];
+  gboolean             show_preview;
+  gint                 offset_x, offset_y;
+
+  /* drafts carry no size, the estimator's from make_preview() stays */
+  if (! result->draft)
+    {
+      if (result->estimated)
+        g_snprintf (temp, sizeof (temp),
+                    _("File size: ~ %02.01f kB (estimate)"),
+                    (gdouble) result->file_size / 1024.0);
+      else
+        g_snprintf (temp, sizeof (temp), _("File size: %02.01f kB"),
+                    (gdouble) result->file_size / 1024.0);
+
+      gtk_label_set_text (GTK_LABEL (preview_size), temp);
+    }
+
+  g_object_get (config, "show-preview", &show_preview, NULL);
+
+  if (! show_preview || ! gimp_image_is_valid (preview_image))
+    return;
+
+  if (! preview_layer)
+    {
+      preview_layer = gimp_layer_new (preview_image, _("JPEG 2000 preview"),
+                                      preview_info.width, preview_info.height,
+                                      gimp_drawable_type (preview_source),
+                                      100,
+                                      gimp_image_get_default_new_layer_mode (preview_image));
+
+      gimp_drawable_get_offsets (preview_source, &offset_x, &offset_y);
+      gimp_layer_set_offsets (preview_layer, offset_x, offset_y);
+
+      gimp_image_insert_layer (preview_image, preview_layer, NULL, 0);
+    }
+
+  /* converted with the preview's threads, as it was encoded */
+  memset (&options, 0, sizeof (Decode_Options));
+  g_object_get (config, "preview-threads", &options.num_threads, NULL);
+
+  buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (preview_layer));
+  /* drafts are scaled up to cover the whole layer */
+  image_to_buffer (result->image, buffer,
+                   preview_info.width, preview_info.height, &options);
+  g_object_unref (buffer);
+
+  gimp_drawable_update (GIMP_DRAWABLE (preview_layer), 0, 0,
+                        preview_info.width, preview_info.height);
+  gimp_displays_flush ();
+}
+
+
+static void
+cancel_settle (void)
+{
+  if (preview_settle_id)
+    g_source_remove (preview_settle_id);
+
+  preview_settle_id = 0;
+}
+
+
+/* No change for PREVIEW_SETTLE_MS : follow the drafts with the full
+ * resolution preview & its encoded file size. */
+static gboolean
+preview_settled (gpointer user_data)
+{
+  GimpProcedureConfig *config = user_data;
+  Save_Parameters      params;
+
+  preview_settle_id = 0;
+
+  get_save_parameters (G_OBJECT (config), &params, TRUE, NULL);
+  Preview_Request (preview_engine, &params, FALSE);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+/* The preview & sweep workers encode from their own copy of the
+ * pixels, fetched once. */
+static gboolean
+fetch_preview_source (void)
+{
+  GeglBuffer *buffer;
+
+  if (preview_info.data)
+    return TRUE;
+
+  memset (&preview_info, 0, sizeof (Image_Info));
+
+  preview_info.width          = gimp_drawable_get_width  (preview_source);
+  preview_info.height         = gimp_drawable_get_height (preview_source);
+  set_source_format (&preview_info, preview_format);
+  preview_info.data           = g_new (guchar, (gsize) preview_info.width *
+                                               preview_info.height *
+                                               Image_BytesPerPixel (&preview_info));
+
+  buffer = gimp_drawable_get_buffer (preview_source);
+  gegl_buffer_get (buffer,
+                   GEGL_RECTANGLE (0, 0, preview_info.width, preview_info.height), 1.0,
+                   preview_format, preview_info.data,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+  g_object_unref (buffer);
+
+  return TRUE;
+}
+
+
+/* Size & encode time of each preset for this image, from its
+ * estimator. Times are relative to balanced's, both measured on the
+ * same mosaic on one thread. */
+static void
+show_preset_tradeoff (const Save_Parameters *params)
+{
+  const Encoder_Preset  order[NUM_PRESETS] = { PRESET_FASTEST, PRESET_BALANCED, PRESET_SMALLEST };
+  const gchar          *names[NUM_PRESETS] = { _("Balanced"), _("Fastest"), _("Smallest") };
+  const Size_Estimator *balanced = &preview_estimators[PRESET_BALANCED];
+  GString              *text     = g_string_new (NULL);
+  gint                  i;
+
+  if (! preset_tradeoff)
+    return;
+
+  for (i = 0; i < NUM_PRESETS; i++)
+    {
+      const Size_Estimator *e = &preview_estimators[order[i]];
+
+      if (! e->valid)
+        continue;
+
+      g_string_append_printf (text, "%s%s: ~ %02.01f kB",
+                              text->len ? "\n" : "", names[order[i]],
+                              (gdouble) Estimator_PredictParams (e, params) / 1024.0);
+
+      if (balanced->valid && balanced->encode_ns_per_pixel > 0)
+        g_string_append_printf (text, _(", %.2fx the time"),
+                                e->encode_ns_per_pixel / balanced->encode_ns_per_pixel);
+    }
+
+  gtk_label_set_text (GTK_LABEL (preset_tradeoff), text->str);
+
+  g_string_free (text, TRUE);
+}
+
+
+/* Unfitted, or fitted for other tile & layer settings. */
+static gboolean
+preset_fit_stale (const Save_Parameters *params)
+{
+  return ! Estimator_Matches (&preview_estimators[params->preset], params);
+}
+
+
+/* Fits the estimator for params' preset from samples of the preview
+ * source. */
+static void
+fit_preset (const Save_Parameters *params)
+{
+  Export_Source source;
+  Image_Info    image_info;
+
+  /* samples are read straight from the drawable unless the pixels
+   * are already here */
+  image_info = preview_info;
+
+  if (! image_info.data)
+    {
+      source.buffer   = gimp_drawable_get_buffer (preview_source);
+      source.format   = preview_format;
+      source.width    = gimp_drawable_get_width  (preview_source);
+      source.height   = gimp_drawable_get_height (preview_source);
+      source.progress = FALSE;
+
+      image_info.width           = source.width;
+      image_info.height          = source.height;
+      set_source_format (&image_info, preview_format);
+      image_info.fetch           = fetch_region;
+      image_info.fetch_user_data = &source;
+    }
+
+  image_info.cancel = NULL;
+
+  Estimator_Fit (&preview_estimators[params->preset], &image_info, params);
+
+  if (! image_info.data)
+    g_object_unref (source.buffer);
+}
+
+
+/* Idle : fits one of the presets not selected per call, so the
+ * dialog stays responsive while the trade-off fills in. */
+static gboolean
+fit_next_preset (gpointer user_data)
+{
+  GimpProcedureConfig *config = user_data;
+  Save_Parameters      params;
+  gint                 i;
+
+  get_save_parameters (G_OBJECT (config), &params, TRUE, NULL);
+
+  for (i = 0; i < NUM_PRESETS; i++)
+    {
+      Save_Parameters preset_params = params;
+
+      preset_params.preset = (Encoder_Preset) i;
+
+      if (preset_fit_stale (&preset_params))
+        {
+          fit_preset (&preset_params);
+
+          show_preset_tradeoff (&params);
+
+          return G_SOURCE_CONTINUE;
+        }
+    }
+
+  preset_fit_id = 0;
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+cancel_preset_fits (void)
+{
+  if (preset_fit_id)
+    g_source_remove (preset_fit_id);
+
+  preset_fit_id = 0;
+}
+
+
+/* Instant size for the current settings. Only the selected preset's
+ * estimator is fitted here, the others follow from idle. Shown until
+ * (or instead of) an exact preview size. */
+static void
+show_estimate (GimpProcedureConfig *config)
+{
+  Save_Parameters params;
+  GError         *error = NULL;
+  gchar           temp[128];
+
+  if (! get_save_parameters (G_OBJECT (config), &params, TRUE, &error))
+    {
+      gtk_label_set_text (GTK_LABEL (preview_size), error->message);
+      g_error_free (error);
+      return;
+    }
+
+  if (preset_fit_stale (&params))
+    fit_preset (&params);
+
+  /* removes itself once every preset is fitted */
+  if (! preset_fit_id)
+    preset_fit_id = g_idle_add (fit_next_preset, config);
+
+  show_preset_tradeoff (&params);
+
+  if (! preview_estimators[params.preset].valid)
+    {
+      gtk_label_set_text (GTK_LABEL (preview_size), _("File size: unknown"));
+      return;
+    }
+
+  g_snprintf (temp, sizeof (temp), _("File size: ~ %02.01f kB (estimate)"),
+              (gdouble) Estimator_PredictParams (&preview_estimators[params.preset], &params) / 1024.0);
+
+  gtk_label_set_text (GTK_LABEL (preview_size), temp);
+}
+
+
+/* Runs on every config change. Requests are cheap : the engine only
+ * ever works on the latest one and abandons any it's overtaken.
+ * Each change asks for a fast reduced resolution draft, the full
+ * preview waits until changes stop. */
+static void
+make_preview (GimpProcedureConfig *config)
+{
+  Save_Parameters params;
+  gboolean        show_preview;
+
+  g_object_get (config, "show-preview", &show_preview, NULL);
+
+  show_estimate (config);
+
+  if (! show_preview)
+    {
+      cancel_settle ();
+
+      if (preview_engine)
+        Preview_Cancel (preview_engine);
+
+      remove_preview_layer ();
+      gimp_displays_flush ();
+      return;
+    }
+
+  if (! preview_engine)
+    {
+      fetch_preview_source ();
+
+      preview_engine = Preview_New (&preview_info, preview_result, config);
+    }
+
+  get_save_parameters (G_OBJECT (config), &params, TRUE, NULL);
+
+  cancel_settle ();
+
+  if (Preview_HasDraft (preview_engine))
+    {
+      Preview_Request (preview_engine, &params, TRUE);
+
+      preview_settle_id = g_timeout_add (PREVIEW_SETTLE_MS,
+                                         preview_settled, config);
+    }
+  else
+    {
+      Preview_Request (preview_engine, &params, FALSE);
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+//   Quality sweep
+// -------------------------------------------------------------------------------------------------------
+
+#define SWEEP_POINTS 10
+
+static GtkWidget   *sweep_area   = NULL;
+static GtkWidget   *sweep_button = NULL;
+static GThread     *sweep_thread = NULL;
+static gint         sweep_cancel = 0;
+static gint         sweep_redraw = 0;      /* redraw queued by a worker */
+static gulong       sweep_notify_id = 0;
+static GimpProcedureConfig *sweep_config = NULL;
+static GMutex       sweep_lock;
+static Sweep_Point  sweep_points[SWEEP_POINTS];   /* worker side */
+static Sweep_Point  sweep_shown[SWEEP_POINTS];    /* main thread copy, under sweep_lock */
+static Image_Info   sweep_info;
+static Save_Parameters sweep_params;
+
+
+static gboolean
+sweep_queue_draw (gpointer user_data)
+{
+  g_atomic_int_set (&sweep_redraw, 0);
+
+  if (sweep_area)
+    gtk_widget_queue_draw (sweep_area);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+/* worker thread : publish the point & have the curve redrawn */
+static void
+sweep_point_done (Sweep_Point *point,
+                  void        *user_data)
+{
+  g_mutex_lock (&sweep_lock);
+  sweep_shown[point - sweep_points] = *point;
+  g_mutex_unlock (&sweep_lock);
+
+  if (g_atomic_int_compare_and_exchange (&sweep_redraw, 0, 1))
+    g_idle_add (sweep_queue_draw, NULL);
+}
+
+
+static gboolean
+sweep_finished (gpointer user_data)
+{
+  /* already joined by stop_sweep() */
+  if (! sweep_thread)
+    return G_SOURCE_REMOVE;
+
+  g_thread_join (sweep_thread);
+  sweep_thread = NULL;
+
+  gtk_widget_set_sensitive (sweep_button, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static gpointer
+sweep_run (gpointer user_data)
+{
+  serialize_sweep (&sweep_info, &sweep_params, sweep_points, SWEEP_POINTS,
+                   TRUE, sweep_point_done, NULL);
+
+  if (! g_atomic_int_get (&sweep_cancel))
+    g_idle_add (sweep_finished, NULL);
+
+  return NULL;
+}
+
+
+static void
+sweep_clicked (GtkWidget           *button,
+               GimpProcedureConfig *config)
+{
+  gint i;
+
+  if (sweep_thread || ! fetch_preview_source ())
+    return;
+
+  get_save_parameters (G_OBJECT (config), &sweep_params, TRUE, NULL);
+
+  for (i = 0; i < SWEEP_POINTS; i++)
+    sweep_points[i].quality = (i + 1) * QUALITY_MAX / SWEEP_POINTS;
+
+  g_mutex_lock (&sweep_lock);
+  memset (sweep_shown, 0, sizeof (sweep_shown));
+  g_mutex_unlock (&sweep_lock);
+
+  sweep_info        = preview_info;
+  sweep_info.cancel = &sweep_cancel;
+  g_atomic_int_set (&sweep_cancel, 0);
+
+  gtk_widget_set_sensitive (sweep_button, FALSE);
+  gtk_widget_queue_draw (sweep_area);
+
+  sweep_thread = g_thread_new ("j2k-sweep", sweep_run, NULL);
+}
+
+
+static void
+stop_sweep (void)
+{
+  if (sweep_thread)
+    {
+      g_atomic_int_set (&sweep_cancel, 1);
+      g_thread_join (sweep_thread);
+      sweep_thread = NULL;
+    }
+
+  if (sweep_notify_id)
+    g_signal_handler_disconnect (sweep_config, sweep_notify_id);
+
+  sweep_notify_id = 0;
+  sweep_area      = NULL;
+  sweep_button  = NULL;
+}
+
+
+/* bytes (solid) & PSNR (dashed) against quality, with the current
+ * quality marked. Each curve is scaled to its own maximum. */
+static gboolean
+draw_sweep (GtkWidget           *widget,
+            cairo_t             *cr,
+            GimpProcedureConfig *config)
+{
+  Sweep_Point   points[SWEEP_POINTS];
+  GtkAllocation allocation;
+  gdouble       quality, max_size = 0, max_psnr = 0;
+  gdouble       w, h;
+  gchar         text[64];
+  gint          i, curve;
+
+  g_mutex_lock (&sweep_lock);
+  memcpy (points, sweep_shown, sizeof (points));
+  g_mutex_unlock (&sweep_lock);
+
+  g_object_get (config, "quality", &quality, NULL);
+
+  gtk_widget_get_allocation (widget, &allocation);
+  w = allocation.width - 1;
+  h = allocation.height - 1;
 
-void destroy_preview()
+  for (i = 0; i < SWEEP_POINTS; i++)
+    if (points[i].done)
+      {
+        max_size = MAX (max_size, points[i].size);
+
+        if (isfinite (points[i].psnr))
+          max_psnr = MAX (max_psnr, points[i].psnr);
+      }
+
+  cairo_set_line_width (cr, 1.0);
+  cairo_set_source_rgb (cr, 0.5, 0.5, 0.5);
+  cairo_rectangle (cr, 0.5, 0.5, w, h);
+  cairo_stroke (cr);
+
+  cairo_move_to (cr, 0.5 + quality * w, 0);
+  cairo_line_to (cr, 0.5 + quality * w, h);
+  cairo_stroke (cr);
+
+  if (max_size == 0)
+    return FALSE;
+
+  cairo_set_line_width (cr, 2.0);
+
+  for (curve = 0; curve < 2; curve++)
+    {
+      gboolean first = TRUE;
+
+      if (curve == 1)
+        {
+          static const gdouble dash[] = { 4.0, 3.0 };
+
+          if (max_psnr == 0)
+            break;
+
+          cairo_set_dash (cr, dash, G_N_ELEMENTS (dash), 0);
+        }
+
+      cairo_set_source_rgb (cr, curve ? 0.8 : 0.2, 0.4, curve ? 0.2 : 0.8);
+
+      for (i = 0; i < SWEEP_POINTS; i++)
+        {
+          gdouble v;
+
+          if (! points[i].done)
+            continue;
+
+          v = curve ? MIN (points[i].psnr, max_psnr) / max_psnr
+                    : points[i].size / max_size;
+
+          if (first)
+            cairo_move_to (cr, points[i].quality / QUALITY_MAX * w, h - v * (h - 2));
+          else
+            cairo_line_to (cr, points[i].quality / QUALITY_MAX * w, h - v * (h - 2));
+
+          first = FALSE;
+        }
+
+      cairo_stroke (cr);
+    }
+
+  cairo_set_dash (cr, NULL, 0, 0);
+  cairo_set_source_rgb (cr, 0.5, 0.5, 0.5);
+  cairo_move_to (cr, 4, 12);
+
+  if (max_psnr > 0)
+    g_snprintf (text, sizeof (text), _("%.0f kB, %.1f dB"), max_size / 1024.0, max_psnr);
+  else
+    g_snprintf (text, sizeof (text), _("%.0f kB"), max_size / 1024.0);
+
+  cairo_show_text (cr, text);
+
+  return FALSE;
+}
+
+
+/* click the curve to pick that quality */
+static gboolean
+sweep_pick (GtkWidget           *widget,
+            GdkEventButton      *event,
+            GimpProcedureConfig *config)
+{
+  GtkAllocation allocation;
+
+  gtk_widget_get_allocation (widget, &allocation);
+
+  g_object_set (config,
+                "quality", CLAMP (event->x / MAX (1, allocation.width - 1), 0.0, 1.0),
+                NULL);
+
+  gtk_widget_queue_draw (widget);
+
+  return TRUE;
+}
+
+
+static void
+add_sweep_widgets (GtkWidget           *box,
+                   GimpProcedureConfig *config)
 {
-	// TODO
+  sweep_button = gtk_button_new_with_mnemonic (_("_Analyse size vs. quality"));
+  gtk_widget_set_tooltip_text (sweep_button,
+                               _("Encode at a range of qualities in parallel & plot "
+                                 "file size (solid) and PSNR (dashed). "
+                                 "Click the plot to choose a quality."));
+  gtk_box_pack_start (GTK_BOX (box), sweep_button, FALSE, FALSE, 0);
+  gtk_widget_show (sweep_button);
+
+  g_signal_connect (sweep_button, "clicked",
+                    G_CALLBACK (sweep_clicked), config);
+
+  sweep_area = gtk_drawing_area_new ();
+  gtk_widget_set_size_request (sweep_area, 200, 100);
+  gtk_widget_add_events (sweep_area, GDK_BUTTON_PRESS_MASK);
+  gtk_box_pack_start (GTK_BOX (box), sweep_area, FALSE, FALSE, 0);
+  gtk_widget_show (sweep_area);
+
+  g_signal_connect (sweep_area, "draw",
+                    G_CALLBACK (draw_sweep), config);
+  g_signal_connect (sweep_area, "button-press-event",
+                    G_CALLBACK (sweep_pick), config);
+
+  sweep_config    = config;
+  sweep_notify_id = g_signal_connect_swapped (config, "notify::quality",
+                                              G_CALLBACK (gtk_widget_queue_draw),
+                                              sweep_area);
+}
+
+
+static void
+destroy_preview (void)
+{
+  cancel_settle ();
+  cancel_preset_fits ();
+
+  /* stops the workers before the pixels they read go away */
+  stop_sweep ();
+
+  Preview_Free (preview_engine);
+  preview_engine = NULL;
+
+  remove_preview_layer ();
+  gimp_displays_flush ();
+
+  g_free (preview_info.data);
+  memset (&preview_info, 0, sizeof (Image_Info));
+  memset (preview_estimators, 0, sizeof (preview_estimators));
+  preset_tradeoff = NULL;
 }
 
 
-static GtkWidget         *preview_size  = NULL;
- 
 // TODO: Complete stripping of jpg-export reference code to essentials only
-// TODO2: Fix up interactive preview. Reference code from 2.x version at the end of write_j2k.c
 
 gboolean
 save_dialog (GimpProcedure       *procedure,
              GimpProcedureConfig *config,
              GimpDrawable        *drawable,
              GimpImage           *image,
+             const Babl          *format,
 			 gint           channels)
 {
   GtkWidget        *dialog;
@@ -267,11 +1360,6 @@ save_dialog (GimpProcedure       *procedure,
   /* Quality as a GimpScaleEntry. */
   gimp_procedure_dialog_get_spin_scale (GIMP_PROCEDURE_DIALOG (dialog), "quality", 100.0);
 
-  /* changing quality disables custom quantization tables, and vice-versa */
-  g_signal_connect (config, "notify::quality",
-                    G_CALLBACK (quality_changed),
-                    NULL);
-
   /* File size label. */
   preview_size = gimp_procedure_dialog_get_label (GIMP_PROCEDURE_DIALOG (dialog),
                                                   "preview-size", _("File size: unknown"),
@@ -282,7 +1370,22 @@ save_dialog (GimpProcedure       *procedure,
                              PANGO_ATTR_STYLE, PANGO_STYLE_ITALIC,
                              -1);
   gimp_help_set_help_data (preview_size,
-                           _("Enable preview to obtain the file size."), NULL);
+                           _("Estimated from a few sample encodes. "
+                             "Enable preview to obtain the exact file size."), NULL);
+
+
+  /* Preset trade-off label. */
+  preset_tradeoff = gimp_procedure_dialog_get_label (GIMP_PROCEDURE_DIALOG (dialog),
+                                                     "preset-tradeoff", "",
+                                                     FALSE, FALSE);
+  gtk_label_set_xalign (GTK_LABEL (preset_tradeoff), 0.0);
+  gimp_label_set_attributes (GTK_LABEL (preset_tradeoff),
+                             PANGO_ATTR_STYLE, PANGO_STYLE_ITALIC,
+                             -1);
+  gimp_help_set_help_data (preset_tradeoff,
+                           _("Estimated size of each preset at the current settings, "
+                             "from sample encodes of this image. Fastest trades a "
+                             "slightly larger file for a quicker encode."), NULL);
 
 
   /* Profile label. */
@@ -315,18 +1418,29 @@ save_dialog (GimpProcedure       *procedure,
 
   /* Put options in two column form so the dialog fits on
    * smaller screens. */
-  gimp_procedure_dialog_fill_box (GIMP_PROCEDURE_DIALOG (dialog),
+  box = gimp_procedure_dialog_fill_box (GIMP_PROCEDURE_DIALOG (dialog),
                                   "options",
                                   "quality",
-
+                                  "target-size",
+                                  "layer-qualities",
+                                  "layer-rates",
+                                  "progression",
+                                  "preset",
+                                  "preset-tradeoff",
+                                  "show-preview",
+                                  "preview-size",
                                   NULL);
+  add_sweep_widgets (box, config);
+
   gimp_procedure_dialog_fill_frame (GIMP_PROCEDURE_DIALOG (dialog),
                                     "option-frame", "option-title", FALSE,
                                     "options");
 
   gimp_procedure_dialog_fill_box (GIMP_PROCEDURE_DIALOG (dialog),
                                   "advanced-options",
-
+                                  "tile-size",
+                                  "threads",
+                                  "preview-threads",
                                   NULL);
   gimp_procedure_dialog_fill_frame (GIMP_PROCEDURE_DIALOG (dialog),
                                     "advanced-frame", "advanced-title", FALSE,
@@ -342,6 +1456,10 @@ save_dialog (GimpProcedure       *procedure,
   gimp_procedure_dialog_fill (GIMP_PROCEDURE_DIALOG (dialog),
                               "jpeg-hbox", NULL);
 
+  preview_image  = image;
+  preview_source = drawable;
+  preview_format = format;
+
   /* Run make_preview() when various config are changed. */
   g_signal_connect (config, "notify",
                     G_CALLBACK (make_preview),
@@ -352,6 +1470,8 @@ save_dialog (GimpProcedure       *procedure,
   run = gimp_procedure_dialog_run (GIMP_PROCEDURE_DIALOG (dialog));
   gtk_widget_destroy (dialog);
 
+  g_signal_handlers_disconnect_by_func (config, make_preview, NULL);
+
   destroy_preview ();
 
   return run;
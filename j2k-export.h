@@ -34,10 +34,29 @@ typedef enum
 GimpPDBStatusType   export_image (GFile         *file,
                                   GimpImage     *image,
                                   GimpDrawable  *drawable,
+                                  GimpImage     *orig_image,
                                   GimpRunMode    run_mode,
                                   GimpProcedure *procedure,
                                   GObject       *config,
                                   GError       **error);
 
+GimpPDBStatusType   estimate_size (GimpDrawable  *drawable,
+                                   gdouble        quality,
+                                   gboolean       exact,
+                                   gdouble       *estimated_size,
+                                   gdouble       *exact_size,
+                                   GError       **error);
+
+GimpPDBStatusType   export_batch (GimpDrawable **drawables,
+                                  const gchar  **filenames,
+                                  gint           num_files,
+                                  GObject       *config,
+                                  gint           jobs,
+                                  gint32        *statuses,
+                                  gdouble       *sizes,
+                                  gdouble       *fetch_times,
+                                  gdouble       *encode_times,
+                                  GError       **error);
+
 
 #endif /* __BMP_EXPORT_H__ */
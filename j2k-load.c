@@ -19,6 +19,8 @@
  */
 
 
+#include "j2k.h"
+
 #if ENABLE_J2K_READ_THIS_PLUGIN
 
 #include "config.h"
@@ -29,27 +31,267 @@
 #include <glib/gstdio.h>
 
 #include <libgimp/gimp.h>
+#include <libgimp/gimpui.h>
 
-#include "j2k.h"
 #include "j2k-load.h"
 
 #include "libgimp/stdplugins-intl.h"
 
 #include "main.h"
+#include "image_j2k.h"
+#include "trace_j2k.h"
+
+
+static Header_Info  header_info;
+static gboolean     header_valid = FALSE;
+static GtkWidget   *result_size  = NULL;
+
+
+/* Decode options from the load arguments, clipped to the image described
+ * by header, so reduce never exceeds the available resolution levels and a
+ * zero region width or height extends to the image edge.
+ */
+static void
+get_decode_options (GObject           *config,
+                    const Header_Info *header,
+                    Decode_Options    *options)
+{
+  gint reduce, x, y, width, height, threads;
 
+  g_object_get (config,
+                "reduce",        &reduce,
+                "region-x",      &x,
+                "region-y",      &y,
+                "region-width",  &width,
+                "region-height", &height,
+                "threads",       &threads,
+                NULL);
 
-GimpImage *image_to_gimp(opj_image_t *image, const char *filename, gboolean preview);
+  memset (options, 0, sizeof (Decode_Options));
+
+  options->reduce      = reduce;
+  options->num_threads = threads;
+
+  if (header && header->num_resolutions > 0)
+    options->reduce = MIN (options->reduce, header->num_resolutions - 1);
+
+  if (x == 0 && y == 0 && width == 0 && height == 0)
+    return;
+
+  options->x0 = x;
+  options->y0 = y;
+  options->x1 = width  ? (guint) x + width  : (header ? header->width  : G_MAXINT);
+  options->y1 = height ? (guint) y + height : (header ? header->height : G_MAXINT);
+
+  if (header)
+    {
+      options->x1 = MIN (options->x1, header->width);
+      options->y1 = MIN (options->y1, header->height);
+    }
+}
 
 GimpImage *
-load_image (GFile *gfile, GError **error)
+load_image (GFile   *gfile,
+            GObject *config,
+            GError **error)
 {
+	Decode_Options options;
+	Header_Info    header;
+	gchar         *path;
+	gboolean       have_header;
+
 	gimp_progress_init_printf (_("Opening '%s'"), gimp_file_get_utf8_name (gfile));
 
-	const gchar *path = g_file_get_path(gfile);
+	path = g_file_get_path (gfile);
+
+	gint64 start = Trace_Begin();
+
+	have_header = image_load_header (path, &header);
+	get_decode_options (config, have_header ? &header : NULL, &options);
+
+	if (have_header && (options.x1 > 0) && ((options.x0 >= options.x1) || (options.y0 >= options.y1)))
+	{
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		             _("Region lies outside the %u x %u image '%s'"),
+		             header.width, header.height, gimp_file_get_utf8_name (gfile));
+		g_free (path);
+		return NULL;
+	}
+
+	GimpImage *image = image_load_to_gimp (path, &options);
+
+	if (! image)
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		             _("Could not decode '%s'"), gimp_file_get_utf8_name (gfile));
+
+	Trace_End("load", start, 0);
+	Trace_Flush();
+
+	g_free (path);
+
+	return image;
+}
+
+
+/* Decodes just enough for a thumbnail of size pixels : the smallest
+ * resolution level that still covers size, colour components only.
+ * width, height and type describe the full image from its header.
+ */
+GimpImage *
+load_thumbnail_image (GFile          *gfile,
+                      gint            size,
+                      gint           *width,
+                      gint           *height,
+                      GimpImageType  *type,
+                      GError        **error)
+{
+  static const GimpImageType types[] = { GIMP_GRAY_IMAGE, GIMP_GRAYA_IMAGE,
+                                         GIMP_RGB_IMAGE,  GIMP_RGBA_IMAGE };
+  Decode_Options  options;
+  Header_Info     header;
+  GimpImage      *image = NULL;
+  gchar          *path;
+
+  path = g_file_get_path (gfile);
+
+  gint64 start = Trace_Begin();
+
+  if (! image_load_header (path, &header) ||
+      header.num_components < 1 || header.num_components > 4)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Could not read the header of '%s'"),
+                   gimp_file_get_utf8_name (gfile));
+      g_free (path);
+      return NULL;
+    }
+
+  memset (&options, 0, sizeof (Decode_Options));
+  options.reduce         = Header_ReduceForSize (&header, MAX (size, 1));
+  options.num_components = (header.num_components == 2 || header.num_components == 4) ?
+                           header.num_components - 1 : 0;
+
+  image = image_load_to_gimp (path, &options);
+
+  Trace_End("load_thumbnail", start, 0);
+  Trace_Flush();
+
+  if (! image)
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 _("Could not decode '%s'"), gimp_file_get_utf8_name (gfile));
+
+  *width  = header.width;
+  *height = header.height;
+  *type   = types[header.num_components - 1];
+
+  g_free (path);
+
+  return image;
+}
+
+
+static void
+show_result_size (GimpProcedureConfig *config)
+{
+  Decode_Options options;
+  guint          width, height, scale;
+  gchar         *text;
+
+  if (! header_valid)
+    return;
+
+  get_decode_options (G_OBJECT (config), &header_info, &options);
+
+  width  = header_info.width;
+  height = header_info.height;
+
+  if (options.x1 > 0)
+    {
+      width  = options.x1 > options.x0 ? options.x1 - options.x0 : 0;
+      height = options.y1 > options.y0 ? options.y1 - options.y0 : 0;
+    }
+
+  scale  = 1u << options.reduce;
+  width  = (width  + scale - 1) / scale;
+  height = (height + scale - 1) / scale;
+
+  if (width == 0 || height == 0)
+    text = g_strdup (_("Region lies outside the image"));
+  else
+    text = g_strdup_printf (_("Opens as %u x %u pixels"), width, height);
+
+  gtk_label_set_text (GTK_LABEL (result_size), text);
+  g_free (text);
+}
+
+/* The header is read first, so the dialog can describe the full image and
+ * the resolution levels on offer before anything is decoded.
+ */
+gboolean
+load_dialog (GimpProcedure       *procedure,
+             GimpProcedureConfig *config,
+             GFile               *file)
+{
+  GtkWidget *dialog;
+  GtkWidget *header_label;
+  gchar     *path;
+  gchar     *text;
+  gboolean   run;
+
+  path = g_file_get_path (file);
+  header_valid = image_load_header (path, &header_info);
+  g_free (path);
+
+  if (header_valid)
+    text = g_strdup_printf (_("%u x %u pixels, %u components at %u bits\n"
+                              "%u resolution levels, %u quality layers, %u x %u tiles"),
+                            header_info.width, header_info.height,
+                            header_info.num_components, header_info.precision,
+                            header_info.num_resolutions, header_info.num_layers,
+                            header_info.tile_width, header_info.tile_height);
+  else
+    text = g_strdup (_("Unreadable header"));
+
+  dialog = gimp_procedure_dialog_new (procedure, config, _("Open JPEG-2000"));
+
+  header_label = gimp_procedure_dialog_get_label (GIMP_PROCEDURE_DIALOG (dialog),
+                                                  "header-info", text,
+                                                  FALSE, FALSE);
+  gtk_label_set_xalign (GTK_LABEL (header_label), 0.0);
+  g_free (text);
+
+  result_size = gimp_procedure_dialog_get_label (GIMP_PROCEDURE_DIALOG (dialog),
+                                                 "result-size", "",
+                                                 FALSE, FALSE);
+  gtk_label_set_xalign (GTK_LABEL (result_size), 0.0);
+  gimp_label_set_attributes (GTK_LABEL (result_size),
+                             PANGO_ATTR_STYLE, PANGO_STYLE_ITALIC,
+                             -1);
+
+  gimp_procedure_dialog_fill (GIMP_PROCEDURE_DIALOG (dialog),
+                              "header-info",
+                              "reduce",
+                              "region-x",
+                              "region-y",
+                              "region-width",
+                              "region-height",
+                              "result-size",
+                              "threads",
+                              NULL);
+
+  g_signal_connect (config, "notify",
+                    G_CALLBACK (show_result_size),
+                    NULL);
+
+  show_result_size (config);
+
+  run = gimp_procedure_dialog_run (GIMP_PROCEDURE_DIALOG (dialog));
+  gtk_widget_destroy (dialog);
+
+  g_signal_handlers_disconnect_by_func (config, show_result_size, NULL);
+  result_size = NULL;
 
-	opj_image_t *img = image_load(path);
-	
-	return image_to_gimp(img, path, false);
+  return run;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -20,8 +20,20 @@
 #define __BMP_LOAD_H__
 
 
-GimpImage * load_image (GFile   *file,
-                        GError **error);
+GimpImage * load_image  (GFile               *file,
+                         GObject             *config,
+                         GError             **error);
+
+GimpImage * load_thumbnail_image (GFile          *file,
+                                  gint            size,
+                                  gint           *width,
+                                  gint           *height,
+                                  GimpImageType  *type,
+                                  GError        **error);
+
+gboolean    load_dialog (GimpProcedure       *procedure,
+                         GimpProcedureConfig *config,
+                         GFile               *file);
 
 
 #endif /* __BMP_LOAD_H__ */
@@ -63,6 +63,11 @@ static GimpValueArray * j2k_load             (GimpProcedure         *procedure,
                                               GimpMetadataLoadFlags *flags,
                                               GimpProcedureConfig   *config,
                                               gpointer               run_data);
+static GimpValueArray * j2k_load_thumb       (GimpProcedure         *procedure,
+                                              GFile                 *file,
+                                              gint                   size,
+                                              GimpProcedureConfig   *config,
+                                              gpointer               run_data);
 static GimpValueArray * j2k_export           (GimpProcedure         *procedure,
                                               GimpRunMode            run_mode,
                                               GimpImage             *image,
@@ -71,6 +76,12 @@ static GimpValueArray * j2k_export           (GimpProcedure         *procedure,
                                               GimpMetadata          *metadata,
                                               GimpProcedureConfig   *config,
                                               gpointer               run_data);
+static GimpValueArray * j2k_estimate         (GimpProcedure         *procedure,
+                                              GimpProcedureConfig   *config,
+                                              gpointer               run_data);
+static GimpValueArray * j2k_export_batch     (GimpProcedure         *procedure,
+                                              GimpProcedureConfig   *config,
+                                              gpointer               run_data);
 
 
 
@@ -95,6 +106,87 @@ j2k_init (J2K *j2k)
 {
 }
 
+/* Encoder settings shared by the export & batch export procedures, read
+ * back by get_save_parameters(). */
+static void
+add_encoder_arguments (GimpProcedure *procedure)
+{
+  gimp_procedure_add_double_argument (procedure, "quality",
+                                      _("_Quality"),
+                                      _("Quality of exported image"),
+                                      0.0, 1.0, 0.9,
+                                      G_PARAM_READWRITE);
+
+  gimp_procedure_add_int_argument (procedure, "target-size",
+                                   _("Target si_ze (kB)"),
+                                   _("Export at the highest quality that fits this file size "
+                                     "in kilobytes (0 = use quality)"),
+                                   0, G_MAXINT, 0,
+                                   G_PARAM_READWRITE);
+
+  gimp_procedure_add_string_argument (procedure, "layer-qualities",
+                                      _("_Layer qualities"),
+                                      _("Comma separated quality (0 - 1) of each quality layer, "
+                                        "coarse to fine. Viewers can show the first layers "
+                                        "before the whole file is read (empty = single layer "
+                                        "at quality)"),
+                                      "",
+                                      G_PARAM_READWRITE);
+
+  gimp_procedure_add_string_argument (procedure, "layer-rates",
+                                      _("Layer _rates"),
+                                      _("Comma separated compression ratio of each quality "
+                                        "layer, coarse to fine, e.g. \"80,20,5\" (1 = lossless). "
+                                        "Overrides layer qualities"),
+                                      "",
+                                      G_PARAM_READWRITE);
+
+  gimp_procedure_add_choice_argument (procedure, "progression",
+                                      _("_Progression order"),
+                                      _("Order of the codestream packets: by layer, "
+                                        "resolution, position (precinct) or component first"),
+                                      gimp_choice_new_with_values ("lrcp", 0, _("Layer (LRCP)"),      NULL,
+                                                                   "rlcp", 1, _("Resolution (RLCP)"), NULL,
+                                                                   "rpcl", 2, _("Resolution, position (RPCL)"), NULL,
+                                                                   "pcrl", 3, _("Position (PCRL)"),   NULL,
+                                                                   "cprl", 4, _("Component (CPRL)"),  NULL,
+                                                                   NULL),
+                                      "lrcp",
+                                      G_PARAM_READWRITE);
+
+  gimp_procedure_add_choice_argument (procedure, "preset",
+                                      _("Encoder _preset"),
+                                      _("Code-block coding options, trading encode time "
+                                        "against file size at the same quality"),
+                                      gimp_choice_new_with_values ("fastest",  1, _("Fastest"),
+                                                                   _("Bypasses arithmetic coding of the low bit planes, "
+                                                                     "9/7 wavelet when lossy: quickest encode, lossy "
+                                                                     "files slightly larger than smallest's"),
+                                                                   "balanced", 0, _("Balanced"),
+                                                                   _("OpenJPEG's default coding options"),
+                                                                   "smallest", 2, _("Smallest"),
+                                                                   _("9/7 wavelet & an extra resolution level: smallest "
+                                                                     "lossy files, encodes about as quickly as balanced"),
+                                                                   NULL),
+                                      "balanced",
+                                      G_PARAM_READWRITE);
+
+  gimp_procedure_add_int_argument (procedure, "tile-size",
+                                   _("_Tile size"),
+                                   _("Encode tile by tile with tiles of this size, "
+                                     "bounding memory use by the tile size "
+                                     "(0 = whole image as a single tile)"),
+                                   0, 16384, 0,
+                                   G_PARAM_READWRITE);
+
+  gimp_procedure_add_int_argument (procedure, "threads",
+                                   _("T_hreads"),
+                                   _("Number of encoder threads "
+                                     "(0 = automatic, use all available cores)"),
+                                   0, 256, 0,
+                                   G_PARAM_READWRITE);
+}
+
 static GList *
 j2k_query_procedures (GimpPlugIn *plug_in)
 {
@@ -102,9 +194,12 @@ j2k_query_procedures (GimpPlugIn *plug_in)
 
 #if ENABLE_J2K_READ_THIS_PLUGIN
   list = g_list_append (list, g_strdup (LOAD_PROC));
+  list = g_list_append (list, g_strdup (LOAD_THUMB_PROC));
 #endif
 
   list = g_list_append (list, g_strdup (EXPORT_PROC));
+  list = g_list_append (list, g_strdup (ESTIMATE_PROC));
+  list = g_list_append (list, g_strdup (BATCH_EXPORT_PROC));
 
   return list;
 }
@@ -134,11 +229,73 @@ j2k_create_procedure (GimpPlugIn  *plug_in,
                                       "2025");
 
       gimp_file_procedure_set_mime_types (GIMP_FILE_PROCEDURE (procedure),
-                                          "image/j2k");
+                                          "image/j2k,image/jp2");
       gimp_file_procedure_set_extensions (GIMP_FILE_PROCEDURE (procedure),
-                                          "j2k");
-      gimp_file_procedure_set_magics (GIMP_FILE_PROCEDURE (procedure),   // TODO: Review this.
-                                      "0,string,BM");
+                                          "j2k,j2c,jpc,jp2");
+
+      /* JP2 signature box type at 4, raw codestream SOC + SIZ markers at 0.
+       * Escaped for GIMP's magic parser, so pluginrc stays plain text. */
+      gimp_file_procedure_set_magics (GIMP_FILE_PROCEDURE (procedure),
+                                      "4,string,jP\\x20\\x20,"
+                                      "0,string,\\xff\\x4f\\xff\\x51");
+
+      gimp_load_procedure_set_thumbnail_loader (GIMP_LOAD_PROCEDURE (procedure),
+                                                LOAD_THUMB_PROC);
+
+      gimp_procedure_add_int_argument (procedure, "reduce",
+                                       _("_Reduce"),
+                                       _("Discard this many of the highest resolution levels, "
+                                         "each halving width and height. Only the data of the "
+                                         "remaining levels is decoded"),
+                                       0, 32, 0,
+                                       G_PARAM_READWRITE);
+
+      gimp_procedure_add_int_argument (procedure, "region-x",
+                                       _("Region _X"),
+                                       _("Left edge of the region to decode, in full resolution pixels"),
+                                       0, G_MAXINT, 0,
+                                       G_PARAM_READWRITE);
+
+      gimp_procedure_add_int_argument (procedure, "region-y",
+                                       _("Region _Y"),
+                                       _("Top edge of the region to decode, in full resolution pixels"),
+                                       0, G_MAXINT, 0,
+                                       G_PARAM_READWRITE);
+
+      gimp_procedure_add_int_argument (procedure, "region-width",
+                                       _("Region _width"),
+                                       _("Width of the region to decode (0 = to the right edge)"),
+                                       0, G_MAXINT, 0,
+                                       G_PARAM_READWRITE);
+
+      gimp_procedure_add_int_argument (procedure, "region-height",
+                                       _("Region _height"),
+                                       _("Height of the region to decode (0 = to the bottom edge)"),
+                                       0, G_MAXINT, 0,
+                                       G_PARAM_READWRITE);
+
+      gimp_procedure_add_int_argument (procedure, "threads",
+                                       _("T_hreads"),
+                                       _("Number of decoder threads "
+                                         "(0 = automatic, use all available cores)"),
+                                       0, 256, 0,
+                                       G_PARAM_READWRITE);
+    }
+  else if (! strcmp (name, LOAD_THUMB_PROC))
+    {
+      procedure = gimp_thumbnail_procedure_new (plug_in, name,
+                                                GIMP_PDB_PROC_TYPE_PLUGIN,
+                                                j2k_load_thumb, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Loads a thumbnail from a jpeg-2000 file"),
+                                        _("Decodes only the smallest resolution level "
+                                          "covering the requested size, without alpha"),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Advance Software",
+                                      "Advance Software",
+                                      "2025");
     }
   else
 	  
@@ -177,11 +334,14 @@ j2k_create_procedure (GimpPlugIn  *plug_in,
                                               GIMP_EXPORT_CAN_HANDLE_INDEXED,
                                               NULL, NULL, NULL);
 
-      gimp_procedure_add_double_argument (procedure, "quality",
-                                          _("_Quality"),
-                                          _("Quality of exported image"),
-                                          0.0, 1.0, 0.9,
-                                          G_PARAM_READWRITE);
+      add_encoder_arguments (procedure);
+
+      gimp_procedure_add_int_aux_argument (procedure, "preview-threads",
+                                           _("Pre_view threads"),
+                                           _("Number of threads used to encode the export preview "
+                                             "(0 = automatic, use all available cores)"),
+                                           0, 256, 0,
+                                           G_PARAM_READWRITE);
    
       gimp_procedure_add_boolean_aux_argument (procedure, "show-preview",
                                                _("Sho_w preview in image window"),
@@ -190,6 +350,117 @@ j2k_create_procedure (GimpPlugIn  *plug_in,
                                                G_PARAM_READWRITE);
 
     }
+  else if (! strcmp (name, ESTIMATE_PROC))
+    {
+      procedure = gimp_procedure_new (plug_in, name,
+                                      GIMP_PDB_PROC_TYPE_PLUGIN,
+                                      j2k_estimate, NULL, NULL);
+
+      gimp_procedure_set_image_types (procedure, "GRAY, RGB*");
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Estimates the size of a drawable exported as J2K"),
+                                        _("Predicts the size in bytes of the drawable exported "
+                                          "as J2K at the given quality, from a few small sample "
+                                          "encodes, without writing a file. Optionally also "
+                                          "encodes the whole drawable in memory for the exact "
+                                          "size."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Advance Software",
+                                      "Advance Software",
+                                      "2025");
+
+      gimp_procedure_add_drawable_argument (procedure, "drawable",
+                                            _("_Drawable"),
+                                            _("Drawable to estimate"),
+                                            FALSE,
+                                            G_PARAM_READWRITE);
+
+      gimp_procedure_add_double_argument (procedure, "quality",
+                                          _("_Quality"),
+                                          _("Quality to estimate, as for export"),
+                                          0.0, 1.0, 0.9,
+                                          G_PARAM_READWRITE);
+
+      gimp_procedure_add_boolean_argument (procedure, "exact",
+                                           _("E_xact"),
+                                           _("Also encode the whole drawable for the exact size"),
+                                           FALSE,
+                                           G_PARAM_READWRITE);
+
+      gimp_procedure_add_double_return_value (procedure, "estimated-size",
+                                              _("Estimated size"),
+                                              _("Predicted size in bytes"),
+                                              0.0, G_MAXDOUBLE, 0.0,
+                                              G_PARAM_READWRITE);
+
+      gimp_procedure_add_double_return_value (procedure, "exact-size",
+                                              _("Exact size"),
+                                              _("Encoded size in bytes (0 unless exact)"),
+                                              0.0, G_MAXDOUBLE, 0.0,
+                                              G_PARAM_READWRITE);
+    }
+  else if (! strcmp (name, BATCH_EXPORT_PROC))
+    {
+      procedure = gimp_procedure_new (plug_in, name,
+                                      GIMP_PDB_PROC_TYPE_PLUGIN,
+                                      j2k_export_batch, NULL, NULL);
+
+      gimp_procedure_set_documentation (procedure,
+                                        _("Exports drawables to J2K files in parallel"),
+                                        _("Exports each drawable to the file of the same index "
+                                          "with the same settings, encoding several files at "
+                                          "once while the next drawables are read. A failed "
+                                          "file doesn't stop the batch: its status is 0, 1 for "
+                                          "each file written."),
+                                        name);
+      gimp_procedure_set_attribution (procedure,
+                                      "Advance Software",
+                                      "Advance Software",
+                                      "2025");
+
+      gimp_procedure_add_core_object_array_argument (procedure, "drawables",
+                                                     _("_Drawables"),
+                                                     _("Drawables to export"),
+                                                     GIMP_TYPE_DRAWABLE,
+                                                     G_PARAM_READWRITE);
+
+      gimp_procedure_add_string_array_argument (procedure, "filenames",
+                                                _("_Filenames"),
+                                                _("Output file of each drawable"),
+                                                G_PARAM_READWRITE);
+
+      add_encoder_arguments (procedure);
+
+      gimp_procedure_add_int_argument (procedure, "jobs",
+                                       _("_Jobs"),
+                                       _("Number of files encoded at once, the encoder "
+                                         "threads being shared between them "
+                                         "(0 = automatic, one per core)"),
+                                       0, 256, 0,
+                                       G_PARAM_READWRITE);
+
+      gimp_procedure_add_int32_array_return_value (procedure, "statuses",
+                                                   _("Statuses"),
+                                                   _("1 for each file written, 0 for each failure"),
+                                                   G_PARAM_READWRITE);
+
+      gimp_procedure_add_double_array_return_value (procedure, "sizes",
+                                                    _("Sizes"),
+                                                    _("Size in bytes of each file written"),
+                                                    G_PARAM_READWRITE);
+
+      gimp_procedure_add_double_array_return_value (procedure, "fetch-times",
+                                                    _("Fetch times"),
+                                                    _("Seconds spent reading each drawable"),
+                                                    G_PARAM_READWRITE);
+
+      gimp_procedure_add_double_array_return_value (procedure, "encode-times",
+                                                    _("Encode times"),
+                                                    _("Seconds spent encoding & writing each file"),
+                                                    G_PARAM_READWRITE);
+    }
 
   return procedure;
 }
@@ -209,7 +480,17 @@ j2k_load (GimpProcedure         *procedure,
 
   gegl_init (NULL, NULL);
 
-  image = load_image (file, &error);
+  if (run_mode == GIMP_RUN_INTERACTIVE)
+    {
+      gimp_ui_init (PLUG_IN_BINARY);
+
+      if (! load_dialog (procedure, config, file))
+        return gimp_procedure_new_return_values (procedure,
+                                                 GIMP_PDB_CANCEL,
+                                                 NULL);
+    }
+
+  image = load_image (file, G_OBJECT (config), &error);
 
   if (! image)
     return gimp_procedure_new_return_values (procedure,
@@ -226,6 +507,43 @@ j2k_load (GimpProcedure         *procedure,
 }
 
 
+static GimpValueArray *
+j2k_load_thumb (GimpProcedure       *procedure,
+                GFile               *file,
+                gint                 size,
+                GimpProcedureConfig *config,
+                gpointer             run_data)
+{
+  GimpValueArray *return_vals;
+  GimpImage      *image;
+  GimpImageType   type   = GIMP_RGB_IMAGE;
+  gint            width  = 0;
+  gint            height = 0;
+  GError         *error  = NULL;
+
+  gegl_init (NULL, NULL);
+
+  image = load_thumbnail_image (file, size, &width, &height, &type, &error);
+
+  if (! image)
+    return gimp_procedure_new_return_values (procedure,
+                                             GIMP_PDB_EXECUTION_ERROR,
+                                             error);
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_IMAGE (return_vals, 1, image);
+  GIMP_VALUES_SET_INT   (return_vals, 2, width);
+  GIMP_VALUES_SET_INT   (return_vals, 3, height);
+  GIMP_VALUES_SET_ENUM  (return_vals, 4, type);
+  GIMP_VALUES_SET_INT   (return_vals, 5, 1);
+
+  return return_vals;
+}
+
+
 static GimpValueArray *
 j2k_export (GimpProcedure        *procedure,
             GimpRunMode           run_mode,
@@ -238,11 +556,11 @@ j2k_export (GimpProcedure        *procedure,
 {
   GimpPDBStatusType  status = GIMP_PDB_SUCCESS;
   GimpExportReturn   export = GIMP_EXPORT_IGNORE;
+  GimpImage         *orig_image = image;
   GList             *drawables;
   GError            *error  = NULL;
   gdouble dquality;
   gint    quality;
-  gboolean show_preview = FALSE;
   gboolean undo_touched = FALSE;
 
   gegl_init (NULL, NULL);
@@ -269,24 +587,139 @@ j2k_export (GimpProcedure        *procedure,
    {
       gimp_ui_init (PLUG_IN_BINARY);
 
-      g_object_get (config, "show-preview", &show_preview, NULL);
-      if (show_preview)
-	  {
-		  /* we freeze undo saving so that we can avoid sucking up
-           * tile cache with our unneeded preview steps. */
-          gimp_image_undo_freeze (image);
+      /* we freeze undo saving so that we can avoid sucking up
+       * tile cache with our unneeded preview steps. The preview
+       * can be switched on from the dialog, so always do so. */
+      gimp_image_undo_freeze (orig_image);
 
-          undo_touched = TRUE;
-	  }
+      undo_touched = TRUE;
    }
 
-  status = export_image (file, image, drawables->data, run_mode,
+  status = export_image (file, image, drawables->data, orig_image, run_mode,
                          procedure, G_OBJECT (config),
                          &error);
 
+  if (undo_touched)
+    gimp_image_undo_thaw (orig_image);
+
   if (export == GIMP_EXPORT_EXPORT)
     gimp_image_delete (image);
 
   g_list_free (drawables);
   return gimp_procedure_new_return_values (procedure, status, error);
 }
+
+
+static GimpValueArray *
+j2k_estimate (GimpProcedure       *procedure,
+              GimpProcedureConfig *config,
+              gpointer             run_data)
+{
+  GimpValueArray    *return_vals;
+  GimpPDBStatusType  status;
+  GimpDrawable      *drawable;
+  GError            *error = NULL;
+  gdouble            quality;
+  gboolean           exact;
+  gdouble            estimated_size = 0;
+  gdouble            exact_size     = 0;
+
+  gegl_init (NULL, NULL);
+
+  g_object_get (config,
+                "drawable", &drawable,
+                "quality",  &quality,
+                "exact",    &exact,
+                NULL);
+
+  status = estimate_size (drawable, quality * 100.0, exact,
+                          &estimated_size, &exact_size, &error);
+
+  g_clear_object (&drawable);
+
+  if (status != GIMP_PDB_SUCCESS)
+    return gimp_procedure_new_return_values (procedure, status, error);
+
+  return_vals = gimp_procedure_new_return_values (procedure,
+                                                  GIMP_PDB_SUCCESS,
+                                                  NULL);
+
+  GIMP_VALUES_SET_DOUBLE (return_vals, 1, estimated_size);
+  GIMP_VALUES_SET_DOUBLE (return_vals, 2, exact_size);
+
+  return return_vals;
+}
+
+
+static GimpValueArray *
+j2k_export_batch (GimpProcedure       *procedure,
+                  GimpProcedureConfig *config,
+                  gpointer             run_data)
+{
+  GimpValueArray    *return_vals;
+  GimpPDBStatusType  status;
+  GimpDrawable     **drawables = NULL;
+  gchar            **filenames = NULL;
+  GError            *error     = NULL;
+  gint               jobs;
+  gint               num_files;
+  gint32            *statuses;
+  gdouble           *sizes;
+  gdouble           *fetch_times;
+  gdouble           *encode_times;
+
+  gegl_init (NULL, NULL);
+
+  g_object_get (config,
+                "drawables", &drawables,
+                "filenames", &filenames,
+                "jobs",      &jobs,
+                NULL);
+
+  num_files = drawables ? gimp_core_object_array_get_length ((GObject **) drawables) : 0;
+
+  if (num_files != (filenames ? g_strv_length (filenames) : 0))
+    {
+      g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   _("%d drawables but %d filenames"),
+                   num_files, filenames ? g_strv_length (filenames) : 0);
+
+      g_free (drawables);
+      g_strfreev (filenames);
+
+      return gimp_procedure_new_return_values (procedure,
+                                               GIMP_PDB_CALLING_ERROR,
+                                               error);
+    }
+
+  statuses     = g_new0 (gint32,  num_files);
+  sizes        = g_new0 (gdouble, num_files);
+  fetch_times  = g_new0 (gdouble, num_files);
+  encode_times = g_new0 (gdouble, num_files);
+
+  status = export_batch (drawables, (const gchar **) filenames, num_files,
+                         G_OBJECT (config), jobs,
+                         statuses, sizes, fetch_times, encode_times, &error);
+
+  g_free (drawables);
+  g_strfreev (filenames);
+
+  if (status != GIMP_PDB_SUCCESS)
+    {
+      g_free (statuses);
+      g_free (sizes);
+      g_free (fetch_times);
+      g_free (encode_times);
+
+      return gimp_procedure_new_return_values (procedure, status, error);
+    }
+
+  return_vals = gimp_procedure_new_return_values (procedure, status, NULL);
+
+  GIMP_VALUES_TAKE_INT32_ARRAY  (return_vals, 1, statuses,     num_files);
+  GIMP_VALUES_TAKE_DOUBLE_ARRAY (return_vals, 2, sizes,        num_files);
+  GIMP_VALUES_TAKE_DOUBLE_ARRAY (return_vals, 3, fetch_times,  num_files);
+  GIMP_VALUES_TAKE_DOUBLE_ARRAY (return_vals, 4, encode_times, num_files);
+
+  return return_vals;
+}
@@ -20,13 +20,16 @@
 #define __OPENJPG_H__
 
 #define LOAD_PROC      "file-openjpg-load"
+#define LOAD_THUMB_PROC "file-openjpg-load-thumb"
 #define EXPORT_PROC    "file-openjpg-export"
+#define ESTIMATE_PROC  "file-openjpg-estimate"
+#define BATCH_EXPORT_PROC "file-openjpg-export-batch"
 #define PLUG_IN_BINARY "file-openjpeg"
 #define PLUG_IN_ROLE   "gimp-file-openjpg"
 
-// Not used, common\file-jp2-load.c also uses openjpeg & appears sufficient for our needs.
-// This one still requires a little debugging to complete its implementation.
+// common\file-jp2-load.c also uses openjpeg but always decodes the whole image at full resolution.
+// This one can decode a window and / or a reduced resolution, chosen from the header before decoding.
 
-#define ENABLE_J2K_READ_THIS_PLUGIN 0
+#define ENABLE_J2K_READ_THIS_PLUGIN 1
 
 #endif /* __OPENJPG_H__ */
@@ -35,7 +35,6 @@ typedef int bool;
 
 
 
-#define LOAD_THUMB_PROC "j2k-load-thumb"
 #define SAVE_PROC       "j2k-save"
 
 
@@ -43,22 +42,76 @@ typedef int bool;
 #define DATA_KEY_UI_VALS "plug_in_j2k_ui"
 #define PARASITE_KEY     "plug-in-j2k-options"
 
-#define __ENABLE_PREVIEW_BACKGROUND_THREAD_EXIT_TIMEOUT 0
-
-extern gint32 volatile  preview_image_ID;
-extern gint32           preview_layer_ID;
-extern gchar           *image_comment;
-extern GimpDrawable    *drawable_global;
-extern gboolean         undo_touched;
-extern gint32           display_ID;
-
 typedef unsigned long int uint32;
 typedef unsigned char     uint8;
 
 
-opj_image_t *image_load(const gchar *filename);
-opj_image_t *decode_image(guint8 *src, uint32 file_length, bool format_codestream);
-GimpImage *image_to_gimp(opj_image_t *image, const char *filename, gboolean preview);
+typedef struct
+{
+   guint reduce;     // Highest resolution levels to discard, each halving width & height.
+   guint layers;     // Decode only the first layers quality layers. 0 = all.
+
+   guint x0, y0;     // Decode window in full resolution pixels, x1 & y1 exclusive. Empty (x1 = 0) = whole image.
+   guint x1, y1;     // Clipped to the image. Only the code-blocks it touches are decoded.
+
+   guint num_components;   // Decode only the first num_components components, e.g. colour without alpha. 0 = all.
+
+   gint  num_threads;      // Decoder worker threads. 0 = automatic (all available cores).
+
+} Decode_Options;
+
+
+// Codestream facts from the main header, read without decoding any image data.
+typedef struct
+{
+   guint width;
+   guint height;
+   guint num_components;
+   guint precision;        // Bits per sample of the first component.
+   guint num_resolutions;  // Reduce may be 0 .. num_resolutions - 1.
+   guint num_layers;
+   guint tile_width;       // Equal to the image size when untiled.
+   guint tile_height;
+
+} Header_Info;
+
+
+opj_image_t *image_load(const gchar *filename, const Decode_Options *options);
+
+
+// Receives a streaming decode : the decoded size first, then every tile's pixels as interleaved rows, in bands. Samples
+// are u8 (bytes_per_sample 1), or u16 in native byte order (2) for components deeper than 8 bits, scaled to 0 - 65535.
+// x & y are relative to the decoded image. Returning false from either callback aborts the decode.
+typedef struct
+{
+   bool (*begin)(void *user, guint width, guint height, guint num_components, guint bytes_per_sample);
+   bool (*rows)(void *user, const guchar *pixels, guint x, guint y, guint width, guint height);
+   void *user;
+
+} Tile_Sink;
+
+// As image_load, but the decoder holds one tile at a time & hands it to sink. Peak memory is a few tiles, not the image.
+bool image_load_tiles(const gchar *filename, const Decode_Options *options, const Tile_Sink *sink);
+
+
+// Identifies a raw codestream (SOC SIZ markers) or a JP2 file (signature box) from its first FORMAT_SNIFF_BYTES bytes.
+// false when neither.
+#define FORMAT_SNIFF_BYTES 12
+bool Format_Sniff(const guint8 *data, gsize len, bool *format_codestream);
+
+opj_image_t *decode_image(const guint8 *src, gsize length, bool format_codestream, const Decode_Options *options);
+
+// Reads only as far as the end of the main header.
+bool image_load_header(const gchar *filename, Header_Info *info);
+
+// Highest reduce whose image still covers size pixels in its larger dimension, for thumbnails.
+guint Header_ReduceForSize(const Header_Info *info, guint size);
+
+int  Decoder_NumThreads(const Decode_Options *options);   // options may be nullptr.
+
+bool Image_Supported(const opj_image_t *img);
+bool Image_ToInterleaved(const opj_image_t *image, guchar *dest, guint width, guint height, guint y, guint rows,
+                         const Decode_Options *options);   // options may be nullptr.
 
 
 #endif /* __GIMP_J2K_MAIN_H__ */
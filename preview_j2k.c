@@ -0,0 +1,490 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "main.h"
+#include "write_j2k.h"
+#include "preview_j2k.h"
+
+
+// Encode once preview : the draft is encoded with a ladder of quality layers, one rung per LADDER_STEP of quality. A quality
+// change then costs only a decode of the layers up to its rung. Drafts have no file size : scaled up from the downsampled
+// image they come out 20 - 35% small, so the dialog shows the estimator's prediction until the full resolution size arrives.
+
+#define LADDER_RUNGS 20
+#define LADDER_STEP  (QUALITY_MAX / LADDER_RUNGS)
+
+typedef struct
+{
+   guint8 *data;              // Ladder codestream. nullptr until built.
+   gsize   len;
+   guint   tile_size;         // Settings it was encoded with, besides quality.
+   Encoder_Preset preset;
+
+} Ladder;
+
+
+struct Preview_Engine
+{
+   GMutex   lock;
+   GCond    wake;
+   GThread *thread;
+
+   Image_Info source;          // source.cancel points at cancel.
+   gint       cancel;          // Set when the encode in flight has been overtaken.
+
+   Image_Info draft;           // Downsampled copy of source, made by the worker on first use.
+   guint      draft_factor;    // Source pixels per draft pixel along each axis. 1 = no draft needed.
+
+   Ladder     ladder;          // Of the draft. Worker only.
+
+   // Guarded by lock.
+   bool            quit;
+   bool            pending;    // params holds a request the worker hasn't started.
+   bool            pending_draft;
+   Save_Parameters params;
+   guint           generation; // Latest request.
+
+   Preview_Result  ready;      // Completed result awaiting delivery. image is nullptr when there's none.
+   guint           idle_id;
+
+   Preview_Result_CB callback;
+   void             *user_data;
+};
+
+
+typedef struct
+{
+   Preview_Engine *engine;
+   Preview_Result  result;
+   Decode_Options  decode;     // Decodes use the preview's thread count, as its encodes do.
+
+} Preview_Job;
+
+
+static void clear_result(Preview_Result *result)
+{
+   if (result->image)
+      opj_image_destroy(result->image);
+
+   memset(result, 0, sizeof(Preview_Result));
+}
+
+
+// Box filtered copy of src, factor x factor source pixels per draft pixel. Reads row bands through fetch for streamed sources.
+static bool MakeDraft(const Image_Info *src, guint factor, Image_Info *draft)
+{
+   guint bpp = src->num_components;
+   bool deep = Image_BytesPerSample(src) == 2;
+   gsize pitch = (gsize) src->width * Image_BytesPerPixel(src);
+   guint x, y, c, j;
+   guint64 *sums;   // 16 bit samples over a large factor overflow 32 bits.
+   guchar *band = nullptr;
+   bool ok = true;
+
+   memset(draft, 0, sizeof(Image_Info));
+
+   draft->width = (src->width + factor - 1) / factor;
+   draft->height = (src->height + factor - 1) / factor;
+   draft->num_components = bpp;
+   draft->bytes_per_sample = Image_BytesPerSample(src);
+   draft->cancel = src->cancel;
+   draft->data = g_try_malloc((gsize) draft->width * draft->height * Image_BytesPerPixel(src));
+
+   sums = g_try_new(guint64, draft->width * bpp);
+
+   if (!src->data)
+      band = g_try_malloc(pitch * factor);
+
+   if (!draft->data || !sums || (!src->data && !band))
+      ok = false;
+
+   for (y=0; ok && (y < draft->height); y++)
+   {
+      guint y0 = y * factor;
+      guint rows = MIN(factor, src->height - y0);
+      const guchar *src_rows = src->data ? src->data + y0 * pitch : band;
+      guchar *dest = draft->data + (gsize) y * draft->width * Image_BytesPerPixel(src);
+
+      if (!src->data)
+         ok = src->fetch(band, 0, y0, src->width, rows, src->fetch_user_data);
+
+      memset(sums, 0, draft->width * bpp * sizeof(guint64));
+
+      for (j=0; ok && (j < rows); j++)
+      {
+         const guchar *p = src_rows + j * pitch;
+         const guint16 *p16 = (const guint16 *) p;
+
+         if (deep)
+         {
+            for (x=0;x<src->width;x++, p16 += bpp)
+            {
+               guint64 *sum = sums + (x / factor) * bpp;
+
+               for (c=0;c<bpp;c++)
+                  sum[c] += p16[c];
+            }
+         }
+         else
+         {
+            for (x=0;x<src->width;x++, p += bpp)
+            {
+               guint64 *sum = sums + (x / factor) * bpp;
+
+               for (c=0;c<bpp;c++)
+                  sum[c] += p[c];
+            }
+         }
+      }
+
+      for (x=0;x<draft->width;x++)
+      {
+         guint n = MIN(factor, src->width - x * factor) * rows;
+
+         for (c=0;c<bpp;c++)
+         {
+            guint32 mean = (guint32) ((sums[x * bpp + c] + n / 2) / n);
+
+            if (deep)
+               ((guint16 *) dest)[x * bpp + c] = (guint16) mean;
+            else
+               dest[x * bpp + c] = (guchar) mean;
+         }
+      }
+   }
+
+   g_free(sums);
+   g_free(band);
+
+   if (!ok)
+   {
+      g_free(draft->data);
+      draft->data = nullptr;
+   }
+
+   return ok;
+}
+
+
+static bool decode_preview(void *buffer, int length, void *user_data)
+{
+   Preview_Job *job = (Preview_Job *) user_data;
+
+   // Decoding is as costly as encoding, so skip it if the encode just finished has already been overtaken.
+   if (g_atomic_int_get(&job->engine->cancel))
+      return false;
+
+   // Drafts' sizes aren't the export's, see the ladder.
+   if (!job->result.draft)
+      job->result.file_size = length;
+   job->result.image = decode_image(buffer, length, true, &job->decode);
+
+   return job->result.image != nullptr;
+}
+
+
+static bool keep_codestream(void *buffer, int length, void *user_data)
+{
+   Ladder *ladder = (Ladder *) user_data;
+
+   ladder->data = g_memdup2(buffer, length);
+   ladder->len = length;
+
+   return true;
+}
+
+
+static void FreeLadder(Ladder *ladder)
+{
+   g_free(ladder->data);
+   memset(ladder, 0, sizeof(Ladder));
+}
+
+
+// Only single layer, quality driven settings correspond to a rung.
+static bool LadderUsable(const Save_Parameters *params)
+{
+   return !params->target_size && !params->layer_rates && (params->num_layers <= 1);
+}
+
+
+// Every setting that changes the encode other than quality, which the rungs cover.
+static bool LadderMatches(const Ladder *ladder, const Save_Parameters *params)
+{
+   return ladder->data && (ladder->tile_size == params->tile_size) && (ladder->preset == params->preset);
+}
+
+
+static bool BuildLadder(Ladder *ladder, Image_Info *src, const Save_Parameters *params)
+{
+   Save_Parameters ladder_params = *params;
+   int i;
+
+   FreeLadder(ladder);
+
+   ladder_params.num_layers = LADDER_RUNGS;
+
+   for (i=0;i<LADDER_RUNGS;i++)
+      ladder_params.quality[i] = (i + 1) * LADDER_STEP;
+
+   if (!serialize_image(src, &ladder_params, true, keep_codestream, ladder))
+      return false;
+
+   ladder->tile_size = params->tile_size;
+   ladder->preset = params->preset;
+
+   return true;
+}
+
+
+static bool ScrubLadder(Preview_Engine *engine, Ladder *ladder, Image_Info *src, const Save_Parameters *params, Preview_Result *result)
+{
+   Decode_Options options;
+   int rung = CLAMP((int) (params->quality[0] / LADDER_STEP) - 1, 0, LADDER_RUNGS - 1);
+
+   if (!LadderMatches(ladder, params))
+   {
+      if (!BuildLadder(ladder, src, params))
+         return false;
+   }
+
+   if (g_atomic_int_get(&engine->cancel))
+      return false;
+
+   memset(&options, 0, sizeof(Decode_Options));
+   options.layers = rung + 1;
+   options.num_threads = params->num_threads;
+
+   result->image = decode_image(ladder->data, ladder->len, true, &options);
+
+   return result->image != nullptr;
+}
+
+
+// Main thread. Hands the latest result to the client unless a newer request has been made since.
+static gboolean deliver_result(gpointer user_data)
+{
+   Preview_Engine *engine = (Preview_Engine *) user_data;
+   Preview_Result result;
+   bool current;
+
+   g_mutex_lock(&engine->lock);
+
+   result = engine->ready;
+   memset(&engine->ready, 0, sizeof(Preview_Result));
+   engine->idle_id = 0;
+
+   current = result.image && (result.generation == engine->generation);
+
+   g_mutex_unlock(&engine->lock);
+
+   if (current)
+      engine->callback(&result, engine->user_data);
+
+   clear_result(&result);
+
+   return G_SOURCE_REMOVE;
+}
+
+
+static gpointer preview_thread(gpointer user_data)
+{
+   Preview_Engine *engine = (Preview_Engine *) user_data;
+   Save_Parameters params;
+   Preview_Job job;
+   Image_Info *src;
+   bool ok;
+
+   g_mutex_lock(&engine->lock);
+
+   for (;;)
+   {
+      while (!engine->quit && !engine->pending)
+         g_cond_wait(&engine->wake, &engine->lock);
+
+      if (engine->quit)
+         break;
+
+      params = engine->params;
+      engine->pending = false;
+
+      memset(&job, 0, sizeof(Preview_Job));
+      job.engine = engine;
+      job.decode.num_threads = params.num_threads;
+      job.result.generation = engine->generation;
+      job.result.draft = engine->pending_draft && (engine->draft_factor > 1);
+
+      // Reset under the lock so a request arriving from here on cancels this job.
+      g_atomic_int_set(&engine->cancel, 0);
+
+      g_mutex_unlock(&engine->lock);
+
+      src = &engine->source;
+      ok = true;
+
+      if (job.result.draft)
+      {
+         // Only the worker touches the draft, so it's safe to make it outside the lock.
+         ok = engine->draft.data || MakeDraft(&engine->source, engine->draft_factor, &engine->draft);
+
+         src = &engine->draft;
+
+         // Same bits per pixel as a full size target.
+         if (params.target_size)
+         {
+            double scale = ((double) engine->source.width * engine->source.height) / ((double) engine->draft.width * engine->draft.height);
+
+            params.target_size = MAX(1, params.target_size / scale);
+         }
+      }
+
+      if (ok)
+      {
+         ok = job.result.draft && LadderUsable(&params) && ScrubLadder(engine, &engine->ladder, src, &params, &job.result);
+
+         // Any other settings, or a ladder that failed to encode, take a full encode.
+         if (!ok && !g_atomic_int_get(&engine->cancel))
+         {
+            // An untiled encode writes nothing - so can't notice it's been overtaken - until it's finished. Tile large ones
+            // so a cancelled encode stops at the next tile, at the cost of a file size slightly off the export's.
+            if (!params.tile_size && (MAX(src->width, src->height) > DEFAULT_TILE_SIZE))
+            {
+               params.tile_size = DEFAULT_TILE_SIZE;
+               job.result.estimated = true;
+            }
+
+            ok = serialize_image(src, &params, true, decode_preview, &job);
+         }
+      }
+
+      g_mutex_lock(&engine->lock);
+
+      if (ok && !engine->quit && (job.result.generation == engine->generation))
+      {
+         // Replaces any result the main loop hasn't got round to yet.
+         clear_result(&engine->ready);
+         engine->ready = job.result;
+         memset(&job.result, 0, sizeof(Preview_Result));
+
+         if (!engine->idle_id)
+            engine->idle_id = g_idle_add(deliver_result, engine);
+      }
+
+      clear_result(&job.result);
+   }
+
+   g_mutex_unlock(&engine->lock);
+
+   return nullptr;
+}
+
+
+Preview_Engine *Preview_New(const Image_Info *source, Preview_Result_CB callback, void *user_data)
+{
+   Preview_Engine *engine = g_new0(Preview_Engine, 1);
+
+   g_mutex_init(&engine->lock);
+   g_cond_init(&engine->wake);
+
+   engine->source = *source;
+   engine->source.cancel = &engine->cancel;
+   engine->callback = callback;
+   engine->user_data = user_data;
+
+   engine->draft_factor = (MAX(source->width, source->height) + PREVIEW_DRAFT_SIZE - 1) / PREVIEW_DRAFT_SIZE;
+   engine->draft_factor = MAX(1, engine->draft_factor);
+
+   engine->thread = g_thread_new("j2k-preview", preview_thread, engine);
+
+   return engine;
+}
+
+
+guint Preview_Request(Preview_Engine *engine, const Save_Parameters *params, bool draft)
+{
+   guint generation;
+
+   g_mutex_lock(&engine->lock);
+
+   engine->params = *params;
+   engine->pending = true;
+   engine->pending_draft = draft;
+   generation = ++engine->generation;
+
+   // Abandon whatever the worker is doing - it's for settings the user has already left behind.
+   g_atomic_int_set(&engine->cancel, 1);
+
+   g_cond_signal(&engine->wake);
+   g_mutex_unlock(&engine->lock);
+
+   return generation;
+}
+
+
+void Preview_Cancel(Preview_Engine *engine)
+{
+   g_mutex_lock(&engine->lock);
+
+   engine->pending = false;
+   engine->generation++;   // Nothing outstanding is current any more.
+
+   g_atomic_int_set(&engine->cancel, 1);
+
+   g_mutex_unlock(&engine->lock);
+}
+
+
+bool Preview_HasDraft(const Preview_Engine *engine)
+{
+   return engine->draft_factor > 1;
+}
+
+
+void Preview_Free(Preview_Engine *engine)
+{
+   if (!engine)
+      return;
+
+   g_mutex_lock(&engine->lock);
+
+   engine->quit = true;
+   g_atomic_int_set(&engine->cancel, 1);
+
+   g_cond_signal(&engine->wake);
+   g_mutex_unlock(&engine->lock);
+
+   g_thread_join(engine->thread);
+
+   if (engine->idle_id)
+      g_source_remove(engine->idle_id);
+
+   clear_result(&engine->ready);
+   g_free(engine->draft.data);
+
+   FreeLadder(&engine->ladder);
+
+   g_cond_clear(&engine->wake);
+   g_mutex_clear(&engine->lock);
+
+   g_free(engine);
+}
@@ -0,0 +1,66 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+#ifndef __GIMP_PREVIEW_J2K_H__
+#define __GIMP_PREVIEW_J2K_H__
+
+
+// Export preview engine. A single worker thread encodes & decodes the latest requested settings. Requests made while it's
+// busy replace any request still waiting & cancel the encode in flight, so it only ever works on what the user last asked for.
+// Results are delivered on the main loop. Those overtaken by a newer request are dropped.
+//
+// Draft requests encode a copy downsampled to at most PREVIEW_DRAFT_SIZE on its longest side, fast enough to follow a
+// slider being dragged. They carry no file size : the downsampled image compresses better than the full one.
+//
+// Single layer, quality driven drafts are previewed from a codestream encoded once with a ladder of quality layers : a
+// quality change decodes only the layers up to its rung. Other drafts are encoded for each request. Full resolution
+// requests are encoded as exported so the file size is exact - except that untiled settings are previewed tiled on images larger than a tile, so an
+// overtaken encode can be abandoned part way.
+
+#define PREVIEW_DRAFT_SIZE 512
+
+typedef struct Preview_Engine Preview_Engine;
+
+typedef struct
+{
+   guint        generation;    // Request answered, as returned by Preview_Request.
+   bool         draft;         // Reduced resolution result. image is smaller than the source & file_size is 0.
+   bool         estimated;     // file_size is close to, not exactly, the exported file's.
+   guint64      file_size;     // Encoded size, bytes. Full resolution results only.
+   opj_image_t *image;         // Decoded preview. Owned by the engine, valid for the duration of the callback.
+
+} Preview_Result;
+
+typedef void (*Preview_Result_CB)(const Preview_Result *result, void *user_data);
+
+
+// source must remain valid until Preview_Free. Its cancel field is managed by the engine.
+Preview_Engine *Preview_New(const Image_Info *source, Preview_Result_CB callback, void *user_data);
+
+guint Preview_Request(Preview_Engine *engine, const Save_Parameters *params, bool draft);
+void  Preview_Cancel(Preview_Engine *engine);
+
+// False when the source is already no larger than a draft, so draft requests are full previews.
+bool  Preview_HasDraft(const Preview_Engine *engine);
+
+// Cancels outstanding work & waits for the worker to exit. No callbacks are made after this returns.
+void  Preview_Free(Preview_Engine *engine);
+
+
+#endif
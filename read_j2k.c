@@ -16,23 +16,20 @@ Compiles on Windows (mingw64) and Linux.
 ------------------------------------------------------------------- */
 
 
-#if ENABLE_J2K_READ_THIS_PLUGIN
-
-#include "config.h"
-
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 
-#include <libgimp/gimp.h>
-#include <libgimp/gimpui.h>
-
-#include "main.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
+#include <glib.h>
 
-gint32 volatile  preview_image_ID;
-gint32           preview_layer_ID;
-GimpDrawable    *drawable_global;
+#include "main.h"
+#include "convert_j2k.h"
+#include "trace_j2k.h"
 
 
 #if ENABLE_OPENJPEG_DIAGNOSTIC
@@ -47,7 +44,8 @@ void info_callback (const char *msg, void *client_data);
 #endif
 
 
-static gboolean __SupportedFormat(opj_image_t *img)
+// Every component shares one sampling grid & precision - the layouts the converters handle.
+bool Image_Supported(const opj_image_t *img)
 {
 	gint32 i;
 
@@ -67,188 +65,227 @@ static gboolean __SupportedFormat(opj_image_t *img)
 }
 
 
-/*
- * Divide an integer by a power of 2 and round upwards.
- *
- * a divided by 2^b
- */
+int Decoder_NumThreads(const Decode_Options *options)
+{
+   if (options && (options->num_threads > 0))
+      return options->num_threads;
+
+   return opj_get_num_cpus();
+}
+
+
+// Conversions split their rows across a shared worker pool. The caller runs the first part itself & waits for the rest,
+// so parts never wait on each other & concurrent callers (loader, preview worker) can share the pool.
+
+typedef void (*Rows_Fn)(void *user, guint y, guint rows);
 
+#define PARALLEL_MIN_PIXELS (256 * 1024)   // Below this, thread hand-off costs more than it saves.
+#define MAX_ROW_PARTS 64
 
-static int ceildiv(int a, int b)
+typedef struct
 {
-    return (a+b-1)/b;
-}
+   GMutex lock;
+   GCond  done;
+   gint   pending;
+
+} Rows_Wait;
 
 
-static gboolean __Query(opj_image_t *img, uint32 *width, uint32 *height, gboolean *alpha)
+typedef struct
 {
-	if (!__SupportedFormat(img))
-		return 0;
+   Rows_Fn    fn;
+   void      *user;
+   guint      y;
+   guint      rows;
+   Rows_Wait *wait;
+
+} Rows_Part;
 
-   *width  = ceildiv(img->x1-img->x0, img->comps[0].dx);
-	*height = ceildiv(img->y1-img->y0, img->comps[0].dy);
 
-	// Mono with alpha, or RGB with alpha.
-   *alpha = (img->numcomps==2) || (img->numcomps==4);
+static void rows_job(gpointer data, gpointer user_data)
+{
+   Rows_Part *part = (Rows_Part *) data;
 
-   return 1;
+   part->fn(part->user, part->y, part->rows);
+
+   g_mutex_lock(&part->wait->lock);
+
+   if (--part->wait->pending == 0)
+      g_cond_signal(&part->wait->done);
+
+   g_mutex_unlock(&part->wait->lock);
 }
 
 
-static void opj_pixel_data_to_gimp(opj_image_t * image, GeglBuffer *buffer)
+static GThreadPool *RowsPool(void)
 {
-   int i, j, src_comp;
-   gint height, width, src_num_components, dest_num_components, offset;
-   guchar *buf;
+   static gsize initialised = 0;
+   static GThreadPool *pool = nullptr;
 
-   width = (gint) (image->x1);
-   height = (gint) (image->y1);
-   src_num_components = (gint) (image->numcomps);
+   if (g_once_init_enter(&initialised))
+   {
+      pool = g_thread_pool_new(rows_job, nullptr, MAX(opj_get_num_cpus() - 1, 1), false, nullptr);
+      g_once_init_leave(&initialised, 1);
+   }
+
+   return pool;
+}
 
-   // Extend grey(a) into rgb(a) for now.
-   dest_num_components = src_num_components;
 
-   if (dest_num_components < 3)
-      dest_num_components += 2;
+static void ParallelRows(Rows_Fn fn, void *user, guint rows, guint width, int num_threads)
+{
+   Rows_Part parts[MAX_ROW_PARTS];
+   Rows_Wait wait;
+   GThreadPool *pool;
+   guint num_parts, i;
 
-   buf = g_new (guchar, dest_num_components * width * height);
+   num_parts = MIN((guint) MAX(num_threads, 1), MIN(rows, MAX_ROW_PARTS));
 
-   for (i = 0; i < width; ++i)
+   if ((num_parts < 2) || ((guint64) rows * width < PARALLEL_MIN_PIXELS) || !(pool = RowsPool()))
    {
-      for (j = 0; j < height; ++j)
-      {
-         int dest_comp, dest_base;
+      fn(user, 0, rows);
+      return;
+   }
 
-         offset = i + (j * width);
-         dest_base = dest_num_components * offset;
-         dest_comp = 0;
+   g_mutex_init(&wait.lock);
+   g_cond_init(&wait.done);
+   wait.pending = num_parts - 1;
 
-         for (src_comp = 0; src_comp < src_num_components;src_comp++, dest_comp++)
-         {
-            buf[dest_comp + dest_base] = (guchar) (image->comps[src_comp].data[offset]);
-
-            // Extend greyscale(a) into rgb(a) gimp layer for now.
-            if ((src_num_components < 3) && (src_comp==0))
-            {
-                buf[1 + dest_base] = (guchar) (image->comps[0].data[offset]);
-                buf[2 + dest_base] = (guchar) (image->comps[0].data[offset]);
-                dest_comp += 2;
-            }
-         }
-      }
+   for (i=0;i<num_parts;i++)
+   {
+      parts[i].fn = fn;
+      parts[i].user = user;
+      parts[i].y = (guint) ((guint64) rows * i / num_parts);
+      parts[i].rows = (guint) ((guint64) rows * (i + 1) / num_parts) - parts[i].y;
+      parts[i].wait = &wait;
+
+      if (i > 0)
+         g_thread_pool_push(pool, &parts[i], nullptr);
    }
 
-   gegl_buffer_set (buffer, GEGL_RECTANGLE (0, 0, width, height), 0, babl_format ("R'G'B' u8"),
-                           buf, GEGL_AUTO_ROWSTRIDE);
-						   
-   g_free(buf);
+   fn(user, parts[0].y, parts[0].rows);
+
+   g_mutex_lock(&wait.lock);
+
+   while (wait.pending > 0)
+      g_cond_wait(&wait.done, &wait.lock);
+
+   g_mutex_unlock(&wait.lock);
+
+   g_mutex_clear(&wait.lock);
+   g_cond_clear(&wait.done);
 }
 
 
-// Transfers openjpeg format image to gimp equivalent - loaded as regular image or constructed in preview window as appropriate.
-GimpImage * image_to_gimp(opj_image_t *image, const char *filename, gboolean preview)
+typedef struct
 {
-   uint32 image_width, image_height;
+   const opj_image_t *image;
+   guchar            *dest;
+   guint              width;
+   guint              height;
+   guint              y;
+   const guint       *src_x;   // Source column of each destination column, when scaling.
 
-   GimpImageBaseType type;
-   GimpImageType  layer_type;
-   gint32 layer_ID,image_ID;
-   gint x1, y1, x2, y2, width, height;
-   
-   GimpImage         *gimp_image;
-   GimpLayer         *layer;
-   GeglBuffer        *buffer;
+} Interleave_Job;
 
-   gboolean contains_alpha = 0;
 
-   if (!__Query(image, &image_width, &image_height, &contains_alpha))
+// Rows j .. j+rows-1 of an Image_ToInterleaved call.
+static void InterleaveRows(void *user, guint j0, guint rows)
+{
+   const Interleave_Job *job = (const Interleave_Job *) user;
+   const opj_image_t *image = job->image;
+   uint32 numcomps = image->numcomps;
+   uint32 src_width = image->comps[0].w;
+   uint32 src_height = image->comps[0].h;
+   guint32 shift = image->comps[0].prec > 8 ? image->comps[0].prec - 8 : 0;
+   Interleave_Fn interleave = Interleave_GetKernel(numcomps);
+   uint32 c, x, j;
+
+   for (j=j0;j<j0+rows;j++)
    {
-      fprintf(stderr,"The encoding method is not currently supported.");
-      return 0;
-   }
+      gsize src_row = (gsize) ((guint64) (job->y + j) * src_height / job->height) * src_width;
+      guchar *row = job->dest + (gsize) j * job->width * numcomps;
 
-  /* create output image */
+      // Unscaled rows go through the vector kernels, row by row in memory order.
+      if (!job->src_x)
+      {
+         const OPJ_INT32 *src[4];
 
-  width = (gint) (image->x1);
-  height = (gint) (image->y1);
-  x1 = (gint) (image->x0);
-  y1 = (gint) (image->y0);
-  x2 = x1 + width;
-  y2 = y1 + height;
+         for (c=0;c<numcomps;c++)
+            src[c] = image->comps[c].data + src_row;
 
-  // TODO: Get GIMP grey layers working. Grey duplicated across RGB for now.
-  //if (image->numcomps < 3)
-  //   type = GIMP_GRAY;
-  //else
-     type = GIMP_RGB;
+         interleave(src, row, job->width, shift);
+         continue;
+      }
 
-  switch (image->numcomps)
-  {
-     case 1: layer_type = GIMP_RGB_IMAGE /*GIMP_GRAY_IMAGE*/;  break;
-     case 2: layer_type = GIMP_RGBA_IMAGE /*GIMP_GRAYA_IMAGE*/; break;
-     case 3: layer_type = GIMP_RGB_IMAGE;   break;
-     case 4: layer_type = GIMP_RGBA_IMAGE;  break;
+      for (c=0;c<numcomps;c++)
+      {
+         const OPJ_INT32 *src = image->comps[c].data + src_row;
 
-     default:
-      fprintf(stderr,"Unsupported number of channels : %d.", image->numcomps);
-      return 0;
-  }
+         for (x=0;x<job->width;x++)
+            row[x * numcomps + c] = (guchar) CLAMP(src[job->src_x[x]] >> shift, 0, 255);
+      }
+   }
+}
 
-#if 0
-  if (preview)
-  {
-      image_ID = preview_image_ID;
 
-      // TODO: Preview layer format should match image format, not saved file format.
-      preview_layer_ID = gimp_layer_new(preview_image_ID, "J2K preview", width, height, layer_type, 100, gimp_image_get_default_new_layer_mode (gimp_image));
-      layer_ID = preview_layer_ID;
-  }
-  else
-  {
-     gimp_image = gimp_image_new(width, height, type);
+// Rows y .. y+rows-1 of the decoded planes scaled (nearest) to width x height, as interleaved u8 - e.g. a reduced preview
+// shown full size. Samples deeper than 8 bits keep their most significant bits. Large calls use options' decoder threads.
+bool Image_ToInterleaved(const opj_image_t *image, guchar *dest, guint width, guint height, guint y, guint rows, const Decode_Options *options)
+{
+   uint32 numcomps = image->numcomps;
+   uint32 src_width, x;
+   guint *src_x = nullptr;
+   Interleave_Job job;
 
-     gimp_image_set_filename(image_ID, filename);
-     layer_ID = gimp_layer_new (image_ID, "Background", width, height, layer_type, 100, gimp_image_get_default_new_layer_mode (gimp_image));
-  }
+   if ((numcomps < 1) || (numcomps > 4) || !Image_Supported(image))
+      return false;
 
-  gimp_image_add_layer(image_ID, layer_ID, 0);
-  drawable_global = drawable = gimp_drawable_get(layer_ID);
-  gimp_drawable_mask_bounds(drawable->drawable_id, &x1, &y1, &x2, &y2);
-  gimp_pixel_rgn_init(&rgn_in, drawable, x1, y1,x2 - x1, y2 - y1, TRUE, FALSE);
-#endif
+   src_width = image->comps[0].w;
 
-  gimp_image = gimp_image_new_with_precision (width, height, GIMP_RGB, GIMP_PRECISION_U32_NON_LINEAR);
-  
-  layer = gimp_layer_new (gimp_image, "Background",
-                          width, height,
-                          GIMP_RGBA_IMAGE, 100,
-                          gimp_image_get_default_new_layer_mode (gimp_image));
-						  
-  gimp_image_insert_layer (gimp_image, layer, NULL, 0);
-  buffer = gimp_drawable_get_buffer (GIMP_DRAWABLE (layer));
+   if (width != src_width)
+   {
+      src_x = g_try_new(guint, width);
+
+      if (!src_x)
+         return false;
+
+      for (x=0;x<width;x++)
+         src_x[x] = (guint) ((guint64) x * src_width / width);
+   }
+
+   job.image = image;
+   job.dest = dest;
+   job.width = width;
+   job.height = height;
+   job.y = y;
+   job.src_x = src_x;
 
+   ParallelRows(InterleaveRows, &job, rows, width, Decoder_NumThreads(options));
 
-  // Convert the pixel data ...
-  opj_pixel_data_to_gimp(image, buffer);
+   g_free(src_x);
 
-  return gimp_image;
+   return true;
 }
 
 
 typedef struct
 {
-   uint8 *data;
-   uint8 *start;
+   const uint8 *data;
+   const uint8 *start;
    size_t len;
    size_t left;
 } Buffer;
 
 
 
-OPJ_SIZE_T memory_stream_read(void *p_buffer, OPJ_SIZE_T p_nb_bytes, void *p_user_data)
+static OPJ_SIZE_T memory_stream_read(void *p_buffer, OPJ_SIZE_T p_nb_bytes, void *p_user_data)
 {
   Buffer *b = (Buffer*) p_user_data;
 
+  if (b->left == 0)
+     return (OPJ_SIZE_T) -1;   // End of stream.
+
   if (b->left < p_nb_bytes)
   {
 #if ENABLE_OPENJPEG_DIAGNOSTIC 
@@ -271,7 +308,7 @@ OPJ_SIZE_T memory_stream_read(void *p_buffer, OPJ_SIZE_T p_nb_bytes, void *p_use
 
 
 
-bool memory_stream_seek(OPJ_OFF_T bytes, void *p_user_data)
+static bool memory_stream_seek(OPJ_OFF_T bytes, void *p_user_data)
 {
   Buffer *b = (Buffer*) p_user_data;
   
@@ -298,7 +335,7 @@ bool memory_stream_seek(OPJ_OFF_T bytes, void *p_user_data)
 
 
 
-OPJ_OFF_T memory_stream_skip(OPJ_OFF_T bytes, void *p_user_data)
+static OPJ_OFF_T memory_stream_skip(OPJ_OFF_T bytes, void *p_user_data)
 {
   Buffer *b = (Buffer*) p_user_data;
   
@@ -319,18 +356,58 @@ OPJ_OFF_T memory_stream_skip(OPJ_OFF_T bytes, void *p_user_data)
 
 
 
-// Loads jpeg-2000 image from memory & decodes it returning decoded image.
-opj_image_t *decode_image(guint8 *src, uint32 buffer_length, bool format_codestream)
+bool Format_Sniff(const guint8 *data, gsize len, bool *format_codestream)
 {
-   if (!src || (buffer_length == 0))
-      return 0;
+   static const guint8 jp2_signature[FORMAT_SNIFF_BYTES] = { 0x00, 0x00, 0x00, 0x0c, 'j', 'P', ' ', ' ', 0x0d, 0x0a, 0x87, 0x0a };
+   static const guint8 codestream_start[4] = { 0xff, 0x4f, 0xff, 0x51 };   // SOC, SIZ
+
+   if ((len >= sizeof(codestream_start)) && !memcmp(data, codestream_start, sizeof(codestream_start)))
+   {
+      *format_codestream = true;
+      return true;
+   }
 
+   if ((len >= sizeof(jp2_signature)) && !memcmp(data, jp2_signature, sizeof(jp2_signature)))
+   {
+      *format_codestream = false;
+      return true;
+   }
+
+   return false;
+}
+
+
+// Format from the file's first bytes, for the streaming paths that don't have the data in memory.
+static bool SniffFile(const gchar *filename, bool *format_codestream)
+{
+   guint8 head[FORMAT_SNIFF_BYTES];
+   FILE *f = fopen(filename, "rb");
+
+   if (!f)
+      return false;
+
+   size_t len = fread(head, 1, sizeof(head), f);
+   fclose(f);
+
+   return Format_Sniff(head, len, format_codestream);
+}
 
+
+// Decoder for stream s, with the header read into *image & options applied. nullptr on failure, s is left to the caller.
+static opj_codec_t *OpenDecoder(opj_stream_t *s, bool format_codestream, const Decode_Options *options, opj_image_t **image)
+{
    // Set decoding parameters to default decompression values
    opj_dparameters_t parameters;
    memset(&parameters, 0, sizeof(opj_dparameters_t));
    opj_set_default_decoder_parameters(&parameters);
 
+   if (options)
+   {
+      parameters.cp_reduce = options->reduce;
+      parameters.cp_layer = options->layers;
+   }
+
+   *image = nullptr;
  	
 	// Get a decoder handle ...
 	opj_codec_t *codec = opj_create_decompress(format_codestream ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
@@ -342,6 +419,7 @@ opj_image_t *decode_image(guint8 *src, uint32 buffer_length, bool format_codestr
 	opj_set_error_handler(codec, error_callback, stderr);
 #endif
 
+   Trace_AttachCodec(codec);
 
 	// Setup the decoder decoding parameters ...
    if (!opj_setup_decoder(codec, &parameters))
@@ -350,28 +428,10 @@ opj_image_t *decode_image(guint8 *src, uint32 buffer_length, bool format_codestr
        return nullptr;
 	}
 
-   opj_stream_t *s = opj_stream_create(buffer_length, true);
+   // Code-blocks decode in parallel (OpenJPEG 2.2+). Must follow setup & precede the header read.
+   opj_codec_set_threads(codec, Decoder_NumThreads(options));
 
-   if (!s)
-	{
-       opj_destroy_codec(codec);
-       return nullptr;
-	}
 
-   opj_stream_set_read_function(s, memory_stream_read);
-   opj_stream_set_seek_function(s, memory_stream_seek);
-   opj_stream_set_skip_function(s, memory_stream_skip);
-
-	Buffer b;
-	b.start = b.data = (uint8*) src;
-	b.left = b.len = buffer_length;
- 
-   // TODO: This function is badly named, it provides the length of the custom stream, not the user data :)
-   opj_stream_set_user_data_length(s, buffer_length);
-
-   opj_stream_set_user_data(s, (void*) &b, NULL); 
-
- 
 #if ENABLE_OPENJPEG_DIAGNOSTIC
    if (format_codestream)
 		fprintf(stderr, "decode_image[j2k]\n");
@@ -380,8 +440,9 @@ opj_image_t *decode_image(guint8 *src, uint32 buffer_length, bool format_codestr
 #endif
 
 
-   opj_image_t *image = nullptr;
-   bool ok = opj_read_header(s, codec, &image);
+   gint64 start = Trace_Begin();
+   bool ok = opj_read_header(s, codec, image);
+   Trace_End("opj_read_header", start, 0);
 
 
    if (!ok)
@@ -390,66 +451,673 @@ opj_image_t *decode_image(guint8 *src, uint32 buffer_length, bool format_codestr
 	    fprintf(stderr, "decode_image[hdr-fail]\n");
 #endif
 
-	    opj_stream_destroy(s);
   	    opj_destroy_codec(codec);
        return nullptr;
 	}
 
-   ok = opj_decode(codec, s, image);
+   // Skip trailing components (alpha) - their code-blocks are never decoded.
+   if (options && (options->num_components > 0) && (options->num_components < (*image)->numcomps))
+   {
+      OPJ_UINT32 indices[4] = { 0, 1, 2, 3 };
+
+      if ((options->num_components > 4) || !opj_set_decoded_components(codec, options->num_components, indices, false))
+         ok = false;
+   }
 
-   if (codec)
+   // Restrict decode to a window. Coordinates are on the reference grid, offset by the image origin.
+   if (ok && options && (options->x1 > options->x0) && (options->y1 > options->y0))
+   {
+      opj_image_t *img = *image;
+      OPJ_INT32 x0 = (OPJ_INT32) MIN((guint64) img->x0 + options->x0, img->x1);
+      OPJ_INT32 y0 = (OPJ_INT32) MIN((guint64) img->y0 + options->y0, img->y1);
+      OPJ_INT32 x1 = (OPJ_INT32) MIN((guint64) img->x0 + options->x1, img->x1);
+      OPJ_INT32 y1 = (OPJ_INT32) MIN((guint64) img->y0 + options->y1, img->y1);
+
+      if ((x1 <= x0) || (y1 <= y0) || !opj_set_decode_area(codec, img, x0, y0, x1, y1))
+         ok = false;
+   }
+
+   if (!ok)
+   {
+      opj_destroy_codec(codec);
+      opj_image_destroy(*image);
+      *image = nullptr;
+      return nullptr;
+   }
+
+   return codec;
+}
+
+
+// Decodes from stream s, which it destroys. options may be nullptr for a full decode. length is for tracing only.
+static opj_image_t *DecodeStream(opj_stream_t *s, guint64 length, bool format_codestream, const Decode_Options *options)
+{
+   opj_image_t *image;
+   opj_codec_t *codec = OpenDecoder(s, format_codestream, options, &image);
+
+   if (!codec)
+   {
+      opj_stream_destroy(s);
+      return nullptr;
+   }
+
+   gint64 start = Trace_Begin();
+   bool ok = opj_decode(codec, s, image);
+   Trace_End("opj_decode", start, length);
+
+   if (ok)
+   {
+      start = Trace_Begin();
+      ok = opj_end_decompress(codec, s);
+      Trace_End("opj_end_decompress", start, 0);
+   }
+
+   opj_stream_destroy(s);
+   opj_destroy_codec(codec);
+
+   if (!ok)
    {
-  		opj_end_decompress(codec, s);
-		opj_stream_destroy(s);
-	    opj_destroy_codec(codec);
+      opj_image_destroy(image);
+      return nullptr;
    }
 
    return image;
 }
 
 
-opj_image_t *image_load(const gchar *filename)
+// Stream reading src through b, which must outlive it.
+static opj_stream_t *MemoryStream(const guint8 *src, gsize length, Buffer *b)
 {
-  FILE *fsrc;
-  size_t file_length;
-  unsigned char *src;
+   // Chunk sized stream buffer - larger reads bypass it & are copied straight into OpenJPEG's destination.
+   opj_stream_t *s = opj_stream_create(MIN(length, (gsize) OPJ_J2K_STREAM_CHUNK_SIZE), true);
 
-  // Read the file into memory.
+   if (!s)
+      return nullptr;
 
-  fsrc = fopen (filename, "rb");
+   opj_stream_set_read_function(s, memory_stream_read);
+   opj_stream_set_seek_function(s, memory_stream_seek);
+   opj_stream_set_skip_function(s, memory_stream_skip);
 
-  if (!fsrc)
-  {
+	b->start = b->data = src;
+	b->left = b->len = length;
+ 
+   // TODO: This function is badly named, it provides the length of the custom stream, not the user data :)
+   opj_stream_set_user_data_length(s, length);
+
+   opj_stream_set_user_data(s, (void*) b, NULL); 
+
+   return s;
+}
+
+
+// Loads jpeg-2000 image from memory & decodes it returning decoded image. options may be nullptr for a full decode.
+// The stream callbacks read straight from src, so a mapped file is paged in only where OpenJPEG reads it.
+opj_image_t *decode_image(const guint8 *src, gsize buffer_length, bool format_codestream, const Decode_Options *options)
+{
+   if (!src || (buffer_length == 0))
+      return 0;
+
+	Buffer b;
+   opj_stream_t *s = MemoryStream(src, buffer_length, &b);
+
+   if (!s)
+      return nullptr;
+
+   return DecodeStream(s, buffer_length, format_codestream, options);
+}
+
+
+typedef struct
+{
+   GMappedFile *mapping;
+   Buffer       b;
+
+} Input;
+
+
+// Window, reduced or layer limited decodes skip much of the codestream.
+static bool PartialDecode(const Decode_Options *options)
+{
+   return options && (((options->x1 > options->x0) && (options->y1 > options->y0)) || options->reduce || options->layers);
+}
+
+
+// Input stream for filename & its format. Mapped where possible - only the pages OpenJPEG touches are read, once, with
+// no heap copy of the file. Otherwise OpenJPEG's own file stream, reading chunk by chunk. Release with CloseInput.
+static opj_stream_t *OpenInput(const gchar *filename, const Decode_Options *options, Input *in, bool *format_codestream, guint64 *length)
+{
+   opj_stream_t *s = nullptr;
+
+   *length = 0;
+
+   gint64 start = Trace_Begin();
+   in->mapping = g_mapped_file_new(filename, false, nullptr);
+   Trace_End("file_map", start, in->mapping ? g_mapped_file_get_length(in->mapping) : 0);
+
+   if (in->mapping && (g_mapped_file_get_length(in->mapping) > 0))
+   {
+      const guint8 *src = (const guint8*) g_mapped_file_get_contents(in->mapping);
+      gsize file_length = g_mapped_file_get_length(in->mapping);
+
+#if defined(POSIX_MADV_SEQUENTIAL) && defined(POSIX_MADV_RANDOM)
+      // Whole decodes read front to back, so read ahead pays. Partial ones jump between the packets they need, where
+      // read ahead would fetch pages OpenJPEG never touches.
+      posix_madvise((void*) src, file_length, PartialDecode(options) ? POSIX_MADV_RANDOM : POSIX_MADV_SEQUENTIAL);
+#endif
+
+      if (!Format_Sniff(src, file_length, format_codestream))
+      {
+         fprintf(stderr, "ERROR -> %s is not a JPEG-2000 file\n", filename);
+         return nullptr;
+      }
+
+      *length = file_length;
+      return MemoryStream(src, file_length, &in->b);
+   }
+
+   if (!SniffFile(filename, format_codestream))
+      return nullptr;
+
+   s = opj_stream_create_default_file_stream(filename, true);
+
+   if (!s)
       fprintf (stderr, "ERROR -> failed to open %s for reading\n", filename);
-      return NULL;
-  }
 
+   return s;
+}
 
-  fseek (fsrc, 0, SEEK_END);
-  file_length = ftell (fsrc);
-  fseek (fsrc, 0, SEEK_SET);
-  src = (unsigned char *) malloc (file_length);
-  size_t read_bytes = fread (src, 1, file_length, fsrc);
-  fclose (fsrc);
 
-  if (read_bytes != file_length)
-  {
-		fprintf (stderr, "ERROR -> failed to read all from %s. Got %ld of %ld\n", filename, read_bytes, file_length);
-      return NULL;
-  }
+static void CloseInput(Input *in)
+{
+   if (in->mapping)
+      g_mapped_file_unref(in->mapping);
 
+   in->mapping = nullptr;
+}
+
+
+opj_image_t *image_load(const gchar *filename, const Decode_Options *options)
+{
+   Input in;
+   bool format_codestream;
+   guint64 length;
+
+   opj_stream_t *s = OpenInput(filename, options, &in, &format_codestream, &length);
+   opj_image_t *opj_image = s ? DecodeStream(s, length, format_codestream, options) : nullptr;
+
+   CloseInput(&in);
+
+   return opj_image;
+}
 
-  // Guess format from extension.
-  const char *ext = strrchr(filename, '.');
-  gboolean format_codestream = ext && !stricmp(ext, ".j2k");
 
-  opj_image_t *opj_image = decode_image(src, file_length, format_codestream);
+static inline guint32 CeilDiv(guint32 a, guint32 b)
+{
+   return (guint32) (((guint64) a + b - 1) / b);
+}
 
-  // If load failed, try other format - file could be named incorrectly.
-  if (!opj_image)
-     opj_image = decode_image(src, file_length, !format_codestream);
 
-  return opj_image;
+static inline guint32 CeilDivPow2(guint32 a, guint32 b)
+{
+   return (guint32) (((guint64) a + ((guint64) 1 << b) - 1) >> b);
 }
 
-#endif
\ No newline at end of file
+
+// Reference grid rectangle -> decoded pixel rectangle of comp at reduce, as OpenJPEG sizes its output.
+static void ReducedRect(const opj_image_comp_t *comp, guint reduce, guint32 x0, guint32 y0, guint32 x1, guint32 y1, guint32 r[4])
+{
+   r[0] = CeilDivPow2(CeilDiv(x0, comp->dx), reduce);
+   r[1] = CeilDivPow2(CeilDiv(y0, comp->dy), reduce);
+   r[2] = CeilDivPow2(CeilDiv(x1, comp->dx), reduce);
+   r[3] = CeilDivPow2(CeilDiv(y1, comp->dy), reduce);
+}
+
+
+// One row of a tile component as returned by opj_decode_tile_data - 1, 2 or 4 bytes per sample - widened to int32.
+static void WidenRow(const guint8 *src, guint32 sample_size, bool sgnd, OPJ_INT32 *dest, guint32 width)
+{
+   guint32 x;
+
+   switch (sample_size)
+   {
+      case 1 :
+         if (sgnd)
+            for (x=0;x<width;x++) dest[x] = ((const gint8*) src)[x];
+         else
+            for (x=0;x<width;x++) dest[x] = src[x];
+         break;
+
+      case 2 :
+         if (sgnd)
+            for (x=0;x<width;x++) dest[x] = ((const gint16*) src)[x];
+         else
+            for (x=0;x<width;x++) dest[x] = ((const guint16*) src)[x];
+         break;
+
+      default :
+         memcpy(dest, src, (gsize) width * sizeof(OPJ_INT32));
+   }
+}
+
+
+#define TILE_BAND_HEIGHT 64
+
+
+typedef struct
+{
+   const opj_image_t *image;
+   const guint8      *data;        // Tile samples from opj_decode_tile_data, plane after plane.
+   gsize              plane;       // Bytes per plane.
+   guint32            width;
+   guint32            numcomps;
+   guint32            sample_size;
+   guint32            shift;
+   guint32            prec;
+   guint32            bytes_per_sample;   // Of the band : 1 = u8, 2 = u16.
+   guint32            y;           // Band's first tile row.
+   guchar            *band;
+
+} Tile_Job;
+
+
+// Rows j .. j+rows-1 of the current band : widened to int32 & interleaved. Each part has its own widening scratch.
+static void ConvertTileRows(void *user, guint j0, guint rows)
+{
+   const Tile_Job *job = (const Tile_Job *) user;
+   const OPJ_INT32 *src[4];
+   OPJ_INT32 *widened = g_new(OPJ_INT32, (gsize) job->width * job->numcomps);
+   Interleave_Fn interleave = Interleave_GetKernel(job->numcomps);
+   Interleave16_Fn interleave16 = Interleave16_GetKernel(job->numcomps);
+   gsize band_pitch = (gsize) job->width * job->numcomps;
+   guint32 c, j;
+
+   for (j=j0;j<j0+rows;j++)
+   {
+      for (c=0;c<job->numcomps;c++)
+      {
+         const guint8 *row = job->data + c * job->plane + (gsize) (job->y + j) * job->width * job->sample_size;
+
+         WidenRow(row, job->sample_size, job->image->comps[c].sgnd, widened + c * job->width, job->width);
+         src[c] = widened + c * job->width;
+      }
+
+      if (job->bytes_per_sample == 2)
+         interleave16(src, (guint16 *) job->band + j * band_pitch, job->width, job->prec);
+      else
+         interleave(src, job->band + j * band_pitch, job->width, job->shift);
+   }
+
+   g_free(widened);
+}
+
+
+#define JP2_BOX_JP2H 0x6a703268   // 'jp2h' : JP2 header superbox.
+#define JP2_BOX_JP2C 0x6a703263   // 'jp2c' : the codestream.
+#define JP2_BOX_PCLR 0x70636c72   // 'pclr' : palette.
+#define JP2_BOX_CMAP 0x636d6170   // 'cmap' : component mapping.
+#define JP2_BOX_CDEF 0x63646566   // 'cdef' : channel definitions.
+
+
+static guint32 ReadBE32(const guint8 *p)
+{
+   return ((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | p[3];
+}
+
+
+// Whether the JP2 header has a palette, component mapping or channel definitions. OpenJPEG applies those only when it
+// decodes the whole image (opj_decode), never to tiles from opj_decode_tile_data. Reads box headers only.
+static bool Jp2_HasChannelBoxes(const gchar *filename)
+{
+   FILE *f = fopen(filename, "rb");
+   guint64 pos = 0, end = G_MAXUINT64;
+   bool found = false;
+   guint8 box[16];
+
+   if (!f)
+      return false;
+
+   while (!found && (pos < end) && !fseek(f, (long) pos, SEEK_SET) && (fread(box, 1, 8, f) == 8))
+   {
+      guint64 length = ReadBE32(box);
+      guint32 type = ReadBE32(box + 4);
+      guint32 header = 8;
+
+      if (length == 1)
+      {
+         // 64 bit extended length.
+         if (fread(box + 8, 1, 8, f) != 8)
+            break;
+
+         length = ((guint64) ReadBE32(box + 8) << 32) | ReadBE32(box + 12);
+         header = 16;
+      }
+      else if (length == 0)
+         length = end - pos;   // Box runs to the end of its container.
+
+      if (length < header)
+         break;
+
+      if (type == JP2_BOX_JP2H)
+      {
+         // Walk the header's children, stopping at its end.
+         end = pos + length;
+         pos += header;
+         continue;
+      }
+
+      if (type == JP2_BOX_JP2C)
+         break;
+
+      found = (end != G_MAXUINT64) && ((type == JP2_BOX_PCLR) || (type == JP2_BOX_CMAP) || (type == JP2_BOX_CDEF));
+      pos += length;
+   }
+
+   fclose(f);
+
+   return found;
+}
+
+
+// Whole image decode handed to sink in bands of rows, for JP2 files whose palette or channel definitions the tile path
+// would skip. Destroys s.
+static bool DecodeToSink(opj_stream_t *s, guint64 length, const Decode_Options *options, const Tile_Sink *sink)
+{
+   opj_image_t *image = DecodeStream(s, length, false, options);
+   guchar *band = nullptr;
+   bool ok = false;
+
+   if (!image)
+      return false;
+
+   guint32 numcomps = image->numcomps;
+
+   if (options && (options->num_components > 0))
+      numcomps = MIN(numcomps, options->num_components);
+
+   if ((numcomps >= 1) && (numcomps <= 4) && Image_Supported(image))
+   {
+      const opj_image_comp_t *comp = &image->comps[0];
+      guint32 width = comp->w, height = comp->h;
+      guint32 bytes_per_sample = comp->prec > 8 ? 2 : 1;
+      guint32 shift = comp->prec > 8 ? comp->prec - 8 : 0;
+      gsize band_pitch = (gsize) width * numcomps;
+      Interleave_Fn interleave = Interleave_GetKernel(numcomps);
+      Interleave16_Fn interleave16 = Interleave16_GetKernel(numcomps);
+      const OPJ_INT32 *src[4];
+      guint32 y, j, c;
+
+      band = g_try_new(guchar, band_pitch * bytes_per_sample * TILE_BAND_HEIGHT);
+      ok = band && sink->begin(sink->user, width, height, numcomps, bytes_per_sample);
+
+      for (y=0; ok && (y < height); y+=TILE_BAND_HEIGHT)
+      {
+         guint32 rows = MIN(TILE_BAND_HEIGHT, height - y);
+
+         for (j=0;j<rows;j++)
+         {
+            for (c=0;c<numcomps;c++)
+               src[c] = image->comps[c].data + (gsize) (y + j) * width;
+
+            if (bytes_per_sample == 2)
+               interleave16(src, (guint16 *) band + j * band_pitch, width, comp->prec);
+            else
+               interleave(src, band + j * band_pitch, width, shift);
+         }
+
+         ok = sink->rows(sink->user, band, 0, y, width, rows);
+      }
+   }
+
+   g_free(band);
+   opj_image_destroy(image);
+
+   return ok;
+}
+
+
+// Tile by tile decode. Each tile is decoded, converted to interleaved samples in bands of rows for the sink & released
+// before the next is read, so the decoder never holds more than one tile. Untiled files are a single tile. Components
+// deeper than 8 bits go straight from int32 to u16, never through 8 bits.
+bool image_load_tiles(const gchar *filename, const Decode_Options *options, const Tile_Sink *sink)
+{
+   Input in;
+   bool format_codestream;
+   guint64 length;
+   opj_image_t *image = nullptr;
+   opj_codec_t *codec = nullptr;
+   guint8 *data = nullptr;
+   OPJ_UINT32 data_capacity = 0;
+   guchar *band = nullptr;
+   Tile_Job job;
+   bool ok = false;
+
+   opj_stream_t *s = OpenInput(filename, options, &in, &format_codestream, &length);
+
+   if (s && !format_codestream && Jp2_HasChannelBoxes(filename))
+   {
+      ok = DecodeToSink(s, length, options, sink);
+      CloseInput(&in);
+      return ok;
+   }
+
+   if (s)
+      codec = OpenDecoder(s, format_codestream, options, &image);
+
+   if (!codec)
+      goto done;
+
+   {
+      guint reduce = options ? options->reduce : 0;
+      guint32 numcomps = image->numcomps;
+      guint32 area[4], out[4];
+
+      if (options && (options->num_components > 0))
+         numcomps = MIN(numcomps, options->num_components);
+
+      if ((numcomps < 1) || (numcomps > 4) || !Image_Supported(image))
+         goto done;
+
+      const opj_image_comp_t *comp = &image->comps[0];
+      guint32 sample_size = (comp->prec + 7) / 8;
+      guint32 shift = comp->prec > 8 ? comp->prec - 8 : 0;
+      guint32 bytes_per_sample = comp->prec > 8 ? 2 : 1;
+
+      if (sample_size == 3)
+         sample_size = 4;
+
+      // Decoded area on the reference grid & in output pixels.
+      area[0] = image->x0; area[1] = image->y0; area[2] = image->x1; area[3] = image->y1;
+
+      if (options && (options->x1 > options->x0) && (options->y1 > options->y0))
+      {
+         area[0] = (guint32) MIN((guint64) image->x0 + options->x0, image->x1);
+         area[1] = (guint32) MIN((guint64) image->y0 + options->y0, image->y1);
+         area[2] = (guint32) MIN((guint64) image->x0 + options->x1, image->x1);
+         area[3] = (guint32) MIN((guint64) image->y0 + options->y1, image->y1);
+      }
+
+      ReducedRect(comp, reduce, area[0], area[1], area[2], area[3], out);
+
+      if (!sink->begin(sink->user, out[2] - out[0], out[3] - out[1], numcomps, bytes_per_sample))
+         goto done;
+
+      int num_threads = Decoder_NumThreads(options);
+      guint32 band_height = TILE_BAND_HEIGHT;
+
+      job.image = image;
+      job.numcomps = numcomps;
+      job.sample_size = sample_size;
+      job.shift = shift;
+      job.prec = comp->prec;
+      job.bytes_per_sample = bytes_per_sample;
+
+      for (;;)
+      {
+         OPJ_UINT32 tile_index, data_size, tile_comps;
+         OPJ_INT32 tx0, ty0, tx1, ty1;
+         OPJ_BOOL more;
+         guint32 r[4];
+
+         gint64 start = Trace_Begin();
+         bool read = opj_read_tile_header(codec, s, &tile_index, &data_size, &tx0, &ty0, &tx1, &ty1, &tile_comps, &more);
+         Trace_End("opj_read_tile_header", start, 0);
+
+         if (!read)
+            goto done;
+
+         if (!more)
+            break;
+
+         if (data_size > data_capacity)
+         {
+            g_free(data);
+            data = g_try_new(guint8, data_size);
+            data_capacity = data ? data_size : 0;
+
+            if (!data)
+               goto done;
+         }
+
+         start = Trace_Begin();
+         read = opj_decode_tile_data(codec, tile_index, data, data_size, s);
+         Trace_End("opj_decode_tile_data", start, data_size);
+
+         if (!read)
+            goto done;
+
+         // The tile's part of the decoded area - what OpenJPEG returned, component after component.
+         ReducedRect(comp, reduce, MAX((guint32) tx0, area[0]), MAX((guint32) ty0, area[1]),
+                     MIN((guint32) tx1, area[2]), MIN((guint32) ty1, area[3]), r);
+
+         if ((r[2] <= r[0]) || (r[3] <= r[1]))
+            continue;
+
+         guint32 w = r[2] - r[0];
+         guint32 h = r[3] - r[1];
+         gsize plane = (gsize) w * h * sample_size;
+
+         if ((tile_comps < numcomps) || ((gsize) data_size < plane * numcomps))
+            goto done;
+
+         if (!band)
+         {
+            // Bands of enough pixels for ParallelRows to split them across threads, sized from the first tile's width.
+            if (num_threads > 1)
+               band_height = MIN(MAX(band_height, (PARALLEL_MIN_PIXELS + w - 1) / w), out[3] - out[1]);
+
+            band = g_try_new(guchar, (gsize) (out[2] - out[0]) * numcomps * bytes_per_sample * band_height);
+            job.band = band;
+
+            if (!band)
+               goto done;
+         }
+
+         job.data = data;
+         job.plane = plane;
+         job.width = w;
+
+         start = Trace_Begin();
+
+         for (guint32 y=0;y<h;y+=band_height)
+         {
+            guint32 rows = MIN(band_height, h - y);
+
+            job.y = y;
+            ParallelRows(ConvertTileRows, &job, rows, w, num_threads);
+
+            if (!sink->rows(sink->user, band, r[0] - out[0], r[1] - out[1] + y, w, rows))
+               goto done;
+         }
+
+         Trace_End("tile_convert", start, (guint64) w * h * numcomps * bytes_per_sample);
+      }
+
+      gint64 start = Trace_Begin();
+      ok = opj_end_decompress(codec, s);
+      Trace_End("opj_end_decompress", start, 0);
+   }
+
+done:
+   g_free(band);
+   g_free(data);
+
+   if (codec)
+      opj_destroy_codec(codec);
+
+   if (image)
+      opj_image_destroy(image);
+
+   if (s)
+      opj_stream_destroy(s);
+
+   CloseInput(&in);
+
+   return ok;
+}
+
+
+// Reads the main header only. The file stream pulls just the bytes the header parser asks for.
+bool image_load_header(const gchar *filename, Header_Info *info)
+{
+   memset(info, 0, sizeof(Header_Info));
+
+   bool format_codestream;
+
+   if (!SniffFile(filename, &format_codestream))
+      return false;
+
+   opj_stream_t *s = opj_stream_create_default_file_stream(filename, true);
+
+   if (!s)
+      return false;
+
+   opj_dparameters_t parameters;
+   opj_set_default_decoder_parameters(&parameters);
+
+   opj_codec_t *codec = opj_create_decompress(format_codestream ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
+   opj_image_t *image = nullptr;
+
+   bool ok = opj_setup_decoder(codec, &parameters) && opj_read_header(s, codec, &image) && (image->numcomps > 0);
+
+   if (ok)
+   {
+      info->width = image->x1 - image->x0;
+      info->height = image->y1 - image->y0;
+      info->num_components = image->numcomps;
+      info->precision = image->comps[0].prec;
+
+      opj_codestream_info_v2_t *cstr = opj_get_cstr_info(codec);
+
+      if (cstr)
+      {
+         info->num_layers = cstr->m_default_tile_info.numlayers;
+         info->tile_width = MIN(cstr->tdx, info->width);
+         info->tile_height = MIN(cstr->tdy, info->height);
+
+         if (cstr->m_default_tile_info.tccp_info)
+            info->num_resolutions = cstr->m_default_tile_info.tccp_info[0].numresolutions;
+
+         opj_destroy_cstr_info(&cstr);
+      }
+   }
+
+   if (image)
+      opj_image_destroy(image);
+
+   opj_stream_destroy(s);
+   opj_destroy_codec(codec);
+
+   return ok;
+}
+
+
+guint Header_ReduceForSize(const Header_Info *info, guint size)
+{
+   guint reduce = 0;
+   guint extent = MAX(info->width, info->height);
+
+   while ((reduce + 1 < info->num_resolutions) && (((extent + (2u << reduce) - 1) >> (reduce + 1)) >= size))
+      reduce++;
+
+   return reduce;
+}
@@ -0,0 +1,201 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+// j2k-test-cli : lossless round trips through the j2k-cli executable named on the command line. Generated PNM files are
+// encoded, decoded back & must come out byte for byte the same. Run by meson test.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "main.h"
+
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                         \
+   G_STMT_START                                  \
+   {                                             \
+      if (!(cond))                               \
+      {                                          \
+         fprintf(stderr, "FAIL %s:%d : ", __FILE__, __LINE__);   \
+         fprintf(stderr, __VA_ARGS__);           \
+         fprintf(stderr, "\n");                  \
+         failures++;                             \
+      }                                          \
+   }                                             \
+   G_STMT_END
+
+
+// Header as j2k-cli writes it : PGM, PPM, or PAM for alpha. Pixels vary in every channel, so none is dropped as redundant.
+static GByteArray *MakePnm(guint width, guint height, guint num_components)
+{
+   static const char *tuple_types[] = { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+   GByteArray *pnm = g_byte_array_new();
+   GRand *rand = g_rand_new_with_seed(width * 31 + height * 7 + num_components);
+   gchar *header;
+   guint x, y, c;
+
+   if ((num_components == 1) || (num_components == 3))
+      header = g_strdup_printf("P%d\n%u %u\n255\n", num_components == 1 ? 5 : 6, width, height);
+   else
+      header = g_strdup_printf("P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n", width, height,
+                               num_components, tuple_types[num_components-1]);
+
+   g_byte_array_append(pnm, (const guint8 *) header, strlen(header));
+   g_free(header);
+
+   for (y=0;y<height;y++)
+   {
+      for (x=0;x<width;x++)
+      {
+         for (c=0;c<num_components;c++)
+         {
+            guint8 v = (guint8) ((x * (c + 1) + y * (3 - c % 3) + c * 80 + g_rand_int_range(rand, 0, 32)) & 0xff);
+
+            g_byte_array_append(pnm, &v, 1);
+         }
+      }
+   }
+
+   g_rand_free(rand);
+
+   return pnm;
+}
+
+
+static bool RunCli(const char *cli, const char *const *args)
+{
+   const char *argv[16];
+   gchar *errors = nullptr;
+   GError *error = nullptr;
+   gint status = 0;
+   guint n = 0;
+   bool ok;
+
+   argv[n++] = cli;
+
+   while (*args && (n < G_N_ELEMENTS(argv) - 1))
+      argv[n++] = *args++;
+
+   argv[n] = nullptr;
+
+   ok = g_spawn_sync(nullptr, (gchar **) argv, nullptr, G_SPAWN_STDOUT_TO_DEV_NULL, nullptr, nullptr, nullptr, &errors, &status, &error) &&
+        g_spawn_check_wait_status(status, &error);
+
+   if (!ok)
+   {
+      gchar *command = g_strjoinv(" ", (gchar **) argv);
+
+      fprintf(stderr, "%s : %s\n%s", command, error ? error->message : "failed", errors ? errors : "");
+      g_free(command);
+   }
+
+   g_clear_error(&error);
+   g_free(errors);
+
+   return ok;
+}
+
+
+// Lossless encode of a generated image with extra_arg (may be nullptr), decoded back to PNM.
+static void RoundTrip(const char *cli, const char *dir, guint width, guint height, guint num_components, const char *extension,
+                      const char *extra_arg)
+{
+   GByteArray *pnm = MakePnm(width, height, num_components);
+   gchar *name = g_strdup_printf("%ux%ux%u%s", width, height, num_components, extra_arg ? extra_arg : "");
+   gchar *input = g_strdup_printf("%s%s%s-in.pnm", dir, G_DIR_SEPARATOR_S, name);
+   gchar *encoded = g_strdup_printf("%s%s%s.%s", dir, G_DIR_SEPARATOR_S, name, extension);
+   gchar *output = g_strdup_printf("%s%s%s-out.pnm", dir, G_DIR_SEPARATOR_S, name);
+   gchar *decoded = nullptr;
+   gsize len = 0;
+
+   CHECK(g_file_set_contents(input, (const gchar *) pnm->data, pnm->len, nullptr), "%s : could not write input", name);
+
+   {
+      const char *encode[6], *decode[] = { "-d", encoded, output, nullptr };
+      guint n = 0;
+
+      encode[n++] = "-q";
+      encode[n++] = "1";
+
+      if (extra_arg)
+         encode[n++] = extra_arg;
+
+      encode[n++] = input;
+      encode[n++] = encoded;
+      encode[n] = nullptr;
+
+      CHECK(RunCli(cli, encode), "%s.%s : encode failed", name, extension);
+      CHECK(RunCli(cli, decode), "%s.%s : decode failed", name, extension);
+   }
+
+   CHECK(g_file_get_contents(output, &decoded, &len, nullptr) && (len == pnm->len) && !memcmp(decoded, pnm->data, len),
+         "%s.%s : decoded image differs from the input", name, extension);
+
+   g_remove(input);
+   g_remove(encoded);
+   g_remove(output);
+
+   g_free(decoded);
+   g_free(output);
+   g_free(encoded);
+   g_free(input);
+   g_free(name);
+   g_byte_array_free(pnm, TRUE);
+}
+
+
+int main(int argc, char **argv)
+{
+   gchar *dir;
+   guint c;
+
+   if (argc != 2)
+   {
+      fprintf(stderr, "usage : j2k-test-cli PATH-TO-J2K-CLI\n");
+      return 1;
+   }
+
+   dir = g_dir_make_tmp("j2k-test-cli-XXXXXX", nullptr);
+
+   if (!dir)
+   {
+      fprintf(stderr, "j2k-test-cli: no temporary directory.\n");
+      return 1;
+   }
+
+   for (c=1;c<=4;c++)
+   {
+      RoundTrip(argv[1], dir, 61, 37, c, "j2k", nullptr);
+      RoundTrip(argv[1], dir, 61, 37, c, "jp2", nullptr);
+   }
+
+   RoundTrip(argv[1], dir, 129, 67, 3, "j2k", "--tile-size=32");
+
+   g_rmdir(dir);
+   g_free(dir);
+
+   if (failures)
+      fprintf(stderr, "j2k-test-cli: %d failures.\n", failures);
+
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,843 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+// j2k-test-codec : encode / decode round trips through the codec core & the OpenJPEG it's built against. Run by meson test.
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "main.h"
+#include "write_j2k.h"
+#include "estimate_j2k.h"
+
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                         \
+   G_STMT_START                                  \
+   {                                             \
+      if (!(cond))                               \
+      {                                          \
+         fprintf(stderr, "FAIL %s:%d : ", __FILE__, __LINE__);   \
+         fprintf(stderr, __VA_ARGS__);           \
+         fprintf(stderr, "\n");                  \
+         failures++;                             \
+      }                                          \
+   }                                             \
+   G_STMT_END
+
+
+// Gradients, noise & a varying alpha, channels well apart, so the analysis keeps every channel.
+static void Synthesize(Image_Info *ii, guint width, guint height, guint num_components)
+{
+   GRand *rand = g_rand_new_with_seed(width * 31 + height * 7 + num_components);
+   guint x, y, c;
+   guchar *p;
+
+   memset(ii, 0, sizeof(Image_Info));
+
+   ii->width = width;
+   ii->height = height;
+   ii->num_components = num_components;
+   ii->data = p = g_new(guchar, (gsize) width * height * num_components);
+
+   for (y=0;y<height;y++)
+   {
+      for (x=0;x<width;x++, p+=num_components)
+      {
+         for (c=0;c<num_components;c++)
+            p[c] = (guchar) ((x * (c + 1) + y * (3 - c % 3) + c * 80 + g_rand_int_range(rand, 0, 32)) & 0xff);
+
+         if ((num_components == 2) || (num_components == 4))
+            p[num_components-1] = (guchar) ((x + y) * 255 / MAX(1, width + height - 2));
+      }
+   }
+
+   g_rand_free(rand);
+}
+
+
+typedef struct
+{
+   guint8 *data;
+   gsize   len;
+
+} Codestream;
+
+
+static bool KeepCodestream(void *buffer, int length, void *user_data)
+{
+   Codestream *cs = (Codestream *) user_data;
+
+   cs->data = (guint8 *) g_memdup2(buffer, length);
+   cs->len = length;
+
+   return true;
+}
+
+
+static gdouble Psnr(const guchar *a, const guchar *b, gsize n)
+{
+   gdouble sum = 0;
+   gsize i;
+
+   for (i=0;i<n;i++)
+      sum += (gdouble) (a[i] - b[i]) * (a[i] - b[i]);
+
+   return sum == 0 ? HUGE_VAL : 10.0 * log10(255.0 * 255.0 * n / sum);
+}
+
+
+// Encodes with params & decodes. Lossless must return the source exactly, lossy must stay recognisable.
+static void RoundTrip(const char *what, Image_Info *ii, const Save_Parameters *params, bool format_codestream, bool lossless)
+{
+   Codestream cs = { nullptr, 0 };
+   opj_image_t *image;
+   guchar *decoded;
+   gsize n = (gsize) ii->width * ii->height * ii->num_components;
+
+   if (!serialize_image(ii, params, format_codestream, KeepCodestream, &cs))
+   {
+      CHECK(false, "%s %s : encode failed", what, format_codestream ? "j2k" : "jp2");
+      return;
+   }
+
+   image = decode_image(cs.data, cs.len, format_codestream, nullptr);
+
+   CHECK(image != nullptr, "%s %s : decode failed", what, format_codestream ? "j2k" : "jp2");
+
+   if (image)
+   {
+      CHECK((image->comps[0].w == ii->width) && (image->comps[0].h == ii->height) && (image->numcomps == ii->num_components),
+            "%s : decoded %ux%u x %u", what, image->comps[0].w, image->comps[0].h, image->numcomps);
+
+      if ((image->comps[0].w == ii->width) && (image->comps[0].h == ii->height) && (image->numcomps == ii->num_components))
+      {
+         decoded = g_new(guchar, n);
+
+         CHECK(Image_ToInterleaved(image, decoded, ii->width, ii->height, 0, ii->height, nullptr), "%s : interleave failed", what);
+
+         if (lossless)
+            CHECK(!memcmp(decoded, ii->data, n), "%s : lossless round trip differs", what);
+         else
+            CHECK(Psnr(decoded, ii->data, n) > 25.0, "%s : PSNR %.1f dB", what, Psnr(decoded, ii->data, n));
+
+         g_free(decoded);
+      }
+
+      opj_image_destroy(image);
+   }
+
+   g_free(cs.data);
+}
+
+
+// Every preset, lossless & lossy, untiled & tiled, on sizes down to less than the presets' resolution levels allow - the
+// smallest still has two alpha values, a single pixel's would be dropped as uniform.
+static void TestPresets(void)
+{
+   static const guint sizes[][2] = { { 257, 131 }, { 17, 9 }, { 3, 2 } };
+   static const guint components[] = { 1, 3, 4 };
+   guint s, c, tiled, lossless;
+   int p;
+
+   for (p=0;p<NUM_PRESETS;p++)
+   {
+      for (s=0;s<G_N_ELEMENTS(sizes);s++)
+      {
+         for (c=0;c<G_N_ELEMENTS(components);c++)
+         {
+            Image_Info ii;
+
+            Synthesize(&ii, sizes[s][0], sizes[s][1], components[c]);
+
+            for (tiled=0;tiled<2;tiled++)
+            {
+               for (lossless=0;lossless<2;lossless++)
+               {
+                  Save_Parameters params;
+                  gchar *what;
+
+                  memset(&params, 0, sizeof(Save_Parameters));
+
+                  Layers_Setup(&params, lossless ? 1.0 : 0.6, nullptr, nullptr);
+
+                  params.preset = (Encoder_Preset) p;
+                  params.tile_size = tiled ? 64 : 0;
+
+                  what = g_strdup_printf("%s %ux%u x %u%s%s", Preset_Name(params.preset), ii.width, ii.height, ii.num_components,
+                                         tiled ? " tiled" : "", lossless ? " lossless" : " lossy");
+
+                  RoundTrip(what, &ii, &params, true, lossless);
+                  RoundTrip(what, &ii, &params, false, lossless);
+
+                  g_free(what);
+               }
+            }
+
+            g_free(ii.data);
+         }
+      }
+   }
+}
+
+
+// Target size encodes land at or under the target & within 10% of it, single tile or tiled, J2K or JP2.
+static void TestTargetSize(void)
+{
+   static const guint64 targets[] = { 5000, 20000, 80000 };
+   Image_Info ii;
+   guint t, tiled, codestream;
+
+   Synthesize(&ii, 300, 200, 3);
+
+   for (t=0;t<G_N_ELEMENTS(targets);t++)
+   {
+      for (tiled=0;tiled<2;tiled++)
+      {
+         for (codestream=0;codestream<2;codestream++)
+         {
+            Codestream cs = { nullptr, 0 };
+            Save_Parameters params;
+
+            memset(&params, 0, sizeof(Save_Parameters));
+            Layers_Setup(&params, 0.5, nullptr, nullptr);
+
+            params.target_size = targets[t];
+            params.tile_size = tiled ? 64 : 0;
+
+            CHECK(serialize_image(&ii, &params, codestream, KeepCodestream, &cs), "target %lu : encode failed", (unsigned long) targets[t]);
+            CHECK(cs.data && (cs.len <= targets[t]) && (cs.len >= targets[t] * 0.9), "target %lu%s %s : %lu bytes",
+                  (unsigned long) targets[t], tiled ? " tiled" : "", codestream ? "j2k" : "jp2", (unsigned long) cs.len);
+
+            g_free(cs.data);
+         }
+      }
+   }
+
+   g_free(ii.data);
+}
+
+
+// Progression order & layer count from the main header's COD marker.
+static bool ReadCod(const guint8 *data, gsize len, guint *progression, guint *num_layers)
+{
+   gsize pos = 2;   // After SOC.
+
+   while ((pos + 4 <= len) && (data[pos] == 0xff) && (data[pos+1] != 0x90))   // Up to the first SOT.
+   {
+      if ((data[pos+1] == 0x52) && (pos + 8 <= len))
+      {
+         *progression = data[pos+5];
+         *num_layers = (data[pos+6] << 8) | data[pos+7];
+         return true;
+      }
+
+      pos += 2 + ((data[pos+2] << 8) | data[pos+3]);
+   }
+
+   return false;
+}
+
+
+// N quality layers in each progression order : the COD marker must say so, & the first layer alone must decode coarser.
+static void TestLayers(void)
+{
+   static const char *qualities[] = { "0.6", "0.3,0.6", "0.2,0.3,0.4,0.5,0.6" };
+   static const guint num_layers[] = { 1, 2, 5 };
+   gsize n;
+   Image_Info ii;
+   guint l;
+   int p;
+
+   Synthesize(&ii, 129, 67, 3);
+   n = (gsize) ii.width * ii.height * ii.num_components;
+
+   for (l=0;l<G_N_ELEMENTS(qualities);l++)
+   {
+      for (p=OPJ_LRCP;p<=OPJ_CPRL;p++)
+      {
+         Codestream cs = { nullptr, 0 };
+         Save_Parameters params;
+         guint progression = 0, layers = 0;
+
+         memset(&params, 0, sizeof(Save_Parameters));
+         Layers_Setup(&params, 0.6, qualities[l], nullptr);
+         params.progression = (OPJ_PROG_ORDER) p;
+
+         CHECK(serialize_image(&ii, &params, true, KeepCodestream, &cs), "layers %s %s : encode failed", qualities[l], Progression_Name(p));
+         CHECK(cs.data && ReadCod(cs.data, cs.len, &progression, &layers) && (layers == num_layers[l]) && (progression == (guint) p),
+               "layers %s %s : COD has %u layers, progression %u", qualities[l], Progression_Name(p), layers, progression);
+
+         if (cs.data && (num_layers[l] > 1))
+         {
+            Decode_Options first;
+            opj_image_t *coarse, *full;
+
+            memset(&first, 0, sizeof(Decode_Options));
+            first.layers = 1;
+
+            coarse = decode_image(cs.data, cs.len, true, &first);
+            full = decode_image(cs.data, cs.len, true, nullptr);
+
+            if (coarse && full)
+            {
+               guchar *a = g_new(guchar, n), *b = g_new(guchar, n);
+
+               Image_ToInterleaved(coarse, a, ii.width, ii.height, 0, ii.height, nullptr);
+               Image_ToInterleaved(full, b, ii.width, ii.height, 0, ii.height, nullptr);
+
+               CHECK(Psnr(a, ii.data, n) + 1.0 < Psnr(b, ii.data, n), "layers %s %s : first layer %.1f dB, all %.1f dB", qualities[l],
+                     Progression_Name(p), Psnr(a, ii.data, n), Psnr(b, ii.data, n));
+
+               g_free(a);
+               g_free(b);
+            }
+            else
+               CHECK(false, "layers %s %s : decode failed", qualities[l], Progression_Name(p));
+
+            if (coarse)
+               opj_image_destroy(coarse);
+
+            if (full)
+               opj_image_destroy(full);
+         }
+
+         g_free(cs.data);
+      }
+   }
+
+   g_free(ii.data);
+}
+
+
+static guchar *Interleaved(const opj_image_t *image)
+{
+   guint width = image->comps[0].w, height = image->comps[0].h;
+   guchar *pixels = g_new(guchar, (gsize) width * height * image->numcomps);
+
+   Image_ToInterleaved(image, pixels, width, height, 0, height, nullptr);
+
+   return pixels;
+}
+
+
+// A window or reduced decode must match the same pixels cut from the whole image decoded at that reduction. Windows are
+// in full resolution pixels, rounded outwards at lower resolutions.
+static void CheckWindow(const char *what, const Codestream *cs, const char *path, guint reduce, guint x0, guint y0, guint x1, guint y1)
+{
+   Decode_Options whole, window;
+   opj_image_t *reference, *image;
+   guint scale = 1 << reduce;
+   guint rx0 = (x0 + scale - 1) / scale, ry0 = (y0 + scale - 1) / scale;
+   guint rx1 = (x1 + scale - 1) / scale, ry1 = (y1 + scale - 1) / scale;
+
+   memset(&whole, 0, sizeof(Decode_Options));
+   whole.reduce = reduce;
+
+   window = whole;
+   window.x0 = x0;
+   window.y0 = y0;
+   window.x1 = x1;
+   window.y1 = y1;
+
+   reference = decode_image(cs->data, cs->len, true, &whole);
+   image = path ? image_load(path, &window) : decode_image(cs->data, cs->len, true, &window);
+
+   CHECK(reference && image, "%s : decode failed", what);
+
+   if (reference && image)
+   {
+      guint nc = image->numcomps, y, wrong = 0;
+
+      CHECK((image->comps[0].w == rx1 - rx0) && (image->comps[0].h == ry1 - ry0), "%s : decoded %ux%u, %ux%u expected", what,
+            image->comps[0].w, image->comps[0].h, rx1 - rx0, ry1 - ry0);
+
+      if ((image->comps[0].w == rx1 - rx0) && (image->comps[0].h == ry1 - ry0) && (nc == reference->numcomps))
+      {
+         guchar *a = Interleaved(reference), *b = Interleaved(image);
+
+         for (y=0;y<ry1-ry0;y++)
+            if (memcmp(b + (gsize) y * (rx1 - rx0) * nc, a + (((gsize) (ry0 + y) * reference->comps[0].w) + rx0) * nc, (rx1 - rx0) * nc))
+               wrong++;
+
+         CHECK(wrong == 0, "%s : %u rows differ from the whole image's", what, wrong);
+
+         g_free(a);
+         g_free(b);
+      }
+   }
+
+   if (reference)
+      opj_image_destroy(reference);
+
+   if (image)
+      opj_image_destroy(image);
+}
+
+
+// Window & reduced decodes, of single tile & tiled codestreams, from memory & from a mapped file.
+static void TestRegionReduce(void)
+{
+   Image_Info ii;
+   guint tiled;
+
+   Synthesize(&ii, 257, 131, 3);
+
+   for (tiled=0;tiled<2;tiled++)
+   {
+      Codestream cs = { nullptr, 0 };
+      Save_Parameters params;
+      gchar *path = nullptr;
+      gint fd;
+
+      memset(&params, 0, sizeof(Save_Parameters));
+      Layers_Setup(&params, 1.0, nullptr, nullptr);
+      params.tile_size = tiled ? 64 : 0;
+
+      CHECK(serialize_image(&ii, &params, true, KeepCodestream, &cs), "region%s : encode failed", tiled ? " tiled" : "");
+
+      if (!cs.data)
+         continue;
+
+      // Lossless, so the whole image at full resolution is the source itself.
+      {
+         opj_image_t *image = decode_image(cs.data, cs.len, true, nullptr);
+         guchar *pixels = image ? Interleaved(image) : nullptr;
+
+         CHECK(pixels && !memcmp(pixels, ii.data, (gsize) ii.width * ii.height * ii.num_components), "region%s : whole image differs",
+               tiled ? " tiled" : "");
+
+         g_free(pixels);
+
+         if (image)
+            opj_image_destroy(image);
+      }
+
+      CheckWindow(tiled ? "window tiled" : "window", &cs, nullptr, 0, 30, 20, 200, 100);
+      CheckWindow(tiled ? "reduce tiled" : "reduce", &cs, nullptr, 1, 0, 0, ii.width, ii.height);
+      CheckWindow(tiled ? "window reduce 2 tiled" : "window reduce 2", &cs, nullptr, 2, 31, 5, 250, 127);
+
+      fd = g_file_open_tmp("j2k-test-XXXXXX.j2k", &path, nullptr);
+
+      if (fd >= 0)
+         g_close(fd, nullptr);
+
+      if (path && g_file_set_contents(path, (const gchar *) cs.data, cs.len, nullptr))
+      {
+         CheckWindow(tiled ? "file window reduce 1 tiled" : "file window reduce 1", &cs, path, 1, 65, 33, 190, 131);
+         g_remove(path);
+      }
+      else
+         CHECK(false, "region : could not write test file");
+
+      g_free(path);
+      g_free(cs.data);
+   }
+
+   g_free(ii.data);
+}
+
+
+// Real J2K & JP2 output is recognised as such. Other formats, other markers after SOC & short or altered signatures aren't.
+static void TestSniff(void)
+{
+   static const struct
+   {
+      const char *what;
+      guint8      data[FORMAT_SNIFF_BYTES];
+      gsize       len;
+
+   } others[] =
+   {
+      { "png",                  { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a, 0, 0, 0, 0x0d },      12 },
+      { "jpeg",                 { 0xff, 0xd8, 0xff, 0xe0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1 },         12 },
+      { "soc without siz",      { 0xff, 0x4f, 0xff, 0x52, 0, 0x0c, 0, 0, 0, 0, 0, 0 },                12 },
+      { "short codestream",     { 0xff, 0x4f, 0xff },                                                  3  },
+      { "short jp2 signature",  { 0, 0, 0, 0x0c, 'j', 'P', ' ', ' ', 0x0d, 0x0a, 0x87 },               11 },
+      { "other signature type", { 0, 0, 0, 0x0c, 'j', 'P', ' ', '!', 0x0d, 0x0a, 0x87, 0x0a },         12 },
+      { "empty",                { 0 },                                                                 0  },
+   };
+   Image_Info ii;
+   guint i, codestream;
+
+   Synthesize(&ii, 17, 9, 3);
+
+   for (codestream=0;codestream<2;codestream++)
+   {
+      Codestream cs = { nullptr, 0 };
+      Save_Parameters params;
+      bool format_codestream = !codestream;
+
+      memset(&params, 0, sizeof(Save_Parameters));
+      Layers_Setup(&params, 0.6, nullptr, nullptr);
+
+      CHECK(serialize_image(&ii, &params, codestream, KeepCodestream, &cs), "sniff : encode failed");
+      CHECK(cs.data && Format_Sniff(cs.data, cs.len, &format_codestream) && (format_codestream == (bool) codestream),
+            "sniff : %s output not recognised", codestream ? "j2k" : "jp2");
+
+      g_free(cs.data);
+   }
+
+   for (i=0;i<G_N_ELEMENTS(others);i++)
+   {
+      bool format_codestream;
+
+      CHECK(!Format_Sniff(others[i].data, others[i].len, &format_codestream), "sniff : %s accepted", others[i].what);
+   }
+
+   g_free(ii.data);
+}
+
+
+// 16 bit sources holding replicated lower precision values are written at that precision, losslessly.
+static void TestDeepPrecision(void)
+{
+   static const guint32 precs[] = { 8, 12, 16 };
+   const guint width = 67, height = 45, num_components = 3;
+   gsize n = (gsize) width * height * num_components, i;
+   GRand *rand = g_rand_new_with_seed(16);
+   guint16 *samples = g_new(guint16, n);
+   guint p, tiled;
+
+   for (p=0;p<G_N_ELEMENTS(precs);p++)
+   {
+      guint32 bits = precs[p];
+
+      for (i=0;i<n;i++)
+      {
+         guint32 v = (guint32) g_rand_int_range(rand, 0, 1 << bits);
+
+         samples[i] = (guint16) ((v << (16 - bits)) | (v >> (2 * bits - 16)));
+      }
+
+      for (tiled=0;tiled<2;tiled++)
+      {
+         Codestream cs = { nullptr, 0 };
+         Save_Parameters params;
+         opj_image_t *image;
+         Image_Info ii;
+
+         memset(&ii, 0, sizeof(Image_Info));
+         ii.width = width;
+         ii.height = height;
+         ii.num_components = num_components;
+         ii.bytes_per_sample = 2;
+         ii.data = (guchar *) samples;
+
+         memset(&params, 0, sizeof(Save_Parameters));
+         Layers_Setup(&params, 1.0, nullptr, nullptr);
+         params.tile_size = tiled ? 32 : 0;
+
+         CHECK(serialize_image(&ii, &params, true, KeepCodestream, &cs), "deep %u bit%s : encode failed", bits, tiled ? " tiled" : "");
+
+         image = cs.data ? decode_image(cs.data, cs.len, true, nullptr) : nullptr;
+
+         if (image && (image->numcomps == num_components))
+         {
+            guint c, wrong = 0;
+
+            CHECK(image->comps[0].prec == bits, "deep %u bit%s : written at %u bits", bits, tiled ? " tiled" : "", image->comps[0].prec);
+
+            for (c=0;c<num_components;c++)
+               for (i=0;i<(gsize) width * height;i++)
+                  if ((guint32) image->comps[c].data[i] != (guint32) samples[i * num_components + c] >> (16 - image->comps[c].prec))
+                     wrong++;
+
+            CHECK(wrong == 0, "deep %u bit%s : %u samples differ", bits, tiled ? " tiled" : "", wrong);
+         }
+         else
+            CHECK(false, "deep %u bit%s : decode failed", bits, tiled ? " tiled" : "");
+
+         if (image)
+            opj_image_destroy(image);
+
+         g_free(cs.data);
+      }
+   }
+
+   g_free(samples);
+   g_rand_free(rand);
+}
+
+
+static void AppendBE(GByteArray *a, guint32 value, guint bytes)
+{
+   guint8 b[4];
+   guint i;
+
+   for (i=0;i<bytes;i++)
+      b[i] = (guint8) (value >> (8 * (bytes - 1 - i)));
+
+   g_byte_array_append(a, b, bytes);
+}
+
+
+static void AppendBox(GByteArray *a, const char *type, const guint8 *data, guint len)
+{
+   AppendBE(a, 8 + len, 4);
+   g_byte_array_append(a, (const guint8 *) type, 4);
+   g_byte_array_append(a, data, len);
+}
+
+
+typedef struct
+{
+   guchar *pixels;
+   guint   width;
+   guint   height;
+   guint   num_components;
+   guint   bytes_per_sample;
+
+} Collect_Sink;
+
+
+static bool CollectBegin(void *user, guint width, guint height, guint num_components, guint bytes_per_sample)
+{
+   Collect_Sink *c = (Collect_Sink *) user;
+
+   c->width = width;
+   c->height = height;
+   c->num_components = num_components;
+   c->bytes_per_sample = bytes_per_sample;
+   c->pixels = g_new0(guchar, (gsize) width * height * num_components * bytes_per_sample);
+
+   return true;
+}
+
+
+static bool CollectRows(void *user, const guchar *pixels, guint x, guint y, guint width, guint height)
+{
+   Collect_Sink *c = (Collect_Sink *) user;
+   gsize pixel = c->num_components * c->bytes_per_sample;
+   guint j;
+
+   for (j=0;j<height;j++)
+      memcpy(c->pixels + ((gsize) (y + j) * c->width + x) * pixel, pixels + (gsize) j * width * pixel, width * pixel);
+
+   return true;
+}
+
+
+// A palettized JP2 - one index component mapped through pclr & cmap boxes to RGB - must load as the palette's colours.
+// OpenJPEG applies the palette only in a whole image decode, which the tile by tile loader has to fall back to.
+static void TestPaletteLoad(void)
+{
+   const guint width = 37, height = 21, num_entries = 16;
+   GByteArray *file = g_byte_array_new(), *box = g_byte_array_new();
+   Codestream cs = { nullptr, 0 };
+   Save_Parameters params;
+   Collect_Sink collect;
+   Tile_Sink sink;
+   Image_Info ii;
+   gchar *path = nullptr;
+   guint x, y, i;
+   gint fd;
+
+   memset(&ii, 0, sizeof(Image_Info));
+   ii.width = width;
+   ii.height = height;
+   ii.num_components = 1;
+   ii.data = g_new(guchar, width * height);
+
+   for (y=0;y<height;y++)
+      for (x=0;x<width;x++)
+         ii.data[y * width + x] = (guchar) ((x + 3 * y) % num_entries);
+
+   memset(&params, 0, sizeof(Save_Parameters));
+   Layers_Setup(&params, 1.0, nullptr, nullptr);
+
+   CHECK(serialize_image(&ii, &params, true, KeepCodestream, &cs), "palette : index encode failed");
+
+   // Signature, file type, then the header : ihdr, colr (sRGB), pclr & cmap.
+   AppendBE(file, 12, 4);
+   g_byte_array_append(file, (const guint8 *) "jP  \r\n\x87\n", 8);
+
+   g_byte_array_append(box, (const guint8 *) "jp2 ", 4);
+   AppendBE(box, 0, 4);
+   g_byte_array_append(box, (const guint8 *) "jp2 ", 4);
+   AppendBox(file, "ftyp", box->data, box->len);
+   g_byte_array_set_size(box, 0);
+
+   {
+      GByteArray *header = g_byte_array_new();
+
+      AppendBE(box, height, 4);
+      AppendBE(box, width, 4);
+      AppendBE(box, 1, 2);      // Codestream components.
+      AppendBE(box, 7, 1);      // 8 bit unsigned.
+      AppendBE(box, 7, 1);      // Wavelet compression.
+      AppendBE(box, 0, 2);      // Colourspace known, no IPR.
+      AppendBox(header, "ihdr", box->data, box->len);
+      g_byte_array_set_size(box, 0);
+
+      AppendBE(box, 1, 1);      // Enumerated colourspace.
+      AppendBE(box, 0, 2);
+      AppendBE(box, 16, 4);     // sRGB.
+      AppendBox(header, "colr", box->data, box->len);
+      g_byte_array_set_size(box, 0);
+
+      AppendBE(box, num_entries, 2);
+      AppendBE(box, 3, 1);
+
+      for (i=0;i<3;i++)
+         AppendBE(box, 7, 1);
+
+      for (i=0;i<num_entries;i++)
+      {
+         AppendBE(box, i * 16, 1);
+         AppendBE(box, 255 - i * 16, 1);
+         AppendBE(box, (i * 37) & 0xff, 1);
+      }
+
+      AppendBox(header, "pclr", box->data, box->len);
+      g_byte_array_set_size(box, 0);
+
+      for (i=0;i<3;i++)
+      {
+         AppendBE(box, 0, 2);   // Component 0 ...
+         AppendBE(box, 1, 1);   // ... through the palette ...
+         AppendBE(box, i, 1);   // ... column i.
+      }
+
+      AppendBox(header, "cmap", box->data, box->len);
+      g_byte_array_set_size(box, 0);
+
+      AppendBox(file, "jp2h", header->data, header->len);
+      g_byte_array_free(header, TRUE);
+   }
+
+   if (cs.data)
+      AppendBox(file, "jp2c", cs.data, (guint) cs.len);
+
+   fd = g_file_open_tmp("j2k-test-XXXXXX.jp2", &path, nullptr);
+
+   if (fd >= 0)
+      g_close(fd, nullptr);
+
+   CHECK(path && g_file_set_contents(path, (const gchar *) file->data, file->len, nullptr), "palette : could not write test file");
+
+   memset(&collect, 0, sizeof(Collect_Sink));
+   sink.begin = CollectBegin;
+   sink.rows = CollectRows;
+   sink.user = &collect;
+
+   if (path && cs.data)
+   {
+      CHECK(image_load_tiles(path, nullptr, &sink), "palette : load failed");
+      CHECK((collect.width == width) && (collect.height == height) && (collect.num_components == 3) && (collect.bytes_per_sample == 1),
+            "palette : loaded %ux%u x %u, %u bytes per sample", collect.width, collect.height, collect.num_components, collect.bytes_per_sample);
+
+      if (collect.pixels && (collect.width == width) && (collect.height == height) && (collect.num_components == 3))
+      {
+         guint wrong = 0;
+
+         for (y=0;y<height;y++)
+         {
+            for (x=0;x<width;x++)
+            {
+               const guchar *p = collect.pixels + (y * width + x) * 3;
+               guint index = ii.data[y * width + x];
+
+               if ((p[0] != index * 16) || (p[1] != 255 - index * 16) || (p[2] != ((index * 37) & 0xff)))
+                  wrong++;
+            }
+         }
+
+         CHECK(wrong == 0, "palette : %u pixels differ from their palette colour", wrong);
+      }
+
+      g_remove(path);
+   }
+
+   g_free(collect.pixels);
+   g_free(path);
+   g_free(cs.data);
+   g_free(ii.data);
+   g_byte_array_free(box, TRUE);
+   g_byte_array_free(file, TRUE);
+}
+
+
+// A fit holds for changes of quality alone. Tiling & layer changes need a refit, which measures their overhead.
+static void TestEstimatorMatches(void)
+{
+   Save_Parameters params, changed;
+   Size_Estimator e;
+   Image_Info ii;
+
+   Synthesize(&ii, 300, 200, 3);
+
+   memset(&params, 0, sizeof(Save_Parameters));
+   Layers_Setup(&params, 0.4, nullptr, nullptr);
+
+   CHECK(Estimator_Fit(&e, &ii, &params), "estimator : fit failed");
+   CHECK(Estimator_Matches(&e, &params), "estimator : fit doesn't match its own settings");
+   CHECK(e.layout_ratio == 1.0, "estimator : single layer, untiled layout ratio %g", e.layout_ratio);
+   CHECK(e.encode_ns_per_pixel > 0, "estimator : encode not timed");
+
+   changed = params;
+   changed.quality[0] = 0.7 * QUALITY_MAX;
+   changed.target_size = 1000;
+   CHECK(Estimator_Matches(&e, &changed), "estimator : quality change needs a refit");
+
+   changed = params;
+   changed.tile_size = 64;
+   CHECK(!Estimator_Matches(&e, &changed), "estimator : tile size change kept the fit");
+
+   changed = params;
+   changed.preset = PRESET_SMALLEST;
+   CHECK(!Estimator_Matches(&e, &changed), "estimator : preset change kept the fit");
+
+   // Tiled & layered : fitted with the overhead measured, & the layer values it was measured at.
+   changed = params;
+   changed.tile_size = 64;
+   Layers_Setup(&changed, 0.4, "0.2,0.3,0.4", nullptr);
+
+   CHECK(Estimator_Fit(&e, &ii, &changed), "estimator : tiled, layered fit failed");
+   CHECK(Estimator_Matches(&e, &changed), "estimator : tiled, layered fit doesn't match its own settings");
+   CHECK(e.layout_ratio > 0.5 && e.layout_ratio < 2.0, "estimator : layout ratio %g", e.layout_ratio);
+
+   changed.quality[1] = 0.35 * QUALITY_MAX;
+   CHECK(!Estimator_Matches(&e, &changed), "estimator : layer change kept the fit");
+
+   g_free(ii.data);
+}
+
+
+int main(void)
+{
+   TestPresets();
+   TestTargetSize();
+   TestLayers();
+   TestRegionReduce();
+   TestSniff();
+   TestDeepPrecision();
+   TestPaletteLoad();
+   TestEstimatorMatches();
+
+   if (failures)
+      fprintf(stderr, "j2k-test-codec: %d failures.\n", failures);
+
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,442 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+// j2k-test-convert : every SIMD conversion kernel the running CPU supports against the scalar reference, on widths which
+// leave every tail length & every source layout. Run by meson test.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "main.h"
+#include "convert_j2k.h"
+
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                         \
+   G_STMT_START                                  \
+   {                                             \
+      if (!(cond))                               \
+      {                                          \
+         fprintf(stderr, "FAIL %s:%d : ", __FILE__, __LINE__);   \
+         fprintf(stderr, __VA_ARGS__);           \
+         fprintf(stderr, "\n");                  \
+         failures++;                             \
+      }                                          \
+   }                                             \
+   G_STMT_END
+
+
+// Odd, & either side of each vector width.
+static const guint32 widths[] = { 1, 2, 3, 5, 7, 9, 15, 16, 17, 31, 33, 47, 63, 64, 65, 95, 129, 255, 257 };
+
+#define MAX_WIDTH 257
+#define GUARD     0x5a5a5a5a   // Written past the row end, must survive the kernel.
+
+static const char *const simd_levels[] = { "sse2", "avx2" };
+
+static const struct
+{
+   Planar_Layout layout;
+   guint32       src_samples;   // Per pixel.
+   const char   *name;
+
+} layouts[] =
+{
+   { PLANAR_G,       1, "g"       },
+   { PLANAR_GA,      2, "ga"      },
+   { PLANAR_GX,      2, "gx"      },
+   { PLANAR_RGB,     3, "rgb"     },
+   { PLANAR_RGB_G,   3, "rgb-g"   },
+   { PLANAR_RGBA,    4, "rgba"    },
+   { PLANAR_RGBX,    4, "rgbx"    },
+   { PLANAR_RGBA_GA, 4, "rgba-ga" },
+   { PLANAR_RGBX_G,  4, "rgbx-g"  },
+};
+
+
+// Selects level, FALSE when the CPU lacks it.
+static gboolean UseLevel(const char *level)
+{
+   return Convert_LimitSimd(level) && !strcmp(Convert_SimdName(), level);
+}
+
+
+static void FillPlanes(OPJ_INT32 planes[4][MAX_WIDTH + 1])
+{
+   guint c;
+
+   for (c=0;c<4;c++)
+   {
+      guint32 x;
+
+      for (x=0;x<=MAX_WIDTH;x++)
+         planes[c][x] = GUARD;
+   }
+}
+
+
+// Interleaved u8 -> int32 planes. The source starts off alignment, as rows of odd width do.
+static void TestDeinterleave(GRand *rand, const char *level)
+{
+   guint8 src[MAX_WIDTH * 4 + 1];
+   OPJ_INT32 ref[4][MAX_WIDTH + 1], out[4][MAX_WIDTH + 1];
+   OPJ_INT32 *ref_rows[4] = { ref[0], ref[1], ref[2], ref[3] };
+   OPJ_INT32 *out_rows[4] = { out[0], out[1], out[2], out[3] };
+   guint i, w, c;
+
+   for (i=0;i<G_N_ELEMENTS(layouts);i++)
+   {
+      Deinterleave_Fn simd, scalar;
+      guint32 numcomps = Planar_NumComponents(layouts[i].layout);
+
+      UseLevel(level);
+      simd = Deinterleave_GetKernel(layouts[i].layout);
+      UseLevel("scalar");
+      scalar = Deinterleave_GetKernel(layouts[i].layout);
+
+      for (w=0;w<G_N_ELEMENTS(widths);w++)
+      {
+         guint32 width = widths[w], x;
+
+         for (x=0;x<sizeof(src);x++)
+            src[x] = (guint8) g_rand_int_range(rand, 0, 256);
+
+         FillPlanes(ref);
+         FillPlanes(out);
+
+         scalar(src + 1, ref_rows, width);
+         simd(src + 1, out_rows, width);
+
+         for (c=0;c<numcomps;c++)
+         {
+            CHECK(!memcmp(ref[c], out[c], (width + 1) * sizeof(OPJ_INT32)), "deinterleave %s %s : width %u, component %u differs",
+                  level, layouts[i].name, width, c);
+         }
+      }
+   }
+}
+
+
+// The analysis pass : grey & uniform alpha images, each broken by one pixel at the start, middle & end of the last row.
+static void TestScan(GRand *rand, const char *level)
+{
+   guint8 src[3 * MAX_WIDTH * 4];
+   guint32 spp, w, where, what;
+
+   for (spp=1;spp<=4;spp++)
+   {
+      for (w=0;w<G_N_ELEMENTS(widths);w++)
+      {
+         guint32 width = widths[w], pitch = width * spp, x, c;
+         guint32 breaks[3] = { 2 * width, 2 * width + width / 2, 3 * width - 1 };
+
+         for (where=0;where<3;where++)
+         {
+            // 0 : untouched, 1 : colour off grey by more than the threshold, 2 : alpha off.
+            for (what=0;what<3;what++)
+            {
+               Scan_Result ref, out;
+               guint8 *p = src;
+               guint8 alpha = (guint8) g_rand_int_range(rand, 0, 256);
+
+               for (x=0; x<3*width; x++, p+=spp)
+               {
+                  guint8 grey = (guint8) g_rand_int_range(rand, 0, 256);
+
+                  for (c=0;c<spp;c++)
+                     p[c] = grey;
+
+                  if ((spp == 2) || (spp == 4))
+                     p[spp-1] = alpha;
+               }
+
+               p = src + breaks[where] * spp;
+
+               if ((what == 1) && (spp >= 3))
+                  p[1] = p[0] + MONO_THRESHOLD + 1;
+
+               if ((what == 2) && ((spp == 2) || (spp == 4)))
+                  p[spp-1] = alpha + 1;
+
+               UseLevel("scalar");
+               Scan_Begin(&ref, spp, FALSE);
+               Scan_Rows(&ref, src, pitch, width, 3);
+               Scan_End(&ref);
+
+               UseLevel(level);
+               Scan_Begin(&out, spp, FALSE);
+               Scan_Rows(&out, src, pitch, width, 3);
+               Scan_End(&out);
+
+               CHECK((ref.mono == out.mono) && (ref.alpha_uniform == out.alpha_uniform) && (ref.alpha_value == out.alpha_value),
+                     "scan %s : %u channels, width %u, case %u at %u : mono %d / %d, alpha uniform %d / %d, alpha %u / %u",
+                     level, spp, width, what, breaks[where], ref.mono, out.mono, ref.alpha_uniform, out.alpha_uniform,
+                     ref.alpha_value, out.alpha_value);
+            }
+         }
+      }
+   }
+}
+
+
+// Ranges need every pixel : per channel min & max against a plain loop, on a random band of rows.
+static void TestScanRanges(GRand *rand, const char *level)
+{
+   guint8 src[3 * MAX_WIDTH * 4];
+   guint32 spp, w, c;
+
+   for (spp=1;spp<=4;spp++)
+   {
+      for (w=0;w<G_N_ELEMENTS(widths);w++)
+      {
+         guint32 width = widths[w], pitch = width * spp, x;
+         guint16 min[4] = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF }, max[4] = { 0 };
+         guint8 lo = (guint8) g_rand_int_range(rand, 0, 128), hi = (guint8) g_rand_int_range(rand, 128, 256);
+         Scan_Result ref, out;
+
+         for (x=0;x<3*pitch;x++)
+         {
+            src[x] = (guint8) g_rand_int_range(rand, lo, hi + 1);
+            min[x % spp] = MIN(min[x % spp], src[x]);
+            max[x % spp] = MAX(max[x % spp], src[x]);
+         }
+
+         UseLevel("scalar");
+         Scan_Begin(&ref, spp, TRUE);
+         Scan_Rows(&ref, src, pitch, width, 3);
+         Scan_End(&ref);
+
+         UseLevel(level);
+         Scan_Begin(&out, spp, TRUE);
+         Scan_Rows(&out, src, pitch, width, 3);
+         Scan_End(&out);
+
+         for (c=0;c<spp;c++)
+         {
+            CHECK((ref.min[c] == min[c]) && (ref.max[c] == max[c]) && (out.min[c] == min[c]) && (out.max[c] == max[c]) &&
+                  (out.bit_depth[c] == 8), "scan ranges %s : %u channels, width %u, channel %u : min %u / %u / %u, max %u / %u / %u",
+                  level, spp, width, c, min[c], ref.min[c], out.min[c], max[c], ref.max[c], out.max[c]);
+         }
+      }
+   }
+}
+
+
+// 16 bit bit depths : each channel holds values of its own precision, scaled up to 16 bits the way the loader does, so needs
+// exactly that many.
+static void TestScanRanges16(GRand *rand)
+{
+   static const guint32 precs[4] = { 8, 12, 15, 16 };
+   guint16 src[64 * 4];
+   guint32 x, c;
+   Scan_Result r;
+
+   for (x=0;x<64;x++)
+   {
+      for (c=0;c<4;c++)
+      {
+         guint32 bits = precs[c], v = (guint32) g_rand_int_range(rand, 0, 1 << bits);
+
+         // Both ends of the range, so every low bit of the scaled values varies.
+         if (x < 2)
+            v = x ? (1u << bits) - 1 : 0;
+         else if (x < 2 + bits)
+            v = 1u << (x - 2);
+
+         src[x * 4 + c] = (guint16) ((v << (16 - bits)) | (v >> (2 * bits - 16)));
+      }
+   }
+
+   Scan_Begin(&r, 4, TRUE);
+   Scan_Rows16(&r, src, 4 * 16, 16, 4);
+   Scan_End(&r);
+
+   for (c=0;c<4;c++)
+   {
+      CHECK(r.bit_depth[c] == precs[c], "scan ranges 16 : channel %u bit depth %u, %u expected", c, r.bit_depth[c], precs[c]);
+      CHECK((r.min[c] == 0) && (r.max[c] == 0xFFFF), "scan ranges 16 : channel %u range %u - %u", c, r.min[c], r.max[c]);
+   }
+}
+
+
+// Random samples reaching past both ends of a precision, so the clamps are exercised too.
+static void FillSamples(GRand *rand, OPJ_INT32 planes[4][MAX_WIDTH + 1], guint32 prec)
+{
+   guint32 c, x;
+
+   for (c=0;c<4;c++)
+      for (x=0;x<MAX_WIDTH;x++)
+         planes[c][x] = g_rand_int_range(rand, -100, (1 << prec) + 100);
+}
+
+
+// int32 planes -> interleaved u8, at each precision above 8 bits the loader shifts down.
+static void TestInterleave(GRand *rand, const char *level)
+{
+   static const guint32 shifts[] = { 0, 1, 4, 8 };
+   OPJ_INT32 src[4][MAX_WIDTH + 1];
+   const OPJ_INT32 *rows[4] = { src[0], src[1], src[2], src[3] };
+   guint8 ref[MAX_WIDTH * 4 + 1], out[MAX_WIDTH * 4 + 1];
+   guint32 numcomps, s, w;
+
+   for (numcomps=1;numcomps<=4;numcomps++)
+   {
+      Interleave_Fn simd, scalar;
+
+      UseLevel(level);
+      simd = Interleave_GetKernel(numcomps);
+      UseLevel("scalar");
+      scalar = Interleave_GetKernel(numcomps);
+
+      for (s=0;s<G_N_ELEMENTS(shifts);s++)
+      {
+         for (w=0;w<G_N_ELEMENTS(widths);w++)
+         {
+            guint32 width = widths[w];
+
+            FillSamples(rand, src, 8 + shifts[s]);
+            memset(ref, 0x5a, sizeof(ref));
+            memset(out, 0x5a, sizeof(out));
+
+            scalar(rows, ref, width, shifts[s]);
+            simd(rows, out, width, shifts[s]);
+
+            CHECK(!memcmp(ref, out, width * numcomps + 1), "interleave %s : %u components, width %u, shift %u differs",
+                  level, numcomps, width, shifts[s]);
+         }
+      }
+   }
+}
+
+
+// 16 bit : interleaved u16 -> int32 planes.
+static void TestDeinterleave16(GRand *rand, const char *level)
+{
+   guint16 src[MAX_WIDTH * 4 + 1];
+   OPJ_INT32 ref[4][MAX_WIDTH + 1], out[4][MAX_WIDTH + 1];
+   OPJ_INT32 *ref_rows[4] = { ref[0], ref[1], ref[2], ref[3] };
+   OPJ_INT32 *out_rows[4] = { out[0], out[1], out[2], out[3] };
+   guint i, w, c;
+
+   for (i=0;i<G_N_ELEMENTS(layouts);i++)
+   {
+      Deinterleave16_Fn simd, scalar;
+      guint32 numcomps = Planar_NumComponents(layouts[i].layout);
+
+      UseLevel(level);
+      simd = Deinterleave16_GetKernel(layouts[i].layout);
+      UseLevel("scalar");
+      scalar = Deinterleave16_GetKernel(layouts[i].layout);
+
+      for (w=0;w<G_N_ELEMENTS(widths);w++)
+      {
+         guint32 width = widths[w], x;
+
+         for (x=0;x<G_N_ELEMENTS(src);x++)
+            src[x] = (guint16) g_rand_int_range(rand, 0, 65536);
+
+         FillPlanes(ref);
+         FillPlanes(out);
+
+         scalar(src + 1, ref_rows, width);
+         simd(src + 1, out_rows, width);
+
+         for (c=0;c<numcomps;c++)
+         {
+            CHECK(!memcmp(ref[c], out[c], (width + 1) * sizeof(OPJ_INT32)), "deinterleave16 %s %s : width %u, component %u differs",
+                  level, layouts[i].name, width, c);
+         }
+      }
+   }
+}
+
+
+// 16 bit : int32 planes -> interleaved u16, from precisions scaled up & down to 16 bits.
+static void TestInterleave16(GRand *rand, const char *level)
+{
+   static const guint32 precs[] = { 8, 10, 12, 15, 16, 20 };
+   OPJ_INT32 src[4][MAX_WIDTH + 1];
+   const OPJ_INT32 *rows[4] = { src[0], src[1], src[2], src[3] };
+   guint16 ref[MAX_WIDTH * 4 + 1], out[MAX_WIDTH * 4 + 1];
+   guint32 numcomps, p, w;
+
+   for (numcomps=1;numcomps<=4;numcomps++)
+   {
+      Interleave16_Fn simd, scalar;
+
+      UseLevel(level);
+      simd = Interleave16_GetKernel(numcomps);
+      UseLevel("scalar");
+      scalar = Interleave16_GetKernel(numcomps);
+
+      for (p=0;p<G_N_ELEMENTS(precs);p++)
+      {
+         for (w=0;w<G_N_ELEMENTS(widths);w++)
+         {
+            guint32 width = widths[w];
+
+            FillSamples(rand, src, precs[p]);
+            memset(ref, 0x5a, sizeof(ref));
+            memset(out, 0x5a, sizeof(out));
+
+            scalar(rows, ref, width, precs[p]);
+            simd(rows, out, width, precs[p]);
+
+            CHECK(!memcmp(ref, out, (width * numcomps + 1) * sizeof(guint16)), "interleave16 %s : %u components, width %u, precision %u differs",
+                  level, numcomps, width, precs[p]);
+         }
+      }
+   }
+}
+
+
+int main(void)
+{
+   GRand *rand = g_rand_new_with_seed(2025);
+   guint i;
+
+   for (i=0;i<G_N_ELEMENTS(simd_levels);i++)
+   {
+      if (!UseLevel(simd_levels[i]))
+      {
+         printf("j2k-test-convert: %s not supported, skipped.\n", simd_levels[i]);
+         continue;
+      }
+
+      TestDeinterleave(rand, simd_levels[i]);
+      TestScan(rand, simd_levels[i]);
+      TestScanRanges(rand, simd_levels[i]);
+      TestInterleave(rand, simd_levels[i]);
+      TestDeinterleave16(rand, simd_levels[i]);
+      TestInterleave16(rand, simd_levels[i]);
+   }
+
+   UseLevel("scalar");
+   TestScanRanges16(rand);
+
+   g_rand_free(rand);
+
+   if (failures)
+      fprintf(stderr, "j2k-test-convert: %d failures.\n", failures);
+
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,241 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "main.h"
+#include "trace_j2k.h"
+
+
+// Bounds memory should tracing be left on for a long session.
+#define MAX_TRACE_EVENTS 1000000
+
+typedef struct
+{
+   const char *name;
+   gchar      *msg;       // Messages only.
+   gint64      ts;        // Microseconds.
+   gint64      dur;
+   guint64     bytes;
+   guint       tid;
+   char        ph;        // Chrome phase : 'X' complete, 'i' instant.
+
+} Trace_Event;
+
+
+static bool     trace_enabled = false;
+static gchar   *trace_path = nullptr;
+static gint64   trace_origin;
+static GMutex   trace_lock;
+static GArray  *trace_events = nullptr;
+static gint     trace_next_tid = 0;
+static GPrivate trace_tid = G_PRIVATE_INIT(nullptr);
+
+
+bool Trace_Enabled(void)
+{
+   static gsize initialised = 0;
+
+   if (g_once_init_enter(&initialised))
+   {
+      const char *env = g_getenv(TRACE_ENV);
+
+      if (env && *env && strcmp(env, "0"))
+      {
+         trace_path = !strcmp(env, "1") ? g_build_filename(g_get_tmp_dir(), "j2k-trace.json", nullptr) : g_strdup(env);
+         trace_origin = g_get_monotonic_time();
+         trace_events = g_array_new(FALSE, FALSE, sizeof(Trace_Event));
+         trace_enabled = true;
+
+         atexit(Trace_Flush);
+      }
+
+      g_once_init_leave(&initialised, 1);
+   }
+
+   return trace_enabled;
+}
+
+
+// Small per thread numbers read better in the viewer than system thread ids.
+static guint ThreadId(void)
+{
+   guint tid = GPOINTER_TO_UINT(g_private_get(&trace_tid));
+
+   if (!tid)
+   {
+      tid = g_atomic_int_add(&trace_next_tid, 1) + 1;
+      g_private_set(&trace_tid, GUINT_TO_POINTER(tid));
+   }
+
+   return tid;
+}
+
+
+static void Record(Trace_Event *e)
+{
+   e->tid = ThreadId();
+
+   g_mutex_lock(&trace_lock);
+
+   if (trace_events->len < MAX_TRACE_EVENTS)
+      g_array_append_val(trace_events, *e);
+   else
+      g_free(e->msg);
+
+   g_mutex_unlock(&trace_lock);
+}
+
+
+gint64 Trace_Begin(void)
+{
+   return Trace_Enabled() ? g_get_monotonic_time() : 0;
+}
+
+
+void Trace_End(const char *name, gint64 start, guint64 bytes)
+{
+   Trace_Event e;
+
+   if (!start || !Trace_Enabled())
+      return;
+
+   memset(&e, 0, sizeof(Trace_Event));
+   e.name = name;
+   e.ts = start;
+   e.dur = g_get_monotonic_time() - start;
+   e.bytes = bytes;
+   e.ph = 'X';
+
+   Record(&e);
+}
+
+
+void Trace_Message(const char *level, const char *msg)
+{
+   Trace_Event e;
+
+   if (!Trace_Enabled())
+      return;
+
+   memset(&e, 0, sizeof(Trace_Event));
+   e.name = level;
+   e.msg = g_strchomp(g_strdup(msg));
+   e.ts = g_get_monotonic_time();
+   e.ph = 'i';
+
+   Record(&e);
+}
+
+
+static void OpjInfo(const char *msg, G_GNUC_UNUSED void *client_data)
+{
+   Trace_Message("opj_info", msg);
+}
+
+
+static void OpjWarning(const char *msg, G_GNUC_UNUSED void *client_data)
+{
+   Trace_Message("opj_warning", msg);
+}
+
+
+static void OpjError(const char *msg, G_GNUC_UNUSED void *client_data)
+{
+   Trace_Message("opj_error", msg);
+}
+
+
+void Trace_AttachCodec(opj_codec_t *codec)
+{
+   if (!Trace_Enabled())
+      return;
+
+   opj_set_info_handler(codec, OpjInfo, nullptr);
+   opj_set_warning_handler(codec, OpjWarning, nullptr);
+   opj_set_error_handler(codec, OpjError, nullptr);
+}
+
+
+static void WriteString(FILE *f, const char *s)
+{
+   fputc('"', f);
+
+   for (; *s; s++)
+   {
+      if ((*s == '"') || (*s == '\\'))
+         fprintf(f, "\\%c", *s);
+      else if ((guchar) *s < 0x20)
+         fprintf(f, "\\u%04x", (guchar) *s);
+      else
+         fputc(*s, f);
+   }
+
+   fputc('"', f);
+}
+
+
+void Trace_Flush(void)
+{
+   FILE *f;
+   guint i;
+
+   if (!Trace_Enabled())
+      return;
+
+   g_mutex_lock(&trace_lock);
+
+   f = fopen(trace_path, "w");
+
+   if (!f)
+   {
+      fprintf(stderr, "j2k trace : could not write %s.\n", trace_path);
+      g_mutex_unlock(&trace_lock);
+      return;
+   }
+
+   fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+   for (i=0;i<trace_events->len;i++)
+   {
+      Trace_Event *e = &g_array_index(trace_events, Trace_Event, i);
+
+      fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"j2k\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":%u", i ? ",\n" : "",
+              e->name, e->ph, e->ts - trace_origin, e->tid);
+
+      if (e->ph == 'X')
+         fprintf(f, ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{\"bytes\":%" G_GUINT64_FORMAT "}}", e->dur, e->bytes);
+      else
+      {
+         fprintf(f, ",\"s\":\"t\",\"args\":{\"msg\":");
+         WriteString(f, e->msg);
+         fprintf(f, "}}");
+      }
+   }
+
+   fprintf(f, "\n]}\n");
+   fclose(f);
+
+   g_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,49 @@
+/* ----------------------------------------------------------------
+
+Project : GIMP / JPEG-2000 plugin
+
+Copyright (C) 2008-2025 Advance Software Limited.
+
+Licensed under GNU General Public License V3.
+License terms are available here : http://www.gnu.org/licenses/gpl.html
+
+This software requires :
+
+GIMP 3, OpenJPEG 2.3.1
+
+Compiles on Windows (mingw64) and Linux.
+
+------------------------------------------------------------------- */
+
+
+
+
+#ifndef __GIMP_TRACE_J2K_H__
+#define __GIMP_TRACE_J2K_H__
+
+
+// Stage tracing, switched on at runtime : set J2K_TRACE to a file name (or to 1 for j2k-trace.json in the temporary
+// directory). Exports & loads then record each stage - pixel fetch, analysis, conversion, every OpenJPEG phase, stream &
+// file writes - with its duration & byte count, along with OpenJPEG's own messages. The file is Chrome trace event JSON,
+// for chrome://tracing or ui.perfetto.dev. When tracing is off each call is a single test.
+
+#define TRACE_ENV "J2K_TRACE"
+
+bool   Trace_Enabled(void);
+
+// Start time of a stage, microseconds. 0 when tracing is off.
+gint64 Trace_Begin(void);
+
+// Records the stage begun at start. name is kept, not copied, so must be a literal.
+void   Trace_End(const char *name, gint64 start, guint64 bytes);
+
+void   Trace_Message(const char *level, const char *msg);
+
+// Routes the codec's info, warning & error messages into the trace.
+void   Trace_AttachCodec(opj_codec_t *codec);
+
+// Writes everything recorded so far. Also done at exit.
+void   Trace_Flush(void);
+
+
+#endif
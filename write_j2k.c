@@ -15,49 +15,67 @@ Compiles on Windows (mingw64) and Linux.
 
 ------------------------------------------------------------------- */
 
-#include "config.h"
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
-
-// For usleep.
-#include <unistd.h>
-
-#include <libgimp/gimp.h>
-#include <libgimp/gimpui.h>
+#include <math.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 
 #include "main.h"
 #include "write_j2k.h"
-Save_Parameters __save_params;
-#define GIMP_J2K_PREVIEW_ENABLED 0
+#include "convert_j2k.h"
+#include "trace_j2k.h"
+
 
+// OpenJPEG stages output through one reusable buffer of this size, handing it to the write callback each time it fills.
+const size_t write_chunk_size = OPJ_J2K_STREAM_CHUNK_SIZE; // 1 MB
 
-static GtkWidget *preview_file_size = nullptr;
 
-static bool __preview_update_required = true;
+#ifdef _WIN32
+#define file_seek _fseeki64
+#else
+#define file_seek fseeko
+#endif
 
 
-void Export_SetQuality(float q)
+// Growable in memory output, for callers which need the codestream bytes (e.g. preview decode).
+typedef struct
 {
-  __save_params.quality[0] = q * 100;
-}
+   uint8 *data;
+   size_t len;        // Bytes written (high water mark).
+   size_t pos;        // Write position - OpenJPEG seeks back to patch box & marker lengths.
+   size_t capacity;
 
+   const gint *cancel;  // Optional : writes fail once *cancel is set, abandoning the encode.
+} Buffer;
 
-// TODO[OPT]: This is a brute force max expected compressed file size implementation to deliver a working version asap.
-// The chunk size could be reduced & the custom read & write functions enhanced to support reading & writing chunks from a memory stream to replace the single block only current implementation. 
-const size_t write_chunk_size = 0x08000000; // 128 MB
 
+// Encoder threading arrived in OpenJPEG 2.4. Before that only decompressors have a thread hook, & opj_codec_set_threads
+// on a compressor calls through a null pointer. Checked against the library loaded, not the headers built against.
+static bool EncoderThreadsSupported(void)
+{
+   static volatile gint supported = -1;
 
-typedef struct
+   // Benign race : every thread computes the same answer.
+   if (supported < 0)
+   {
+      int major = 0, minor = 0;
+
+      sscanf(opj_version(), "%d.%d", &major, &minor);
+      supported = (major > 2) || ((major == 2) && (minor >= 4));
+   }
+
+   return supported != 0;
+}
+
+
+static bool Cancelled(const gint *cancel)
 {
-   uint8 *data;
-   size_t len;
-} Buffer;
+   return cancel && g_atomic_int_get(cancel);
+}
 
 
 #if ENABLE_OPENJPEG_DIAGNOSTIC
@@ -85,40 +103,37 @@ void info_callback (const char *msg, void *client_data)
 #endif // ENABLE_OPENJPEG_DIAGNOSTIC
 
 
-static opj_image_t *ToCodestream(const opj_cparameters_t *parameters, uint32 w, uint32 h, uint32 src_bytes_per_pixel, bool mono, bool save_alpha,
-                                 const unsigned char *src_line, uint32 src_pitch, bool colour_order_rgb, bool flip_image_vertically)
+// src_pitch in bytes. 16 bit samples (bytes_per_sample 2) make components of precision prec, their top prec bits.
+static opj_image_t *ToCodestream(const opj_cparameters_t *parameters, uint32 w, uint32 h, uint32 num_channels, uint32 bytes_per_sample,
+                                 uint32 prec, bool mono, bool save_alpha, const unsigned char *src_line, uint32 src_pitch,
+                                 bool flip_image_vertically)
 {
-   const uint8 *src_ptr;
-   uint32 alpha_channel;
-   uint32 x,y;
+   uint32 y, x, shift = 8 * bytes_per_sample - prec;
    int i, numcomps;
    OPJ_COLOR_SPACE color_space;
    int subsampling_dx, subsampling_dy;
    opj_image_t *image;
-   uint32 red_channel, blue_channel;
+   OPJ_INT32 *dest[4];
+
+   // One specialised row kernel per source / output channel layout.
+   Planar_Layout layout = Planar_SelectLayout(num_channels, mono, save_alpha);
+   Deinterleave_Fn deinterleave = Deinterleave_GetKernel(layout);
+   Deinterleave16_Fn deinterleave16 = Deinterleave16_GetKernel(layout);
 
    /* Initialize image components */
    opj_image_cmptparm_t cmptparm[4];	/* Maximum of 4 components */
    memset(&cmptparm[0], 0, 4 * sizeof(opj_image_cmptparm_t));
 
-   if (mono)
-   {
-	  color_space = OPJ_CLRSPC_GRAY;
-      numcomps = save_alpha ? 2 : 1;
-   }
-   else
-   {
-      numcomps = save_alpha ? 4 : 3;
-	  color_space = OPJ_CLRSPC_SRGB;
-   }
+   numcomps = Planar_NumComponents(layout);
+   color_space = numcomps < 3 ? OPJ_CLRSPC_GRAY : OPJ_CLRSPC_SRGB;
 
    subsampling_dx = parameters->subsampling_dx;
    subsampling_dy = parameters->subsampling_dy;
 
    for (i = 0; i < numcomps; i++)
    {
-		cmptparm[i].prec = 8;
-		cmptparm[i].bpp = 8;
+		cmptparm[i].prec = prec;
+		cmptparm[i].bpp = prec;
 		cmptparm[i].sgnd = 0;
 		cmptparm[i].dx = subsampling_dx;
 		cmptparm[i].dy = subsampling_dy;
@@ -144,37 +159,25 @@ static opj_image_t *ToCodestream(const opj_cparameters_t *parameters, uint32 w,
    if (flip_image_vertically)
       src_line += src_pitch * (h-1);
 
-   alpha_channel = mono ? 1 : 3;
-
-   // Select appropriate channels - input could be rgb or bgr
-   red_channel  = colour_order_rgb ? 2 : 0;
-   blue_channel = colour_order_rgb ? 0 : 2;
+   for (i = 0; i < numcomps; i++)
+      dest[i] = image->comps[i].data;
 
    for (y=0;y<h;y++)
    {
-		src_ptr = src_line;
-
-		for (x=0;x<w;x++)
-		{
-			uint32 index = y*w + x;
+      if (bytes_per_sample == 2)
+         deinterleave16((const guint16 *) src_line, dest, w);
+      else
+         deinterleave(src_line, dest, w);
 
-		 if (mono)
-         {
-            src_ptr += 2;
-            image->comps[0].data[index] = *(src_ptr++);
-         }
-         else
-         {
-            image->comps[red_channel].data[index] = *(src_ptr++);
-			   image->comps[1].data[index] = *(src_ptr++);
-            image->comps[blue_channel].data[index] = *(src_ptr++);
-         }
+      for (i = 0; i < numcomps; i++)
+      {
+         // While the row is still in cache.
+         if (shift)
+            for (x=0;x<w;x++)
+               dest[i][x] >>= shift;
 
-         if (save_alpha)
-            image->comps[alpha_channel].data[index] = *(src_ptr++);
-         else if (src_bytes_per_pixel==4)
-            src_ptr++;
-		}
+         dest[i] += w;
+      }
 
       if (flip_image_vertically)
          src_line -= src_pitch;
@@ -186,154 +189,631 @@ static opj_image_t *ToCodestream(const opj_cparameters_t *parameters, uint32 w,
 }
 
 
-bool serialize_file(void *buffer, int buffer_length_bytes, void *user_data)
+static bool memory_stream_reserve(Buffer *b, size_t required)
 {
-   const char *filename = (const char *) user_data;
+   size_t capacity = b->capacity ? b->capacity : write_chunk_size;
+   uint8 *data;
+
+   if (required <= b->capacity)
+      return true;
+
+   while (capacity < required)
+      capacity *= 2;
 
-   FILE *f = fopen(filename, "wb");
+   data = g_try_realloc(b->data, capacity);
 
-   if (!f)
+   if (!data)
    {
-      fprintf(stderr, "Could not open file for writing : %s", filename);
+      fprintf(stderr, "Out of memory growing output buffer to %lu bytes.\n", (unsigned long) capacity);
       return false;
    }
-   else
+
+   b->data = data;
+   b->capacity = capacity;
+
+   return true;
+}
+
+
+static OPJ_SIZE_T memory_stream_write(void *p_buffer, OPJ_SIZE_T p_nb_bytes, void *p_user_data)
+{
+   Buffer *b = (Buffer*) p_user_data;
+   gint64 start = Trace_Begin();
+
+   if (Cancelled(b->cancel))
+      return (OPJ_SIZE_T) -1;
+
+   if (!memory_stream_reserve(b, b->pos + p_nb_bytes))
+      return (OPJ_SIZE_T) -1;
+
+   memcpy(b->data + b->pos, p_buffer, p_nb_bytes);
+   b->pos += p_nb_bytes;
+
+   if (b->pos > b->len)
+      b->len = b->pos;
+
+   Trace_End("stream_write", start, p_nb_bytes);
+
+   return p_nb_bytes;
+}
+
+
+static OPJ_OFF_T memory_stream_skip(OPJ_OFF_T bytes, void *p_user_data)
+{
+   Buffer *b = (Buffer*) p_user_data;
+
+   if ((bytes < 0) && ((size_t) -bytes > b->pos))
+      return -1;
+
+   // Skipping forward past the end leaves a zero filled gap, as a file would.
+   if ((bytes > 0) && (b->pos + bytes > b->len))
    {
-      fwrite(buffer, 1, buffer_length_bytes, f);
-      fclose(f);
+      if (!memory_stream_reserve(b, b->pos + bytes))
+         return -1;
+
+      memset(b->data + b->len, 0, b->pos + bytes - b->len);
+      b->len = b->pos + bytes;
    }
 
+   b->pos += bytes;
+
+   return bytes;
+}
+
+
+static bool memory_stream_seek(OPJ_OFF_T bytes, void *p_user_data)
+{
+   Buffer *b = (Buffer*) p_user_data;
+
+   if ((bytes < 0) || ((size_t) bytes > b->len))
+      return false;
+
+   b->pos = bytes;
+
    return true;
 }
 
 
+// Direct to file output : each chunk goes straight to disk, so output size is unbounded & the codestream is never held in memory.
 
-// Analyse image to enable us to perform compression optimizations - currently limited to component reduction (rgb->grey).
+static OPJ_SIZE_T file_stream_write(void *p_buffer, OPJ_SIZE_T p_nb_bytes, void *p_user_data)
+{
+   FILE *f = (FILE *) p_user_data;
+   gint64 start = Trace_Begin();
 
-bool Scan_IsMono(const uint8 *src_line, uint32 src_pitch, uint32 src_bytes_per_pixel, uint32 width, uint32 height)
+   if (fwrite(p_buffer, 1, p_nb_bytes, f) != p_nb_bytes)
+      return (OPJ_SIZE_T) -1;
+
+   Trace_End("file_write", start, p_nb_bytes);
+
+   return p_nb_bytes;
+}
+
+
+static OPJ_OFF_T file_stream_skip(OPJ_OFF_T bytes, void *p_user_data)
 {
-   uint32 x,y;
-   const uint8 *src_ptr;
-   int r,g,b;
+   FILE *f = (FILE *) p_user_data;
 
-   const uint32 colour_threshold = 3;
+   return file_seek(f, bytes, SEEK_CUR) ? -1 : bytes;
+}
 
-	for (y=0;y<height;y++)
-	{
-      src_ptr = src_line;
 
-		for (x=0;x<width;x++)
-		{
-			r = *(src_ptr++);
-			g = *(src_ptr++);
-			b = *(src_ptr++);
+static bool file_stream_seek(OPJ_OFF_T bytes, void *p_user_data)
+{
+   FILE *f = (FILE *) p_user_data;
+
+   return !file_seek(f, bytes, SEEK_SET);
+}
+
+
+static opj_stream_t *create_output_stream(opj_stream_write_fn write_fn, opj_stream_skip_fn skip_fn, opj_stream_seek_fn seek_fn, void *user_data)
+{
+   opj_stream_t *s = opj_stream_create(write_chunk_size, false);
 
-         // Step past alpha channel data, if present.
-         src_ptr += (src_bytes_per_pixel==4);
+   if (!s)
+      return nullptr;
 
-         if ( (abs(r-g)>colour_threshold) || (abs(r-b)>colour_threshold) || (abs(g-b)>colour_threshold) )
+   opj_stream_set_write_function(s, write_fn);
+   opj_stream_set_skip_function(s, skip_fn);
+   opj_stream_set_seek_function(s, seek_fn);
+   opj_stream_set_user_data(s, user_data, NULL);
+
+   return s;
+}
+
+
+int Encoder_NumThreads(const Save_Parameters *params)
+{
+   if (params->num_threads > 0)
+      return params->num_threads;
+
+   return opj_get_num_cpus();
+}
+
+
+guint Image_BytesPerSample(const Image_Info *image_info)
+{
+   return image_info->bytes_per_sample == 2 ? 2 : 1;
+}
+
+
+guint Image_BytesPerPixel(const Image_Info *image_info)
+{
+   return image_info->num_components * Image_BytesPerSample(image_info);
+}
+
+
+// Tiled export helpers : the source is pulled through Image_Info.fetch one rectangle at a time so peak memory is bounded by the tile size.
+
+#define ANALYSIS_BAND_HEIGHT 64
+
+
+// Analyse image to enable us to perform compression optimizations - component reduction (rgb->grey, uniform alpha) & for 16 bit
+// sources the precision : samples which are replicated lower precision values (e.g. 8 bit data converted to 16 bit, or a
+// 12 bit file loaded) are written at that precision, exactly. Streamed sources are analysed one band of rows at a time.
+static bool Analyse(Image_Info *si, bool *mono, bool *save_alpha, uint32 *prec)
+{
+   uint32 num_channels = si->num_components;
+   uint32 src_pitch = Image_BytesPerPixel(si) * si->width;
+   bool deep = Image_BytesPerSample(si) == 2;
+   gint64 start = Trace_Begin();
+   Scan_Result scan;
+
+   uint32 c;
+
+   Scan_Begin(&scan, num_channels, deep);
+
+   if (si->data && deep)
+      Scan_Rows16(&scan, (const guint16 *) si->data, num_channels * si->width, si->width, si->height);
+   else if (si->data)
+      Scan_Rows(&scan, si->data, src_pitch, si->width, si->height);
+   else
+   {
+      uint32 band_height = MIN(ANALYSIS_BAND_HEIGHT, si->height);
+      uint8 *band = g_try_malloc((gsize) src_pitch * band_height);
+      uint32 y;
+      bool open = true;
+
+      if (!band)
+         return false;
+
+      for (y=0; (y < si->height) && open; y += band_height)
+      {
+         uint32 h = MIN(band_height, si->height - y);
+
+         if (!si->fetch(band, 0, y, si->width, h, si->fetch_user_data))
          {
+            g_free(band);
             return false;
          }
-		}
 
-		src_line += src_pitch;
-	}
+         if (deep)
+            open = Scan_Rows16(&scan, (const guint16 *) band, num_channels * si->width, si->width, h);
+         else
+            open = Scan_Rows(&scan, band, src_pitch, si->width, h);
+      }
+
+      g_free(band);
+   }
+
+   Scan_End(&scan);
+
+   Trace_End("analysis", start, (guint64) src_pitch * si->height);
+
+   *mono = scan.mono;
+
+   // Uniform alpha is discarded. Please use layer transparency instead.
+   *save_alpha = ((num_channels == 2) || (num_channels == 4)) && !scan.alpha_uniform;
+
+   // All components share one precision. Unwritten channels only raise it, which is still exact.
+   *prec = 8 * Image_BytesPerSample(si);
+
+   if (deep)
+   {
+      *prec = 8;
+
+      for (c=0;c<num_channels;c++)
+         *prec = MAX(*prec, scan.bit_depth[c]);
+   }
 
    return true;
 }
 
 
-bool IsChannelRedundant(uint32 channel_offset, const uint8 *src_line, uint32 src_pitch, uint32 src_bytes_per_pixel, uint32 width, uint32 height)
+// Component header only - sample data is supplied tile by tile through opj_write_tile.
+static opj_image_t *CreateTileImage(const opj_cparameters_t *parameters, uint32 w, uint32 h, uint32 prec, bool mono, bool save_alpha)
 {
-   uint32 x,y, next_pixel_offset;
-   bool need_channel = false;
-   bool done = false;
-   uint8 first_value;
-	const uint8 *src_ptr;
+   opj_image_cmptparm_t cmptparm[4];
+   opj_image_t *image;
+   int i, numcomps;
 
-   // Currently only supports formats which pack one byte per channel.
+   memset(&cmptparm[0], 0, 4 * sizeof(opj_image_cmptparm_t));
 
-   if (channel_offset >= src_bytes_per_pixel)
-      return true;
+   numcomps = (mono ? 1 : 3) + (save_alpha ? 1 : 0);
+
+   for (i = 0; i < numcomps; i++)
+   {
+      cmptparm[i].prec = prec;
+      cmptparm[i].bpp = prec;
+      cmptparm[i].sgnd = 0;
+      cmptparm[i].dx = parameters->subsampling_dx;
+      cmptparm[i].dy = parameters->subsampling_dy;
+      cmptparm[i].w = w;
+      cmptparm[i].h = h;
+   }
 
-   next_pixel_offset = src_bytes_per_pixel-channel_offset;
+   image = opj_image_tile_create(numcomps, &cmptparm[0], mono ? OPJ_CLRSPC_GRAY : OPJ_CLRSPC_SRGB);
 
-   // Grab channel value from the first pixel ...
-   first_value = *(src_line+channel_offset);
+   if (!image)
+      return nullptr;
 
-   for (y=0;y<height;y++)
-   {
-	     if (done)
-          break;
+   image->x0 = parameters->image_offset_x0;
+   image->y0 = parameters->image_offset_y0;
+   image->x1 = image->x0 + (w - 1) * parameters->subsampling_dx + 1;
+   image->y1 = image->y0 + (h - 1) * parameters->subsampling_dy + 1;
 
-        src_ptr = src_line;
+   return image;
+}
 
-		  for (x=0;x<width;x++)
-		  {
-				src_ptr += channel_offset;
 
-				if (*src_ptr != first_value)
-				{
-					need_channel = true;
-					done = true;
-					break;
-				}
+// Deinterleaves one fetched tile into the component planar layout opj_write_tile expects : one byte per sample for components
+// of up to 8 bits, two (native byte order) above. 16 bit samples keep their top prec bits.
+static void ToPlanarTile(const uint8 *src, uint32 num_pixels, uint32 bytes_per_sample, uint32 prec, Planar_Layout layout, uint8 *dest)
+{
+   uint32 c;
+
+   // Tile pixels are tightly packed so the whole tile converts as a single row.
+   if (bytes_per_sample == 2)
+   {
+      gsize n = (gsize) Planar_NumComponents(layout) * num_pixels, i;
+      guint16 *planes[4], *samples = (guint16 *) dest;
 
-				src_ptr += next_pixel_offset;
-			}
+      for (c=0;c<Planar_NumComponents(layout);c++)
+         planes[c] = (guint16 *) dest + (gsize) c * num_pixels;
 
-		src_line += src_pitch;
-	}
+      DeinterleaveTile16_GetKernel(layout)((const guint16 *) src, planes, num_pixels);
 
-   return !need_channel;
+      // Planes are contiguous so narrowing in place keeps them in order, each sample read before it is overwritten.
+      if (prec <= 8)
+         for (i=0;i<n;i++)
+            dest[i] = (uint8) (samples[i] >> 8);
+      else if (prec < 16)
+         for (i=0;i<n;i++)
+            samples[i] >>= 16 - prec;
+   }
+   else
+   {
+      uint8 *planes[4];
+
+      for (c=0;c<Planar_NumComponents(layout);c++)
+         planes[c] = dest + (gsize) c * num_pixels;
+
+      Deinterleave8_GetKernel(layout)(src, planes, num_pixels);
+   }
 }
 
 
+static bool WriteTiles(opj_codec_t *codec, opj_stream_t *s, Image_Info *si, uint32 tile_size, uint32 prec, bool mono, bool save_alpha)
+{
+   uint32 src_bytes_per_pixel = Image_BytesPerPixel(si);
+   uint32 bytes_per_sample = Image_BytesPerSample(si);
+   uint32 tile_bytes_per_sample = prec > 8 ? 2 : 1;
+   Planar_Layout layout = Planar_SelectLayout(si->num_components, mono, save_alpha);
+   uint32 numcomps = Planar_NumComponents(layout);
+   uint32 tiles_x = (si->width + tile_size - 1) / tile_size;
+   uint32 tiles_y = (si->height + tile_size - 1) / tile_size;
+   uint32 tx, ty;
+   bool ok = true;
+
+   uint8 *pixels = g_try_malloc((gsize) tile_size * tile_size * src_bytes_per_pixel);
+   uint8 *planar = g_try_malloc((gsize) tile_size * tile_size * numcomps * bytes_per_sample);
+
+   if (!pixels || !planar)
+      ok = false;
+
+   for (ty=0; ok && (ty < tiles_y); ty++)
+   {
+      for (tx=0; ok && (tx < tiles_x); tx++)
+      {
+         uint32 x = tx * tile_size;
+         uint32 y = ty * tile_size;
+         uint32 w = MIN(tile_size, si->width - x);
+         uint32 h = MIN(tile_size, si->height - y);
+
+         ok = !Cancelled(si->cancel) && si->fetch(pixels, x, y, w, h, si->fetch_user_data);
+
+         if (ok)
+         {
+            gint64 start = Trace_Begin();
+
+            ToPlanarTile(pixels, w * h, bytes_per_sample, prec, layout, planar);
+            Trace_End("conversion", start, (guint64) w * h * src_bytes_per_pixel);
+
+            start = Trace_Begin();
+            ok = opj_write_tile(codec, ty * tiles_x + tx, planar, w * h * numcomps * tile_bytes_per_sample, s);
+            Trace_End("opj_write_tile", start, (guint64) w * h * numcomps * tile_bytes_per_sample);
+
+            if (!ok)
+               fprintf(stderr, "Failed : opj_write_tile %lu.\n", ty * tiles_x + tx);
+         }
+      }
+   }
 
-OPJ_SIZE_T memory_stream_write(void *p_buffer, OPJ_SIZE_T p_nb_bytes, void *p_user_data)
+   g_free(pixels);
+   g_free(planar);
+
+   return ok;
+}
+
+
+// Reads directly from the in-memory image when there's no streamed source.
+static bool fetch_from_memory(guchar *dest, guint x, guint y, guint width, guint height, void *user_data)
 {
-   Buffer *b = (Buffer*) p_user_data;
- 
-   assert(b->len == 0);
-   
-	if (b->len != 0)
-	{
-		fprintf(stderr, "Output file too big. Current implementation only supports single chunk write, max output file size : %d bytes", write_chunk_size);
-		return 0;
-	}
-  
-   b->data = malloc(p_nb_bytes);
-   b->len = p_nb_bytes;
-   memcpy(b->data, p_buffer, b->len);
+   Image_Info *si = (Image_Info *) user_data;
+   uint32 bytes_per_pixel = Image_BytesPerPixel(si);
+   uint32 row_bytes = width * bytes_per_pixel;
+   uint32 pitch = si->width * bytes_per_pixel;
+   const uint8 *src = si->data + (gsize) y * pitch + x * bytes_per_pixel;
+   guint j;
+
+   for (j=0;j<height;j++)
+   {
+      memcpy(dest, src, row_bytes);
+      dest += row_bytes;
+      src += pitch;
+   }
 
-   return p_nb_bytes;
+   return true;
 }
 
 
-bool serialize_image(Image_Info *src_image_info, bool format_codestream_only, Serialize_CB callback, void *user_data)
+// Source analysed & converted, ready to encode. May be encoded several times (e.g. target size search) without redoing either step.
+typedef struct
 {
-   int i;
-   uint32 src_bytes_per_pixel = src_image_info->num_components;
-   uint32 src_pitch = src_bytes_per_pixel * src_image_info->width;
-   const bool colour_order_rgb = false;
+   Image_Info   source;         // Tiled sources re-fetch pixels through source.fetch for every encode.
+   opj_image_t *image;          // Untiled : converted int32 planes. Tiled : component header only.
+   uint32       tile_size;      // 0 = single tile.
+   uint32       prec;           // Component precision, from the analysis.
+   bool         mono;
+   bool         save_alpha;
+
+} Prepared_Image;
+
+
+static bool prepare_image(Image_Info *src_image_info, const Save_Parameters *params, Prepared_Image *p)
+{
+   uint32 bytes_per_sample = Image_BytesPerSample(src_image_info);
+   uint32 src_pitch = Image_BytesPerPixel(src_image_info) * src_image_info->width;
    const bool flip_image_vertically = false;
+   opj_cparameters_t parameters;
+
+   memset(p, 0, sizeof(Prepared_Image));
+
+   p->source = *src_image_info;
+   p->tile_size = params->tile_size;
+
+   // Streamed sources are always encoded tile by tile. In memory sources optionally so.
+   if (!src_image_info->data && !p->tile_size)
+      p->tile_size = DEFAULT_TILE_SIZE;
+
+   if (p->tile_size && src_image_info->data)
+   {
+      p->source.fetch = fetch_from_memory;
+      p->source.fetch_user_data = &p->source;
+   }
+
+   // PART 1 : Single analysis pass - decides the component layout the conversion writes.
+   if (!Analyse(&p->source, &p->mono, &p->save_alpha, &p->prec))
+   {
+      fprintf(stderr, "Failed : image analysis.\n");
+      return false;
+   }
+
+   // Image offset & subsampling from the encoder defaults.
+   opj_set_default_encoder_parameters(&parameters);
+
+   if (p->tile_size)
+      p->image = CreateTileImage(&parameters, src_image_info->width, src_image_info->height, p->prec, p->mono, p->save_alpha);
+   else
+   {
+      gint64 start = Trace_Begin();
+
+      p->image = ToCodestream(&parameters, src_image_info->width, src_image_info->height, src_image_info->num_components, bytes_per_sample,
+                              p->prec, p->mono, p->save_alpha, src_image_info->data, src_pitch, flip_image_vertically);
+
+      Trace_End("conversion", start, (guint64) src_pitch * src_image_info->height);
+   }
+
+   return p->image != nullptr;
+}
+
+
+static void release_prepared(Prepared_Image *p)
+{
+   if (p->image)
+      opj_image_destroy(p->image);
+
+   p->image = nullptr;
+}
+
+
+// OpenJPEG takes ownership of the sample data it is given to encode, so encodes which must leave the prepared image intact work on a copy.
+static opj_image_t *CloneImage(const opj_image_t *src)
+{
+   opj_image_cmptparm_t cmptparm[4];
+   opj_image_t *image;
+   uint32 i;
 
-   // Check for redundant colour channels ...
-   bool mono = Scan_IsMono(src_image_info->data, src_pitch, src_bytes_per_pixel, src_image_info->width, src_image_info->height);
+   memset(&cmptparm[0], 0, 4 * sizeof(opj_image_cmptparm_t));
+
+   for (i=0;i<src->numcomps;i++)
+   {
+      cmptparm[i].dx = src->comps[i].dx;
+      cmptparm[i].dy = src->comps[i].dy;
+      cmptparm[i].w = src->comps[i].w;
+      cmptparm[i].h = src->comps[i].h;
+      cmptparm[i].x0 = src->comps[i].x0;
+      cmptparm[i].y0 = src->comps[i].y0;
+      cmptparm[i].prec = src->comps[i].prec;
+      cmptparm[i].bpp = src->comps[i].bpp;
+      cmptparm[i].sgnd = src->comps[i].sgnd;
+   }
+
+   image = opj_image_create(src->numcomps, &cmptparm[0], src->color_space);
+
+   if (!image)
+      return nullptr;
+
+   image->x0 = src->x0;
+   image->y0 = src->y0;
+   image->x1 = src->x1;
+   image->y1 = src->y1;
 
-   bool save_alpha = (src_bytes_per_pixel == 2) || (src_bytes_per_pixel == 4);
+   for (i=0;i<src->numcomps;i++)
+      memcpy(image->comps[i].data, src->comps[i].data, (gsize) src->comps[i].w * src->comps[i].h * sizeof(OPJ_INT32));
 
-   if (save_alpha)
+   return image;
+}
+
+
+// Uncompressed size OpenJPEG's compression ratios (tcp_rates) are relative to.
+static guint64 raw_size_bytes(const opj_image_t *image)
+{
+   guint64 bits = 0;
+   uint32 i;
+
+   for (i=0;i<image->numcomps;i++)
+      bits += (guint64) image->comps[i].w * image->comps[i].h * image->comps[i].prec;
+
+   return bits / 8;
+}
+
+
+static int compare_ascending(const void *a, const void *b)
+{
+   gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+   return x < y ? -1 : x > y;
+}
+
+
+// Quality layers : each layer refines the previous, so a viewer reading only the first layers' packets gets a usable image.
+// OpenJPEG needs qualities (PSNR) increasing & compression ratios decreasing layer by layer, 0 being lossless in both cases.
+static void SetupLayers(opj_cparameters_t *parameters, const Save_Parameters *params, const opj_image_t *image)
+{
+   int num_layers = CLAMP(params->num_layers, 1, MAX_QUALITY_LAYERS);
+   gdouble values[MAX_QUALITY_LAYERS];
+   int i, lossless;
+
+   parameters->prog_order = params->progression;
+   parameters->tcp_numlayers = num_layers;
+
+   if (params->target_size)
    {
-      // Check for redundant alpha channels ...
-      if (IsChannelRedundant(3, src_image_info->data, src_pitch, src_bytes_per_pixel, src_image_info->width, src_image_info->height))
+      // Rate allocation : ratio of uncompressed to target size. A ratio of 1 or less can't be reached by truncation so means lossless.
+      double rate = (double) raw_size_bytes(image) / params->target_size;
+
+      // Coarser layers keep the relative spacing of any requested rates, otherwise each is a quarter the size of the next.
+      for (i=0;i<num_layers;i++)
+      {
+         double scale = params->layer_rates && params->num_layers > 1 ? params->rate[i] / MAX(1.0, params->rate[num_layers-1]) : 1 << (2 * (num_layers-1-i));
+
+         values[i] = rate * MAX(1.0, scale);
+      }
+
+      qsort(values, num_layers, sizeof(gdouble), compare_ascending);
+
+      // A target near the uncompressed size leaves several layers lossless : they merge into one, as rates can't repeat.
+      for (lossless=0; (lossless < num_layers) && (values[lossless] <= 1.0); lossless++);
+
+      if (lossless > 1)
       {
-          //String s("Warning - '" + filename + "' contains a uniform alpha channel (discarded). Please use layer transparency instead.");
-          //fprintf(stderr, s);
-         save_alpha = false;
+         num_layers -= lossless - 1;
+         memmove(values, values + lossless - 1, num_layers * sizeof(gdouble));
+         parameters->tcp_numlayers = num_layers;
       }
+
+      for (i=0;i<num_layers;i++)
+         parameters->tcp_rates[num_layers-1-i] = values[i] > 1.0 ? values[i] : 0;
+
+      parameters->cp_disto_alloc = 1;
+   }
+   else if (params->layer_rates)
+   {
+      memcpy(values, params->rate, num_layers * sizeof(gdouble));
+      qsort(values, num_layers, sizeof(gdouble), compare_ascending);
+
+      for (i=0;i<num_layers;i++)
+         parameters->tcp_rates[num_layers-1-i] = values[i] > 1.0 ? values[i] : 0;
+
+      parameters->cp_disto_alloc = 1;
+   }
+   else
+   {
+      // OpenJPEG quality: 10 = low, 20 = higher, etc. 0 = lossless.
+      // Remapped so QUALITY_MAX = lossless.
+
+      memcpy(values, params->quality, num_layers * sizeof(gdouble));
+
+      qsort(values, num_layers, sizeof(gdouble), compare_ascending);
+
+      for (i=0;i<num_layers;i++)
+         parameters->tcp_distoratio[i] = values[i] >= QUALITY_MAX ? 0 : values[i];
+
+      parameters->cp_fixed_quality = 1;
    }
+}
+
+
+typedef struct
+{
+   int  num_resolutions;
+   int  cblk_size;         // Code-block edge.
+   int  mode;              // Code-block style bits, as OpenJPEG's mode parameter : pass bypass & termination.
+   bool irreversible;      // 9/7 wavelet when lossy. Lossless always needs the 5/3.
+
+} Preset_Info;
+
+#define CBLKSTY_LAZY 0x01   // Selective arithmetic coding bypass : low bit plane passes written raw.
+
+// Bypass skips the MQ coder for most of the passes that dominate T1 time, costing a few percent in size. OpenJPEG's 9/7
+// transform is also quicker than its 5/3 & shrinks lossy files, so fastest takes both & one fewer level. Extra termination
+// (restart, predictable) only adds bytes, so none of the presets asks for more than bypass needs. Precincts are left
+// whole : they add packet headers & help random access, not time or size.
+static const Preset_Info presets[NUM_PRESETS] =
+{
+   { 6, 64, 0,            false },    // PRESET_BALANCED
+   { 5, 64, CBLKSTY_LAZY, true  },    // PRESET_FASTEST
+   { 7, 64, 0,            true  },    // PRESET_SMALLEST
+};
+
+
+// After SetupLayers, which decides whether the finest layer is lossless.
+static void SetupPreset(opj_cparameters_t *parameters, Encoder_Preset preset, const opj_image_t *image, uint32 tile_size)
+{
+   const Preset_Info *info = &presets[preset < NUM_PRESETS ? preset : PRESET_BALANCED];
+   int last = parameters->tcp_numlayers - 1;
+   bool lossless = parameters->cp_fixed_quality ? parameters->tcp_distoratio[last] == 0 : parameters->tcp_rates[last] == 0;
+   uint32 extent = MIN(image->x1 - image->x0, image->y1 - image->y0);
+
+   if (tile_size)
+      extent = MIN(extent, tile_size);
+
+   parameters->numresolution = info->num_resolutions;
+   parameters->cblockw_init = info->cblk_size;
+   parameters->cblockh_init = info->cblk_size;
+   parameters->mode = info->mode;
+   parameters->irreversible = info->irreversible && !lossless;
+
+   // Every decomposition level halves the smallest tile, which must keep at least a pixel.
+   while ((parameters->numresolution > 1) && (extent >> (parameters->numresolution - 1)) == 0)
+      parameters->numresolution--;
+}
+
+
+// Encodes the prepared image. consume : hand the prepared sample data to OpenJPEG (last use) instead of encoding a copy.
+static bool encode_prepared(Prepared_Image *p, const Save_Parameters *params, bool format_codestream_only, opj_stream_t *s, bool consume)
+{
+   opj_image_t *image = p->image;
 
    // PART 2 : Initialize OpenJPEG.
 
@@ -342,8 +822,40 @@ bool serialize_image(Image_Info *src_image_info, bool format_codestream_only, Se
     opj_set_default_encoder_parameters(&parameters);
 	parameters.cod_format = format_codestream_only ? J2K_CFMT : JP2_CFMT;
 
-	/* Get a J2K compressor handle */
-	opj_codec_t *codec = opj_create_compress(OPJ_CODEC_J2K);
+   if (p->tile_size)
+   {
+      parameters.tile_size_on = OPJ_TRUE;
+      parameters.cp_tx0 = 0;
+      parameters.cp_ty0 = 0;
+      parameters.cp_tdx = p->tile_size;
+      parameters.cp_tdy = p->tile_size;
+   }
+   else if (!consume)
+   {
+      image = CloneImage(p->image);
+
+      if (!image)
+         return false;
+   }
+
+	/* Get a J2K or JP2 compressor handle */
+	opj_codec_t *codec = opj_create_compress(format_codestream_only ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
+
+   if (!codec)
+   {
+      fprintf(stderr, "Failed : opj_create_compress.\n");
+
+      if (image != p->image)
+         opj_image_destroy(image);
+      else if (consume)
+         release_prepared(p);
+
+      return false;
+   }
+
+   // Run T1 & DWT stages in parallel. Older libraries encode single threaded.
+   if (EncoderThreadsSupported())
+      opj_codec_set_threads(codec, Encoder_NumThreads(params));
 	
 
 #if ENABLE_OPENJPEG_DIAGNOSTIC
@@ -352,9 +864,7 @@ bool serialize_image(Image_Info *src_image_info, bool format_codestream_only, Se
 	opj_set_error_handler(codec, error_callback, stderr);
 #endif
 
-
-   opj_image_t *image = ToCodestream(&parameters, src_image_info->width, src_image_info->height, src_bytes_per_pixel, mono, save_alpha, src_image_info->data, src_pitch,
-                                     colour_order_rgb, flip_image_vertically);
+   Trace_AttachCodec(codec);
 
    // PART 3 : Encode OpenJPEG raw data into a j2k codestream.
 
@@ -363,357 +873,586 @@ bool serialize_image(Image_Info *src_image_info, bool format_codestream_only, Se
    // Decide if MCT should be used.
    parameters.tcp_mct = image->numcomps >= 3 ? 1 : 0;
 
-   // OpenJPEG quality: 10 = low, 20 = higher, etc. 0 = lossless.
-   // Remapped so QUALITY_MAX = lossless.
-
-   for (i=0;i< NUM_QUALITY_PARAMETERS; i++)
-   {
-      float q = __save_params.quality[i];
-      parameters.tcp_distoratio[i] = q == QUALITY_MAX ? 0: q;
-      parameters.tcp_numlayers++;
-   }
-
-   parameters.cp_fixed_quality = 1;
+   SetupLayers(&parameters, params, image);
+   SetupPreset(&parameters, params->preset, image, p->tile_size);
 
 	/* setup the encoder parameters using the current image and user parameters */
+   gint64 start = Trace_Begin();
 	opj_setup_encoder(codec, &parameters, image);
+   Trace_End("opj_setup_encoder", start, 0);
 
-	/* Open a byte stream for writing */
-   opj_stream_t *s = opj_stream_create(write_chunk_size, false);
-    
-   opj_stream_set_write_function(s, memory_stream_write);
-
-
-   Buffer b;
-   b.data = NULL;
-   b.len = 0;
-   opj_stream_set_user_data(s, (void*) &b, NULL); 
-
-
+   start = Trace_Begin();
 	bool ok = opj_start_compress(codec, image, s);
+   Trace_End("opj_start_compress", start, 0);
 
    if (!ok)
       fprintf(stderr, "Failed: opj_start_compress.\n");
    else
    { 
-      ok = opj_encode(codec, s);
+      if (p->tile_size)
+         ok = WriteTiles(codec, s, &p->source, p->tile_size, p->prec, p->mono, p->save_alpha);
+      else
+      {
+         start = Trace_Begin();
+         ok = opj_encode(codec, s);
+         Trace_End("opj_encode", start, 0);
 
-	   if (!ok)
-		  fprintf(stderr, "Failed : opj_encode.\n");
-	    else
+         if (!ok)
+            fprintf(stderr, "Failed : opj_encode.\n");
+      }
+
+	    if (ok)
 		{
+         start = Trace_Begin();
 			ok = opj_end_compress(codec, s);
+         Trace_End("opj_end_compress", start, 0);
   
 		    if (!ok)
 		       fprintf(stderr, "Failed : opj_end_compress.\n");
 		}
    }
   
-   // PART 4 : Destroy compressor & custom stream.
-   opj_stream_destroy(s);
+   // PART 4 : Destroy compressor.
    opj_destroy_codec(codec);
-	
-   // PART 5 : Process compressed stream.
 
+   if (image != p->image)
+      opj_image_destroy(image);
+   else if (consume)
+      release_prepared(p);
+
+   return ok;
+}
+
+
+static bool encode_to_memory(Prepared_Image *p, const Save_Parameters *params, bool format_codestream_only, Buffer *b, bool consume)
+{
+   memset(b, 0, sizeof(Buffer));
+   b->cancel = p->source.cancel;
+
+   opj_stream_t *s = create_output_stream(memory_stream_write, memory_stream_skip, memory_stream_seek, b);
+
+   if (!s)
+      return false;
+
+   bool ok = encode_prepared(p, params, format_codestream_only, s, consume);
+
+   opj_stream_destroy(s);
+
+   if (!ok)
+   {
+      g_free(b->data);
+      memset(b, 0, sizeof(Buffer));
+   }
+
+   return ok;
+}
+
+
+// Target file size : the first trial asks OpenJPEG's rate allocation for the target directly. Headers & rate control
+// granularity make it land near, not on, the target, so further trials rescale the requested size by the observed
+// error until the result is within TARGET_SIZE_TOLERANCE below the target. Each trial reuses the prepared image.
+
+#define MAX_TARGET_SIZE_TRIALS 4
+#define TARGET_SIZE_TOLERANCE  0.03
+
+static bool encode_to_target_size(Prepared_Image *p, const Save_Parameters *params, bool format_codestream_only, Buffer *best)
+{
+   Save_Parameters trial_params = *params;
+   guint64 target = params->target_size;
+   guint64 raw_size = raw_size_bytes(p->image);
+   double request = target;
+   int trial;
+
+   memset(best, 0, sizeof(Buffer));
+
+   for (trial=0; trial<MAX_TARGET_SIZE_TRIALS; trial++)
+   {
+      Buffer b;
+
+      trial_params.target_size = MAX(1, (guint64) request);
+
+      if (!encode_to_memory(p, &trial_params, format_codestream_only, &b, trial == MAX_TARGET_SIZE_TRIALS-1))
+         break;
+
+      // Keep the largest result within target, or the smallest over target while none fits.
+      bool fits = b.len <= target;
+      bool better = !best->data || (fits ? (best->len > target || b.len > best->len) : (best->len > target && b.len < best->len));
+
+      if (better)
+      {
+         g_free(best->data);
+         *best = b;
+      }
+      else
+         g_free(b.data);
+
+      if (fits && (b.len >= target * (1.0 - TARGET_SIZE_TOLERANCE)))
+         break;
+
+      // Lossless & still under target - nothing more to gain.
+      if (fits && (trial_params.target_size >= raw_size))
+         break;
+
+      request *= (double) target / MAX(1, b.len);
+
+      if (!fits)
+         request *= 1.0 - TARGET_SIZE_TOLERANCE / 2;
+   }
+
+   if (Cancelled(p->source.cancel))
+   {
+      g_free(best->data);
+      memset(best, 0, sizeof(Buffer));
+      return false;
+   }
+
+   if (best->data && (best->len > target))
+      fprintf(stderr, "Target size %lu bytes not reached. Smallest output : %lu bytes.\n", (unsigned long) target, (unsigned long) best->len);
+
+   return best->data != nullptr;
+}
+
+
+// Encodes to memory & hands the complete codestream to callback.
+bool serialize_image(Image_Info *src_image_info, const Save_Parameters *params, bool format_codestream_only, Serialize_CB callback, void *user_data)
+{
+   Prepared_Image p;
+   gint64 start = Trace_Begin();
+   Buffer b;
+   bool ok;
+
+   if (!prepare_image(src_image_info, params, &p))
+      return false;
+
+   if (params->target_size)
+      ok = encode_to_target_size(&p, params, format_codestream_only, &b);
+   else
+      ok = encode_to_memory(&p, params, format_codestream_only, &b, true);
+
+   release_prepared(&p);
+
+   // Process compressed stream.
    if (ok && callback)
       ok = callback(b.data, b.len, user_data);
 
+   Trace_End("serialize_image", start, ok ? b.len : 0);
 
-	if (b.data)
-      free(b.data);
+   g_free(b.data);
 
    return ok;
 }
 
 
+// Encodes straight into an open, seekable file.
+bool serialize_image_to_file(Image_Info *src_image_info, const Save_Parameters *params, bool format_codestream_only, FILE *outfile)
+{
+   Prepared_Image p;
+   gint64 start = Trace_Begin();
+   bool ok;
+
+   if (!prepare_image(src_image_info, params, &p))
+      return false;
+
+   if (params->target_size)
+   {
+      // Trial encodes are held in memory (bounded by about the target size) & only the chosen one is written.
+      Buffer b;
+
+      ok = encode_to_target_size(&p, params, format_codestream_only, &b);
+
+      if (ok)
+      {
+         gint64 write_start = Trace_Begin();
+
+         ok = fwrite(b.data, 1, b.len, outfile) == b.len;
+         Trace_End("file_write", write_start, b.len);
+      }
+
+      g_free(b.data);
+   }
+   else
+   {
+      opj_stream_t *s = create_output_stream(file_stream_write, file_stream_skip, file_stream_seek, outfile);
+
+      ok = s && encode_prepared(&p, params, format_codestream_only, s, true);
+
+      if (s)
+         opj_stream_destroy(s);
+   }
+
+   release_prepared(&p);
+
+   Trace_End("serialize_image", start, 0);
+
+   return ok && !ferror(outfile);
+}
 
-// -------------------------------------------------------------------------------------------------------
-//   Preview
-// -------------------------------------------------------------------------------------------------------
 
-#if GIMP_J2K_PREVIEW_ENABLED
 
 // -------------------------------------------------------------------------------------------------------
-//  TODO  2.10x preview functionality for reference / merge into 3.x equivalent.
+//   Quality sweep
 // -------------------------------------------------------------------------------------------------------
 
-
-void destroy_preview()
+typedef struct
 {
-  if (gimp_image_is_valid(preview_image_ID) && gimp_drawable_is_valid(preview_layer_ID))
-  {
-      /*  assuming that reference counting is working correctly,
-          we do not need to delete the layer, removing it from
-          the image should be sufficient  */
-      gimp_image_remove_layer(preview_image_ID, preview_layer_ID);
+   Prepared_Image        *prepared;
+   const Save_Parameters *params;
+   Sweep_CB               callback;
+   void                  *user_data;
+   bool                   measure_psnr;
+   gint                   failed;
+
+} Sweep_State;
 
-      preview_layer_ID = -1;
-  }
-}
 
-void get_save_defaults()
+// Peak signal to noise ratio of decoded against the source planes, over all components. Infinite when identical.
+static gdouble ImagePSNR(const opj_image_t *source, const opj_image_t *decoded)
 {
-  GimpParasite *parasite;
-  gchar        *def_str, *param;
-  Save_Parameters tmp;
-  int i, version, num_quality_params;
+   gdouble sum = 0, peak;
+   gsize i, n = 0;
+   uint32 c;
 
-  for (i=0;i<NUM_QUALITY_PARAMETERS;i++)
-  {
-     __save_params.quality[i] = DEFAULT_QUALITY;
-     tmp.quality[i] = DEFAULT_QUALITY;
-  }
+   if (decoded->numcomps != source->numcomps)
+      return 0;
+
+   for (c=0;c<source->numcomps;c++)
+   {
+      gsize num_pixels = (gsize) source->comps[c].w * source->comps[c].h;
 
-  __save_params.preview_enabled = DEFAULT_PREVIEW;
+      if ((decoded->comps[c].w != source->comps[c].w) || (decoded->comps[c].h != source->comps[c].h))
+         return 0;
 
-  parasite = gimp_get_parasite(J2K_DEFAULTS_PARASITE);
+      for (i=0;i<num_pixels;i++)
+      {
+         gdouble d = source->comps[c].data[i] - decoded->comps[c].data[i];
+         sum += d * d;
+      }
 
-  if (!parasite)
-    return;
+      n += num_pixels;
+   }
 
-  def_str = g_strndup((const gchar *) gimp_parasite_data (parasite), gimp_parasite_data_size(parasite));
+   if (sum == 0)
+      return HUGE_VAL;
 
-  gimp_parasite_free(parasite);
+   peak = (1 << source->comps[0].prec) - 1;
 
-  param = strtok(def_str, " ");
+   return 10.0 * log10(peak * peak * n / sum);
+}
 
-  version = param ? atoi(param) : 0;
 
-  if (version == J2K_SAVE_DEFAULTS_VERSION)
-  {
-      param = strtok(nullptr, " ");
-      tmp.preview_enabled = param ? atoi(param) : 0;
+static void sweep_job(gpointer data, gpointer user_data)
+{
+   Sweep_Point *point = (Sweep_Point *) data;
+   Sweep_State *state = (Sweep_State *) user_data;
+   Save_Parameters params = *state->params;
+   opj_image_t *decoded;
+   Buffer b;
 
-      param = strtok(nullptr, " ");
-      num_quality_params = param ? atoi(param) : 0;
+   if (Cancelled(state->prepared->source.cancel))
+      return;
 
-      if (num_quality_params > NUM_QUALITY_PARAMETERS)
-         num_quality_params = NUM_QUALITY_PARAMETERS;
+   // Parallelism comes from encoding several points at once, so each encode is single threaded.
+   params.num_layers = 1;
+   params.quality[0] = point->quality;
+   params.layer_rates = false;
+   params.target_size = 0;
+   params.num_threads = 1;
 
-      for (i=0;i<num_quality_params;i++)
+   if (!encode_to_memory(state->prepared, &params, true, &b, false))
+   {
+      g_atomic_int_set(&state->failed, 1);
+      return;
+   }
+
+   point->size = b.len;
+   point->header_size = Codestream_HeaderSize(b.data, b.len);
+
+   if (state->measure_psnr)
+   {
+      Decode_Options options;
+
+      memset(&options, 0, sizeof(Decode_Options));
+      options.num_threads = 1;
+
+      decoded = decode_image(b.data, b.len, true, &options);
+
+      if (decoded)
       {
-         param = strtok(nullptr, " ");
-         tmp.quality[i] = param ? atof(param) : DEFAULT_QUALITY;
+         point->psnr = ImagePSNR(state->prepared->image, decoded);
+         opj_image_destroy(decoded);
       }
-
-      memcpy(&__save_params, &tmp, sizeof(tmp));
    }
+
+   g_free(b.data);
+
+   point->done = true;
+
+   if (state->callback)
+      state->callback(point, state->user_data);
 }
 
 
-static void save_defaults()
+// Encodes each point's quality in parallel on a thread pool. Analysis & conversion are done once, every encode works on a
+// copy of the same prepared image. measure_psnr : also decode each point to measure its PSNR.
+bool serialize_sweep(Image_Info *src_image_info, const Save_Parameters *params, Sweep_Point *points, int num_points, bool measure_psnr,
+                     Sweep_CB callback, void *user_data)
 {
-  GimpParasite *parasite;
-  gchar *prev;
-  int i;
+   Save_Parameters sweep_params = *params;
+   Prepared_Image p;
+   Sweep_State state;
+   GThreadPool *pool;
+   int i;
 
-  gchar *def_str = g_strdup_printf("%d %d %d", J2K_SAVE_DEFAULTS_VERSION, __save_params.preview_enabled, NUM_QUALITY_PARAMETERS);
+   // Copies need whole image planes, so no tiling & an in memory source.
+   if (!src_image_info->data)
+      return false;
 
-  for (i=0;i<NUM_QUALITY_PARAMETERS;i++)
-  {
-     prev = def_str;
-     def_str = g_strdup_printf ("%s %lf ", prev, __save_params.quality[i]);
-     g_free(prev);
-  }
+   sweep_params.tile_size = 0;
 
-  parasite = gimp_parasite_new(J2K_DEFAULTS_PARASITE, GIMP_PARASITE_PERSISTENT, strlen(def_str), def_str);
+   if (!prepare_image(src_image_info, &sweep_params, &p))
+      return false;
 
-  gimp_attach_parasite(parasite);
-  gimp_parasite_free(parasite);
-  g_free(def_str);
+   memset(&state, 0, sizeof(Sweep_State));
+   state.prepared = &p;
+   state.params = &sweep_params;
+   state.measure_psnr = measure_psnr;
+   state.callback = callback;
+   state.user_data = user_data;
+
+   pool = g_thread_pool_new(sweep_job, &state, MIN(Encoder_NumThreads(params), num_points), TRUE, nullptr);
+
+   for (i=0;i<num_points;i++)
+   {
+      points[i].done = false;
+      g_thread_pool_push(pool, &points[i], nullptr);
+   }
+
+   // Waits for every queued point.
+   g_thread_pool_free(pool, FALSE, TRUE);
+
+   release_prepared(&p);
+
+   return !g_atomic_int_get(&state.failed) && !Cancelled(src_image_info->cancel);
 }
 
 
 
-bool serialize_decompress(void *buffer, int buffer_length_bytes, void *user_data)
+// -------------------------------------------------------------------------------------------------------
+//   Codestream layout
+// -------------------------------------------------------------------------------------------------------
+
+#define J2K_MS_SOC 0xff4f
+#define J2K_MS_SOT 0xff90
+#define J2K_MS_EOC 0xffd9
+
+
+static guint32 read_be16(const guint8 *p)
 {
-   Save_State *state = (Save_State *) user_data;
+   return (p[0] << 8) | p[1];
+}
 
-   state->preview_image_file_size = buffer_length_bytes;
 
-   // Decompress for use by preview display (actual update occurs in idle processing loop) unless another update is immediately required.
-   if (!__preview_update_required)
-	{
-		state->preview_image = decode_image(buffer, buffer_length_bytes, true);
-		return !!state->preview_image; // All ok if we get a decoded image.
-	}
+gsize Codestream_HeaderSize(const guint8 *data, gsize len)
+{
+   gsize pos = 2;
 
-   return true;
+   if ((len < 4) || (read_be16(data) != J2K_MS_SOC))
+      return 0;
+
+   while ((pos + 4 <= len) && (read_be16(data + pos) != J2K_MS_SOT))
+      pos += 2 + read_be16(data + pos + 2);
+
+   return MIN(pos, len) + 2;
 }
 
 
-// Keep GIMP SDK access to minimum from background thread as the API is not guarenteed thread safe.
-static void background_thread(void *user_data)
+
+// -------------------------------------------------------------------------------------------------------
+//   Layers, progression & save defaults
+// -------------------------------------------------------------------------------------------------------
+
+int Layers_Parse(const char *str, gdouble *values, int max_values)
 {
-   Save_State *state = (Save_State *) user_data;
+   gchar **tokens;
+   int i, n = 0;
 
-   while (!state->quit_preview_processing)
-   {
-      if (__preview_update_required && !state->preview_update_available)  // Don't create a new preview whilst previous one is still being processed.
-      {
-         __preview_update_required = FALSE;
+   if (!str)
+      return 0;
 
-         if (__save_params.preview_enabled)
-         {
-            // Serialize with current settings through decompressor to generate new preview image.
-            serialize_image(&(state->image_info), true, serialize_decompress, (void*) state);
+   tokens = g_strsplit_set(str, ", ;", -1);
 
-            state->preview_update_available = TRUE;
-         }
+   for (i=0; tokens[i] && n < max_values; i++)
+   {
+      gchar *end;
+      gdouble v;
 
-         state->preview_state_change = TRUE;
-      }
+      if (!*tokens[i])
+         continue;
+
+      v = g_ascii_strtod(tokens[i], &end);
 
-		if (!__preview_update_required)
-			usleep(1000);  // TODO: Determine optimal value.
+      if (end != tokens[i] && v > 0)
+         values[n++] = v;
    }
 
-   state->preview_thread_done = true;
+   g_strfreev(tokens);
 
-   // Terminate thread.
-   g_thread_exit(nullptr);
+   return n;
 }
 
 
-static void preview_prepare()
+// Inverse of Layers_Parse. values are divided by scale. Caller frees.
+char *Layers_Format(const gdouble *values, int num_values, gdouble scale)
 {
-  destroy_preview();
+   GString *str = g_string_new(nullptr);
+   gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+   int i;
 
-  if (__save_params.preview_enabled)
-  {
-      if (!undo_touched)
-      {
-          // Freeze undo saving to avoid sucking up tile cache with unnecessary preview steps.
-          gimp_image_undo_freeze(preview_image_ID);
-          undo_touched = TRUE;
-      }
+   for (i=0;i<num_values;i++)
+   {
+      if (i)
+         g_string_append(str, ",");
 
-      if (display_ID == -1)
-        display_ID = gimp_display_new(preview_image_ID);
-  }
-  else
-  {
-      gtk_label_set_text (GTK_LABEL (preview_file_size), "File size: unknown");
-      gimp_displays_flush();
+      g_string_append(str, g_ascii_formatd(buf, sizeof(buf), "%g", values[i] / scale));
    }
+
+   return g_string_free(str, FALSE);
 }
 
 
-// Idle processing occurs in main thread so we can safely use all GIMP SDK functionality here.
-static bool idle_save_preview_processing(void *user_data)
+// Export options -> layers. Quality values are 0 - 1 as the options give them.
+const char *Layers_Setup(Save_Parameters *params, gdouble quality, const char *layer_qualities, const char *layer_rates)
 {
-   Save_State *state = (Save_State *) user_data;
+   int i;
+
+   params->num_layers = Layers_Parse(layer_rates, params->rate, MAX_QUALITY_LAYERS);
+   params->layer_rates = params->num_layers > 0;
 
-   // Some item of state has changed so react accordingly.
-   if (state->preview_state_change)
+   if (!params->layer_rates)
    {
-      state->preview_state_change = FALSE;
-      
-		// Prepare for preview window update unless another update is coming though ...
-		if (!__preview_update_required)
-			preview_prepare();
+      params->num_layers = Layers_Parse(layer_qualities, params->quality, MAX_QUALITY_LAYERS);
+
+      for (i=0;i<params->num_layers;i++)
+         params->quality[i] *= QUALITY_MAX;
    }
 
-   if (state->preview_update_available)
+   if (params->num_layers == 0)
    {
-        // Update status.
-        gchar temp[128];
-		
-	    if (!__preview_update_required)
-			g_snprintf(temp, sizeof(temp), "File size: %02.01f kB", (gdouble) (state->preview_image_file_size) / 1024.0);
-		else
-			g_snprintf(temp, sizeof(temp), "File size:"); // If another update is coming through, wait for its size to avoid glitches (changes to discarded intermediate update values).
-		
-		gtk_label_set_text(GTK_LABEL(preview_file_size), temp);
-
-		// Copy new image into preview window ...
-		if (state->preview_image)
-		{
-			// ... unless a new preview has been requested.
-			if (!__preview_update_required)
-			{
-				if (__save_params.preview_enabled)
-					image_to_gimp(state->preview_image, nullptr, TRUE);
-			}
-
-			opj_image_destroy(state->preview_image);
-			state->preview_image = nullptr;
-		}
+      params->num_layers = 1;
+      params->quality[0] = quality * QUALITY_MAX;
+   }
 
-		// Skip flush if another update is being prepared.
-		if (!__preview_update_required)
-        {
-           gimp_displays_flush();
-           gdk_flush();
-		}
+   // Coarse to fine, every layer must add to the last : OpenJPEG rejects repeated or reordered rates, & only the final
+   // layer can be lossless.
+   for (i=1;i<params->num_layers;i++)
+   {
+      if (params->layer_rates && (params->rate[i-1] <= MAX(params->rate[i], 1.0)))
+         return "layer rates must decrease layer by layer, only the last may be 1 (lossless)";
 
-      // Mark current preview update as consumed - background thread can now generate new preview if required.
-      state->preview_update_available = FALSE;
+      if (!params->layer_rates && (params->quality[i-1] >= MIN(params->quality[i], QUALITY_MAX)))
+         return "layer qualities must increase layer by layer, only the last may be 1 (lossless)";
    }
 
-   return TRUE;
+   return nullptr;
 }
 
 
-bool interactive_save()
+static const char *progression_names[] = { "lrcp", "rlcp", "rpcl", "pcrl", "cprl" };
+
+const char *Progression_Name(OPJ_PROG_ORDER progression)
+{
+   return progression >= OPJ_LRCP && progression <= OPJ_CPRL ? progression_names[progression] : progression_names[OPJ_LRCP];
+}
+
+
+OPJ_PROG_ORDER Progression_FromName(const char *name)
 {
-   Save_State state;
-   memset(&state, 0, sizeof(Save_State));
+   int i;
 
-   save_dialog_initialize(&state);
+   for (i=OPJ_LRCP; name && i<=OPJ_CPRL; i++)
+   {
+      if (!g_ascii_strcasecmp(name, progression_names[i]))
+         return (OPJ_PROG_ORDER) i;
+   }
 
-   // TODO: We need to prepare the image data for access by preview code once if preview is enabled.
-   // OPT: Do this in the idle loop - create on demand. Configure preview thread to process only when src data available.
-   serialize_prepare(&(state.image_info), preview_image_ID, drawable_ID_global, orig_image_ID_global, TRUE);
+   return OPJ_LRCP;
+}
 
-   state.background_thread      = g_thread_create( (GThreadFunc) background_thread, (gpointer) &state , FALSE , nullptr);
-   state.preview_idle_fn_handle = g_idle_add( (GSourceFunc) idle_save_preview_processing, &state);
 
-   state.dialog_exit_code = FALSE;
+static const char *preset_names[NUM_PRESETS] = { "balanced", "fastest", "smallest" };
 
-   // Main processing loop executed continuously whilst dialog active.
-   gtk_main();
+const char *Preset_Name(Encoder_Preset preset)
+{
+   return preset_names[preset < NUM_PRESETS ? preset : PRESET_BALANCED];
+}
 
-   state.quit_preview_processing = TRUE;   // signal the background preview generation to stop.
 
-   int counter = 0;
+Encoder_Preset Preset_FromName(const char *name)
+{
+   int i;
 
-   // Wait for thread exit.
-   while (!state.preview_thread_done)
+   for (i=0; name && i<NUM_PRESETS; i++)
    {
-      usleep(1000); // TODO: Figure out optimal setting. This is a wild guess.
+      if (!g_ascii_strcasecmp(name, preset_names[i]))
+         return (Encoder_Preset) i;
+   }
 
-      // Diagnostics to console if thread exit takes longer than expected.
+   return PRESET_BALANCED;
+}
 
-      if (++counter > 1000)  // Wild guess - determine optimal setting.
-      {
-          printf("%s plugin : Waiting for background thread to terminate.\n", PLUG_IN_BINARY);
-          counter = 0;
 
-#if __ENABLE_PREVIEW_BACKGROUND_THREAD_EXIT_TIMEOUT
-          break; // Timeout & kill thread as it refuses to exit gracefully.
-#endif
-      }
+// Save defaults format : version preview_enabled progression layer_rates num_layers value...
+// Values are qualities or compression ratios, per layer_rates.
 
-   }
+bool SaveDefaults_Parse(const char *str, Save_Parameters *params)
+{
+  gchar  **param;
+  gdouble *values;
+  int i, n, version, num_layers;
 
+  param = g_strsplit(str, " ", -1);
+  n = g_strv_length(param);
+
+  version = n > 0 ? atoi(param[0]) : 0;
+
+  if (version != J2K_SAVE_DEFAULTS_VERSION || n < 5)
+  {
+     g_strfreev(param);
+     return false;
+  }
 
-   // TODO: Optionally kill thread if it refuses to exit gracefully after some timeout.
-   // Docs state that glib currently has no thread kill wrapper so use platform specific interfaces to implement.
+  params->preview_enabled = atoi(param[1]);
+  params->progression     = Progression_FromName(param[2]);
+  params->layer_rates     = atoi(param[3]);
 
+  num_layers = CLAMP(atoi(param[4]), 1, MAX_QUALITY_LAYERS);
 
-   // Background thread terminated, so we're idle processor can be terminated.
-   g_source_remove(state.preview_idle_fn_handle);
+  values = params->layer_rates ? params->rate : params->quality;
 
+  for (i=0;i<num_layers;i++)
+     values[i] = 5+i < n ? g_ascii_strtod(param[5+i], nullptr) : DEFAULT_QUALITY;
 
-   // Preview window processing complete so remove it.
-   destroy_preview();
+  params->num_layers = num_layers;
 
-   // Done with source image data copy.
-   if (state.image_info.data)
-      g_free(state.image_info.data);
+  g_strfreev(param);
 
-   return state.dialog_exit_code;
+  return true;
 }
 
-#endif
\ No newline at end of file
+
+char *SaveDefaults_Format(const Save_Parameters *params)
+{
+  int num_layers = CLAMP(params->num_layers, 1, MAX_QUALITY_LAYERS);
+  gchar *values = Layers_Format(params->layer_rates ? params->rate : params->quality, num_layers, 1.0);
+  gchar *def_str;
+
+  // Layers_Format separates with commas, the defaults with spaces.
+  g_strdelimit(values, ",", ' ');
+
+  def_str = g_strdup_printf("%d %d %s %d %d %s", J2K_SAVE_DEFAULTS_VERSION, params->preview_enabled, Progression_Name(params->progression),
+                            params->layer_rates, num_layers, values);
+
+  g_free(values);
+
+  return def_str;
+}
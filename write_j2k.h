@@ -30,16 +30,19 @@ Compiles on Windows (mingw64) and Linux.
 
 
 // Save configuration parameters.
-#define NUM_QUALITY_PARAMETERS 1
+#define MAX_QUALITY_LAYERS 20
 
 // Max quality = lossless.
 #define QUALITY_MAX      100
 #define DEFAULT_QUALITY  (QUALITY_MAX/2)
 #define DEFAULT_PREVIEW  TRUE
 
+// Tiled export : tile edge used when a streamed source doesn't specify one.
+#define DEFAULT_TILE_SIZE 1024
+
 // Save configuration version & id.
 #define J2K_DEFAULTS_PARASITE "j2k-save-defaults"
-#define J2K_SAVE_DEFAULTS_VERSION 2
+#define J2K_SAVE_DEFAULTS_VERSION 3
 
 // Save GUI configuration
 #define SCALE_WIDTH           125
@@ -47,60 +50,99 @@ Compiles on Windows (mingw64) and Linux.
 #define bool gboolean
 
 
+// Fetches an interleaved rectangle of source pixels (num_components samples per pixel, tightly packed) into dest.
+typedef bool (*Fetch_Region_CB)(guchar *dest, guint x, guint y, guint width, guint height, void *user_data);
+
+
 typedef struct
 {
    guint   width;
    guint   height;
    guint   num_components;
-   guchar *data;
+   guint   bytes_per_sample;    // 1 = u8, 2 = u16 in native byte order, encoded at the fewest bits (8 - 16) which keep it exact. 0 is treated as 1.
+   guchar *data;                // Whole image, interleaved. nullptr when the source is streamed through fetch.
+
+   Fetch_Region_CB fetch;       // Optional : pulls pixels on demand so the whole image is never held in memory.
+   void           *fetch_user_data;
+
+   const gint     *cancel;      // Optional : encoding is abandoned (fails) once *cancel becomes non zero.
 } Image_Info;
 
 
-typedef struct
+// Encoder presets : code-block coding options trading encode time against file size, whatever the quality settings.
+typedef enum
 {
-  bool dialog_exit_code;
+   PRESET_BALANCED,     // OpenJPEG's defaults : 6 resolutions, 64x64 code-blocks, every pass arithmetic coded, 5/3 wavelet.
+   PRESET_FASTEST,      // Selective arithmetic coding bypass of the low bit planes, 5 resolutions, 9/7 wavelet for lossy encodes.
+   PRESET_SMALLEST,     // 7 resolutions & the 9/7 wavelet for lossy encodes.
 
-  bool  quit_preview_processing;
-  bool  preview_update_available;
-  bool  preview_state_change;
-  bool  preview_thread_done;
-  guint preview_idle_fn_handle;
+   NUM_PRESETS
 
-  opj_image_t *preview_image;
+} Encoder_Preset;
 
-  guint preview_image_file_size;
 
-  GtkTextBuffer *text_buffer;
+typedef struct
+{
+   gint    num_layers;          // Quality layers, coarse to fine. 0 is treated as 1.
+   gdouble quality[MAX_QUALITY_LAYERS];  // Per layer quality. QUALITY_MAX = lossless.
+   gdouble rate[MAX_QUALITY_LAYERS];     // Per layer compression ratio. 1 = lossless.
+   bool    layer_rates;         // Layers set by rate rather than quality.
+   OPJ_PROG_ORDER progression;  // Packet order within the codestream.
+   bool    preview_enabled;
+   guint   tile_size;           // 0 = single tile (whole image encoded at once).
+   gint    num_threads;         // Encoder worker threads. 0 = automatic (all available cores).
+   guint64 target_size;         // Target output size in bytes, overrides quality. 0 = use quality.
+   Encoder_Preset preset;
+
+} Save_Parameters;
 
-  GtkWidget *slider_quality[NUM_QUALITY_PARAMETERS];  // Quality slider(s)
-  GtkWidget *checkbox_preview;                        // Show preview toggle checkbox
 
-  GThread *background_thread;  // Used for preview image generation. Done in seperate thread to keep UI responsive.
+typedef bool (*Serialize_CB)(void *buffer, int length, void *user_data);
 
-  Image_Info image_info;
+bool serialize_image(Image_Info *image_info, const Save_Parameters *params, bool format_codestream_only, Serialize_CB callback, void *user_data);
+bool serialize_image_to_file(Image_Info *image_info, const Save_Parameters *params, bool format_codestream_only, FILE *outfile);
 
-} Save_State;
+int  Encoder_NumThreads(const Save_Parameters *params);
 
+guint Image_BytesPerSample(const Image_Info *image_info);   // 1 or 2.
+guint Image_BytesPerPixel(const Image_Info *image_info);
 
 typedef struct
 {
-   gdouble quality[NUM_QUALITY_PARAMETERS];
-   bool    preview_enabled;
+   gdouble quality;             // Quality to encode at. QUALITY_MAX = lossless.
+   guint64 size;                // Encoded bytes.
+   gdouble psnr;                // dB against the source. HUGE_VAL when lossless. Only set when measure_psnr.
+   guint64 header_size;         // Main header & EOC bytes, which don't grow with the image.
+   bool    done;
 
-} Save_Parameters;
+} Sweep_Point;
 
-extern Save_Parameters save_params;
+// Called from a worker thread as each point completes.
+typedef void (*Sweep_CB)(Sweep_Point *point, void *user_data);
 
+bool serialize_sweep(Image_Info *image_info, const Save_Parameters *params, Sweep_Point *points, int num_points, bool measure_psnr,
+                     Sweep_CB callback, void *user_data);
 
-typedef bool (*Serialize_CB)(void *buffer, int length, void *user_data);
+// Bytes of the main header (SOC up to the first tile-part) plus EOC. 0 if data isn't a codestream.
+gsize Codestream_HeaderSize(const guint8 *data, gsize len);
+
+// Layer lists are comma or space separated values, coarse to fine.
+int   Layers_Parse(const char *str, gdouble *values, int max_values);
+char *Layers_Format(const gdouble *values, int num_values, gdouble scale);
+
+// Layers from the export options : layer_rates override layer_qualities, both empty = a single layer at quality (0 - 1).
+// Returns nullptr, or why the layers can't be encoded - repeated, out of order, or lossless before the last.
+const char *Layers_Setup(Save_Parameters *params, gdouble quality, const char *layer_qualities, const char *layer_rates);
 
-bool serialize_file(void *buffer, int length, void *user_data);
+const char    *Progression_Name(OPJ_PROG_ORDER progression);
+OPJ_PROG_ORDER Progression_FromName(const char *name);
 
-bool serialize_prepare(Image_Info *si, gint32 image_ID, gint32 drawable_ID, gint32 orig_image_ID, bool preview);
-bool serialize_image(Image_Info *image_info, bool format_codestream_only, Serialize_CB callback, void *user_data);
+const char    *Preset_Name(Encoder_Preset preset);
+Encoder_Preset Preset_FromName(const char *name);
 
-bool interactive_save();
-void get_save_defaults();
+// Settings remembered between exports, as a string (kept in a GIMP parasite by the plug-in). Caller frees.
+bool  SaveDefaults_Parse(const char *str, Save_Parameters *params);
+char *SaveDefaults_Format(const Save_Parameters *params);
 
 
 #endif